@@ -0,0 +1,80 @@
+#ifndef AOT_RUNTIME_H_INCLUDED
+#define AOT_RUNTIME_H_INCLUDED
+
+//support of the C++ code emitted by aot_translator: link it with memory_manager.cpp and pool_allocator.cpp,
+//and define FREEFOIL_AOT_MAIN to get a main() running the program
+
+#include "memory_manager.h"
+#include "builtins.h"
+#include "exceptions.h"
+
+#include <iostream>
+
+#if defined(__unix__)
+#include <sys/resource.h>
+#endif
+
+#include <boost/lexical_cast.hpp>
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        //any value of the language, as a slot of the VM stack holds it
+        union aot_item {
+            gcobject *gcobj_;
+            int   i_;
+            float f_;
+        };
+
+        inline int aot_idiv(const int value1, const int value2) {
+            if (value2 == 0) {
+                throw freefoil_exception("runtime exception: division by zero");
+            }
+            return value1 / value2;
+        }
+
+        inline float aot_fdiv(const float value1, const float value2) {
+            if (value2 == 0.0) {
+                throw freefoil_exception("runtime exception: division by zero");
+            }
+            return value1 / value2;
+        }
+
+        //the lowest native stack address the translated functions may reach, so that a runaway recursion ends with
+        //the same error as in the VM instead of a crash
+        inline const char *&aot_stack_limit() {
+            static const char *limit = NULL;
+            return limit;
+        }
+
+        //sets the limit relative to the caller's native stack position
+        inline void aot_init_stack_limit() {
+            std::size_t size = 1024 * 1024;
+#if defined(__unix__)
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_STACK, &limit) == 0 and limit.rlim_cur != RLIM_INFINITY) {
+                size = limit.rlim_cur;
+            } else {
+                size = 8 * 1024 * 1024;
+            }
+#endif
+            static const std::size_t reserve = 256 * 1024; //left for the builtins and for throwing the exception
+            const char here = 0;
+            aot_stack_limit() = &here - (size > 2 * reserve ? size - reserve : size / 2);
+        }
+
+        inline void aot_check_stack() {
+            const char here = 0;
+            if (&here < aot_stack_limit()) {
+                throw freefoil_exception("stack overflow");
+            }
+        }
+
+        inline void aot_wrong_opcode(const int opcode) {
+            throw freefoil_exception("wrong opcode: " + boost::lexical_cast<string>(opcode));
+        }
+    }
+}
+
+#endif // AOT_RUNTIME_H_INCLUDED
@@ -0,0 +1,503 @@
+#include "aot_translator.h"
+#include "opcodes.h"
+#include "builtins.h"
+
+#include <sstream>
+#include <cstdio>
+
+#include <boost/lexical_cast.hpp>
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using namespace Private;
+
+        static const int NOT_REACHED = -1;
+
+        static string slot(const int depth) {
+            return "s" + boost::lexical_cast<string>(depth);
+        }
+
+        static string float_literal(const float value) {
+            std::ostringstream os;
+            os.precision(9); //enough for every float to read back the same
+            os << value;
+            string text = os.str();
+            if (text.find_first_of(".e") == string::npos) {
+                text += ".0";
+            }
+            return text + "f";
+        }
+
+        static string string_literal(const char *value) {
+            string text = "\"";
+            for (const char *c = value; *c != '\0'; ++c) {
+                if (*c == '"' or *c == '\\' or *c == '?') { //'?' might start a trigraph
+                    text += '\\';
+                    text += *c;
+                } else if (static_cast<unsigned char>(*c) < ' ' or static_cast<unsigned char>(*c) >= 0x7F) {
+                    char escaped[8];
+                    std::sprintf(escaped, "\\%03o", static_cast<unsigned char>(*c));
+                    text += escaped;
+                } else {
+                    text += *c;
+                }
+            }
+            return text + "\"";
+        }
+
+        //the C++ operator of the compare and branch instructions, all of which compare the deeper value with the upper one
+        static const char *compare_operator(const int opcode) {
+            switch (opcode) {
+            case OPCODE_ifeq:
+                return "==";
+            case OPCODE_ifneq:
+                return "!=";
+            case OPCODE_ifleq:
+                return "<=";
+            case OPCODE_ifgeq:
+                return ">=";
+            case OPCODE_ifgreater:
+                return ">";
+            default:
+                assert(opcode == OPCODE_ifless);
+                return "<";
+            }
+        }
+
+        aot_translator::aot_translator(const program_entry &program)
+            :program_(program) {
+        }
+
+        bool aot_translator::fail(const string &func_name, const string &msg) {
+            error_ = func_name + ": " + msg;
+            return false;
+        }
+
+        string aot_translator::function_name(const std::size_t func_index) const {
+            return "f" + boost::lexical_cast<string>(func_index) + "_" + program_.user_funcs_[func_index].name_;
+        }
+
+        //params are addressed from 1 up, locals from -1 down
+        string aot_translator::variable(const int offset) const {
+            return (offset > 0 ? "p" : "l") + boost::lexical_cast<string>(offset > 0 ? offset : -offset);
+        }
+
+        //how many values the opcode pops and then pushes; for jz and jnz the effect on the fall through path
+        bool aot_translator::get_stack_effect(const int opcode, const BYTE *operands, int &pops, int &pushes) const {
+            switch (opcode) {
+            case OPCODE_iload:
+            case OPCODE_fload:
+            case OPCODE_sload:
+            case OPCODE_iload_const:
+            case OPCODE_fload_const:
+            case OPCODE_sload_const:
+            case OPCODE_push_true:
+            case OPCODE_push_false:
+                pops = 0;
+                pushes = 1;
+                return true;
+            case OPCODE_isave:
+            case OPCODE_fsave:
+            case OPCODE_ssave:
+            case OPCODE_jz:
+            case OPCODE_jnz:
+            case OPCODE_pop:
+            case OPCODE_iret:
+            case OPCODE_fret:
+            case OPCODE_sret:
+                pops = 1;
+                pushes = 0;
+                return true;
+            case OPCODE_iadd:
+            case OPCODE_fadd:
+            case OPCODE_sadd:
+            case OPCODE_isub:
+            case OPCODE_fsub:
+            case OPCODE_imul:
+            case OPCODE_fmul:
+            case OPCODE_idiv:
+            case OPCODE_fdiv:
+            case OPCODE_xor:
+            case OPCODE_seq:
+            case OPCODE_scmp:
+                pops = 2;
+                pushes = 1;
+                return true;
+            case OPCODE_inegate:
+            case OPCODE_fnegate:
+            case OPCODE_b2str:
+            case OPCODE_b2f:
+            case OPCODE_f2i:
+            case OPCODE_i2str:
+            case OPCODE_i2f:
+                pops = 1;
+                pushes = 1;
+                return true;
+            case OPCODE_ifeq:
+            case OPCODE_ifneq:
+            case OPCODE_ifleq:
+            case OPCODE_ifgeq:
+            case OPCODE_ifgreater:
+            case OPCODE_ifless:
+                pops = 2;
+                pushes = 0;
+                return true;
+            case OPCODE_jmp:
+            case OPCODE_halt:
+            case OPCODE_ret:
+                pops = 0;
+                pushes = 0;
+                return true;
+            case OPCODE_call:
+            case OPCODE_tailcall: {
+                const std::size_t func_index = static_cast<unsigned char>(operands[0]);
+                if (func_index >= program_.user_funcs_.size()) {
+                    return false;
+                }
+                pops = program_.user_funcs_[func_index].args_count_;
+                pushes = program_.user_funcs_[func_index].void_type_ ? 0 : 1;
+                return true;
+            }
+            case OPCODE_builtin_call:
+                if (static_cast<unsigned char>(operands[0]) > BUILTIN_print_string) {
+                    return false; //the fiber, I/O and parallel builtins need the stack VM
+                }
+                pops = 1; //every builtin takes one arg and returns nothing
+                pushes = 0;
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        bool aot_translator::get_depths(const function_template &func, vector<int> &depths) {
+            const instructions_stream_t &instructions = func.instructions_;
+            depths.assign(instructions.size(), NOT_REACHED);
+
+            vector<std::size_t> pending;
+            depths[0] = 0;
+            pending.push_back(0);
+            while (!pending.empty()) {
+                const std::size_t pos = pending.back();
+                pending.pop_back();
+
+                const int opcode = instructions[pos];
+                const int operands_count = get_operands_count(opcode);
+                const BYTE *operands = &instructions[pos + 1];
+
+                const superinstruction *fused = find_superinstruction(opcode);
+                const int *parts = fused != NULL ? fused->pattern_ : &opcode;
+                const std::size_t parts_count = fused != NULL ? fused->length_ : 1;
+
+                int depth = depths[pos];
+                for (std::size_t i = 0; i < parts_count; ++i) {
+                    int pops, pushes;
+                    if (!get_stack_effect(parts[i], operands, pops, pushes)) {
+                        return fail(func.name_, "wrong opcode " + boost::lexical_cast<string>(parts[i]));
+                    }
+                    depth += pushes - pops;
+                    operands += get_operands_count(parts[i]);
+                }
+
+                const int last_part = parts[parts_count - 1];
+                if (is_branch(opcode)) {
+                    const std::size_t dst_pos = pos + operands_count + instructions[pos + operands_count];
+                    if (depths[dst_pos] == NOT_REACHED) {
+                        //jz and jnz leave the tested value on the stack when they jump
+                        depths[dst_pos] = (last_part == OPCODE_jz or last_part == OPCODE_jnz) ? depth + 1 : depth;
+                        pending.push_back(dst_pos);
+                    }
+                }
+                switch (last_part) {
+                case OPCODE_jmp:
+                case OPCODE_halt:
+                case OPCODE_ret:
+                case OPCODE_iret:
+                case OPCODE_fret:
+                case OPCODE_sret:
+                case OPCODE_tailcall:
+                    break;
+                default:
+                    if (depths[pos + 1 + operands_count] == NOT_REACHED) {
+                        depths[pos + 1 + operands_count] = depth;
+                        pending.push_back(pos + 1 + operands_count);
+                    }
+                    break;
+                }
+            }
+            return true;
+        }
+
+        void aot_translator::translate_instruction(std::ostream &os, const int opcode, const BYTE *operands, const std::size_t dst_pos, int &depth) const {
+            const constants_pool &constants = program_.constants_pool_;
+            const string top = slot(depth - 1);
+            const string second = slot(depth - 2);
+            const string label = "L" + boost::lexical_cast<string>(dst_pos);
+
+            os << "        ";
+            switch (opcode) {
+            case OPCODE_iload:
+            case OPCODE_fload:
+            case OPCODE_sload:
+                os << slot(depth) << " = " << variable(operands[0]) << ";\n";
+                break;
+            case OPCODE_isave:
+                os << variable(operands[0]) << ".i_ = " << top << ".i_;\n";
+                break;
+            case OPCODE_fsave:
+                os << variable(operands[0]) << ".f_ = " << top << ".f_;\n";
+                break;
+            case OPCODE_ssave:
+                os << variable(operands[0]) << ".gcobj_ = " << top << ".gcobj_;\n";
+                break;
+            case OPCODE_iload_const:
+                os << slot(depth) << ".i_ = " << constants.get_int_value_from_table(operands[0]) << ";\n";
+                break;
+            case OPCODE_fload_const:
+                os << slot(depth) << ".f_ = " << float_literal(constants.get_float_value_from_table(operands[0])) << ";\n";
+                break;
+            case OPCODE_sload_const:
+                os << slot(depth) << ".gcobj_ = string_constants[" << static_cast<int>(operands[0]) << "];\n";
+                break;
+            case OPCODE_iadd:
+                os << second << ".i_ = " << second << ".i_ + " << top << ".i_;\n";
+                break;
+            case OPCODE_isub:
+                os << second << ".i_ = " << second << ".i_ - " << top << ".i_;\n";
+                break;
+            case OPCODE_imul:
+                os << second << ".i_ = " << second << ".i_ * " << top << ".i_;\n";
+                break;
+            case OPCODE_idiv:
+                os << second << ".i_ = aot_idiv(" << second << ".i_, " << top << ".i_);\n";
+                break;
+            case OPCODE_fadd:
+                os << second << ".f_ = " << second << ".f_ + " << top << ".f_;\n";
+                break;
+            case OPCODE_fsub:
+                os << second << ".f_ = " << second << ".f_ - " << top << ".f_;\n";
+                break;
+            case OPCODE_fmul:
+                os << second << ".f_ = " << second << ".f_ * " << top << ".f_;\n";
+                break;
+            case OPCODE_fdiv:
+                os << second << ".f_ = aot_fdiv(" << second << ".f_, " << top << ".f_);\n";
+                break;
+            case OPCODE_sadd:
+                os << second << ".gcobj_ = heap.concat(" << second << ".gcobj_, " << top << ".gcobj_);\n";
+                break;
+            case OPCODE_seq:
+                os << second << ".i_ = heap.equal_strings(*" << second << ".gcobj_, *" << top << ".gcobj_) ? 1 : 0;\n";
+                break;
+            case OPCODE_scmp:
+                os << second << ".i_ = heap.compare_strings(*" << second << ".gcobj_, *" << top << ".gcobj_);\n";
+                break;
+            case OPCODE_inegate:
+                os << top << ".i_ = -" << top << ".i_;\n";
+                break;
+            case OPCODE_fnegate:
+                os << top << ".f_ = -" << top << ".f_;\n";
+                break;
+            case OPCODE_f2i:
+                os << top << ".i_ = static_cast<int>(" << top << ".f_);\n";
+                break;
+            case OPCODE_i2f:
+                os << top << ".f_ = static_cast<float>(" << top << ".i_);\n";
+                break;
+            case OPCODE_push_true:
+            case OPCODE_push_false:
+                os << slot(depth) << ".i_ = " << (opcode == OPCODE_push_true ? 1 : 0) << ";\n";
+                break;
+            case OPCODE_jmp:
+                os << "goto " << label << ";\n";
+                break;
+            case OPCODE_jz:
+            case OPCODE_jnz: //the tested value stays on the stack when the jump is taken
+                os << "if (" << top << ".i_ == " << (opcode == OPCODE_jz ? 0 : 1) << ") goto " << label << ";\n";
+                break;
+            case OPCODE_ifeq:
+            case OPCODE_ifneq:
+            case OPCODE_ifleq:
+            case OPCODE_ifgeq:
+            case OPCODE_ifgreater:
+            case OPCODE_ifless:
+                os << "if (" << second << ".i_ " << compare_operator(opcode) << " " << top << ".i_) goto " << label << ";\n";
+                break;
+            case OPCODE_pop:
+                os << "//pop\n";
+                break;
+            case OPCODE_call:
+            case OPCODE_tailcall: {
+                const std::size_t func_index = static_cast<unsigned char>(operands[0]);
+                const function_template &callee = program_.user_funcs_[func_index];
+                std::ostringstream call;
+                call << function_name(func_index) << "(";
+                //the first param is on top of the stack
+                for (int i = 0; i < callee.args_count_; ++i) {
+                    call << (i > 0 ? ", " : "") << slot(depth - 1 - i);
+                }
+                call << ")";
+                if (opcode == OPCODE_tailcall) {
+                    os << "return " << call.str() << ";\n";
+                } else if (callee.void_type_) {
+                    os << call.str() << ";\n";
+                } else {
+                    os << slot(depth - callee.args_count_) << " = " << call.str() << ";\n";
+                }
+                break;
+            }
+            case OPCODE_builtin_call:
+                switch (operands[0]) {
+                case BUILTIN_print_int:
+                    os << "builtin_print_int(" << top << ".i_);\n";
+                    break;
+                case BUILTIN_print_float:
+                    os << "builtin_print_float(" << top << ".f_);\n";
+                    break;
+                case BUILTIN_print_bool:
+                    os << "builtin_print_bool(" << top << ".i_);\n";
+                    break;
+                default:
+                    assert(operands[0] == BUILTIN_print_string);
+                    os << "builtin_print_string(heap, *" << top << ".gcobj_);\n";
+                    break;
+                }
+                break;
+            case OPCODE_ret:
+                os << "return aot_item();\n";
+                break;
+            case OPCODE_iret:
+            case OPCODE_fret:
+            case OPCODE_sret:
+                os << "return " << top << ";\n";
+                break;
+            case OPCODE_halt:
+                os << "return aot_item();\n";
+                break;
+            default:
+                //xor and the conversions to strings, none of which the stack VM runs yet
+                os << "aot_wrong_opcode(" << opcode << ");\n";
+                break;
+            }
+
+            int pops = 0, pushes = 0;
+            get_stack_effect(opcode, operands, pops, pushes);
+            depth += pushes - pops;
+        }
+
+        bool aot_translator::translate_function(std::ostream &os, const std::size_t func_index) {
+            const function_template &func = program_.user_funcs_[func_index];
+            const instructions_stream_t &instructions = func.instructions_;
+
+            vector<int> depths;
+            if (!get_depths(func, depths)) {
+                return false;
+            }
+            vector<bool> is_jump_dst(instructions.size(), false);
+            for (std::size_t pos = 0; pos < instructions.size(); pos += 1 + get_operands_count(instructions[pos])) {
+                if (is_branch(instructions[pos])) {
+                    const int operands_count = get_operands_count(instructions[pos]);
+                    is_jump_dst[pos + operands_count + instructions[pos + operands_count]] = true;
+                }
+            }
+
+            os << "    aot_item " << function_name(func_index) << "(";
+            for (int i = 1; i <= func.args_count_; ++i) {
+                os << (i > 1 ? ", " : "") << "aot_item " << variable(i);
+            }
+            os << ") {\n";
+            for (int i = 1; i <= func.locals_count_; ++i) {
+                os << (i == 1 ? "        aot_item " : ", ") << variable(-i) << (i == func.locals_count_ ? ";\n" : "");
+            }
+            for (std::size_t i = 0; i < func.max_stack_depth_; ++i) {
+                os << (i == 0 ? "        aot_item " : ", ") << slot(i) << (i + 1 == func.max_stack_depth_ ? ";\n" : "");
+            }
+            os << "        aot_check_stack();\n";
+
+            for (std::size_t pos = 0; pos < instructions.size(); pos += 1 + get_operands_count(instructions[pos])) {
+                if (depths[pos] == NOT_REACHED) {
+                    continue;
+                }
+                if (is_jump_dst[pos]) {
+                    os << "    L" << pos << ":\n";
+                }
+
+                const int opcode = instructions[pos];
+                const int operands_count = get_operands_count(opcode);
+                const std::size_t dst_pos = is_branch(opcode) ? pos + operands_count + instructions[pos + operands_count] : 0;
+
+                //fused instructions are translated as their parts
+                const superinstruction *fused = find_superinstruction(opcode);
+                const int *parts = fused != NULL ? fused->pattern_ : &opcode;
+                const std::size_t parts_count = fused != NULL ? fused->length_ : 1;
+
+                const BYTE *operands = &instructions[pos + 1];
+                int depth = depths[pos];
+                for (std::size_t i = 0; i < parts_count; ++i) {
+                    translate_instruction(os, parts[i], operands, dst_pos, depth);
+                    operands += get_operands_count(parts[i]);
+                }
+            }
+            os << "    }\n\n";
+            return true;
+        }
+
+        bool aot_translator::translate(std::ostream &os, const string &entry_name) {
+            std::ostringstream unit;
+
+            unit << "//translated from the freefoil bytecode by aot_translator\n\n";
+            unit << "#include \"aot_runtime.h\"\n\n";
+            unit << "namespace {\n\n";
+            unit << "    using namespace Freefoil::Runtime;\n\n";
+            //the heap of the program, which never collects, as the translated functions keep the objects in C++ locals
+            unit << "    memory_manager heap;\n\n";
+            //made once, before the program runs, as freefoil_vm makes its constants
+            const constants_pool &constants = program_.constants_pool_;
+            if (constants.get_string_constants_count() != 0) {
+                unit << "    gcobject *string_constants[" << constants.get_string_constants_count() << "];\n\n";
+            }
+            for (std::size_t i = 0; i < program_.user_funcs_.size(); ++i) {
+                const function_template &func = program_.user_funcs_[i];
+                unit << "    aot_item " << function_name(i) << "(";
+                for (int j = 1; j <= func.args_count_; ++j) {
+                    unit << (j > 1 ? ", " : "") << "aot_item";
+                }
+                unit << ");\n";
+            }
+            unit << "\n";
+            for (std::size_t i = 0; i < program_.user_funcs_.size(); ++i) {
+                if (!translate_function(unit, i)) {
+                    return false;
+                }
+            }
+            unit << "}\n\n";
+
+            //as freefoil_vm::exec() runs the entry point
+            unit << "void " << entry_name << "() {\n";
+            unit << "    using namespace Freefoil::Runtime;\n";
+            unit << "    aot_init_stack_limit();\n";
+            for (std::size_t i = 0; i < constants.get_string_constants_count(); ++i) {
+                unit << "    string_constants[" << i << "] = heap.make_old_string(" << string_literal(constants.get_string_value_from_table(i)) << ");\n";
+            }
+            unit << "    try {\n";
+            unit << "        " << function_name(program_.entry_point_func_index_) << "();\n";
+            unit << "    } catch (const std::exception &e) {\n";
+            unit << "        std::cout << e.what() << std::endl;\n";
+            unit << "    }\n";
+            unit << "}\n\n";
+
+            unit << "#if defined(FREEFOIL_AOT_MAIN)\n";
+            unit << "int main() {\n";
+            unit << "    " << entry_name << "();\n";
+            unit << "    std::cout << std::endl;\n";
+            unit << "    return 0;\n";
+            unit << "}\n";
+            unit << "#endif\n";
+
+            os << unit.str();
+            return true;
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef AOT_TRANSLATOR_H_INCLUDED
+#define AOT_TRANSLATOR_H_INCLUDED
+
+#include "runtime.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::string;
+        using std::vector;
+
+        //ahead of time translator of a program into a C++ translation unit: every user function becomes a C++ function,
+        //its params, locals and operand stack slots become C++ locals, and calls become direct calls. The unit includes
+        //aot_runtime.h and links with memory_manager.cpp; it behaves as the stack VM running the program does.
+        class aot_translator {
+
+            const program_entry &program_;
+            string error_;
+
+            //operand stack depth before every instruction, as the bytecode verifier computes it
+            bool get_depths(const function_template &func, vector<int> &depths);
+            bool get_stack_effect(const int opcode, const BYTE *operands, int &pops, int &pushes) const;
+
+            bool translate_function(std::ostream &os, const std::size_t func_index);
+            void translate_instruction(std::ostream &os, const int opcode, const BYTE *operands, const std::size_t dst_pos, int &depth) const;
+            string function_name(const std::size_t func_index) const;
+            string variable(const int offset) const;
+            bool fail(const string &func_name, const string &msg);
+        public:
+            explicit aot_translator(const program_entry &program);
+
+            //writes the unit, whose entry_name() function runs the program
+            bool translate(std::ostream &os, const string &entry_name);
+
+            const string &get_error() const {
+                return error_;
+            }
+        };
+    }
+}
+
+#endif // AOT_TRANSLATOR_H_INCLUDED
@@ -0,0 +1,312 @@
+#include "batch_pool.h"
+#include "exceptions.h"
+
+#include <deque>
+#include <exception>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+#include <unistd.h>
+#endif
+
+namespace Freefoil {
+    namespace Runtime {
+
+        namespace {
+            using boost::posix_time::ptime;
+            using boost::posix_time::microsec_clock;
+
+            std::size_t elapsed_us(const ptime &start) {
+                return static_cast<std::size_t>((microsec_clock::universal_time() - start).total_microseconds());
+            }
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            std::size_t get_processors_count() {
+                const long count = sysconf(_SC_NPROCESSORS_ONLN);
+                return count > 0 ? static_cast<std::size_t>(count) : 1;
+            }
+#endif
+        }
+
+        struct batch_pool::worker {
+            batch_pool *pool_;
+            std::size_t index_;
+            std::deque<std::size_t> jobs_; //the job indices; the worker takes its own from the back, the others steal from the front
+            std::size_t jobs_stolen_;      //by the worker, in the current batch
+
+            //by the ids of the programs, as a freed program may leave its address to another one
+            typedef std::pair<std::size_t, shared_ptr<freefoil_vm> > cached_vm_t;
+            vector<cached_vm_t> vms_; //the VMs of the programs run last, the latest one first
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            pthread_mutex_t mutex_; //of the jobs
+            pthread_t thread_;
+#endif
+
+            worker(batch_pool *pool, const std::size_t index)
+                :pool_(pool), index_(index), jobs_stolen_(0) {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+                pthread_mutex_init(&mutex_, NULL);
+#endif
+            }
+
+            ~worker() {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+                pthread_mutex_destroy(&mutex_);
+#endif
+            }
+
+            void lock() {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+                pthread_mutex_lock(&mutex_);
+#endif
+            }
+
+            void unlock() {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+                pthread_mutex_unlock(&mutex_);
+#endif
+            }
+
+            //the VM the worker runs the program on; a new one takes the place of the one used longest ago
+            freefoil_vm &get_vm(const program_entry &program, const std::size_t jit_threshold) {
+                vector<cached_vm_t>::iterator iter = vms_.begin();
+                while (iter != vms_.end() and iter->first != program.get_id()) {
+                    ++iter;
+                }
+                cached_vm_t found;
+                if (iter != vms_.end()) {
+                    found = *iter;
+                    vms_.erase(iter);
+                } else {
+                    if (vms_.size() == MAX_CACHED_VMS) {
+                        vms_.pop_back();
+                    }
+                    found = cached_vm_t(program.get_id(), shared_ptr<freefoil_vm>(new freefoil_vm(program, default_dispatch_mode, true, jit_threshold)));
+                    found.second->batch_worker_ = true;
+                }
+                vms_.insert(vms_.begin(), found);
+                return *found.second;
+            }
+
+            //a VM is dropped once a run fails, as the run may have left it in any state
+            void drop_vm(const program_entry &program) {
+                if (!vms_.empty() and vms_.front().first == program.get_id()) {
+                    vms_.erase(vms_.begin());
+                }
+            }
+        };
+
+        batch_pool::batch_pool(const std::size_t workers_count, const std::size_t jit_threshold)
+            :jit_threshold_(jit_threshold), report_(NULL) {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            const std::size_t count = workers_count == 0 ? get_processors_count() : workers_count;
+#else
+            (void) workers_count;
+            const std::size_t count = 1;
+#endif
+            for (std::size_t i = 0; i < count; ++i) {
+                workers_.push_back(worker_shared_ptr(new worker(this, i)));
+            }
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            pthread_mutex_init(&mutex_, NULL);
+            pthread_cond_init(&start_, NULL);
+            pthread_cond_init(&done_, NULL);
+            batches_started_ = 0;
+            busy_workers_ = 0;
+            stopping_ = false;
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                if (pthread_create(&workers_[i]->thread_, NULL, &batch_pool::worker_entry, workers_[i].get()) != 0) {
+                    workers_.resize(i);
+                    stop();
+                    throw freefoil_exception("can't start the batch workers");
+                }
+            }
+#endif
+        }
+
+        batch_pool::~batch_pool() {
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            stop();
+#endif
+        }
+
+        std::size_t batch_pool::add_job(const program_entry &program, const vector<batch_argument> &args) {
+            job new_job;
+            new_job.program_ = &program;
+            new_job.args_ = args;
+            new_job.range_ = false;
+            new_job.func_index_ = 0;
+            new_job.lo_ = new_job.hi_ = 0;
+            jobs_.push_back(new_job);
+            return jobs_.size() - 1;
+        }
+
+        std::size_t batch_pool::add_range_job(const program_entry &program, const std::size_t func_index, const int lo, const int hi) {
+            job new_job;
+            new_job.program_ = &program;
+            new_job.range_ = true;
+            new_job.func_index_ = func_index;
+            new_job.lo_ = lo;
+            new_job.hi_ = hi;
+            jobs_.push_back(new_job);
+            return jobs_.size() - 1;
+        }
+
+        void batch_pool::run(batch_report &report) {
+            report = batch_report();
+            report.results_.resize(jobs_.size());
+            report_ = &report;
+
+            //the workers are idle, so their queues are filled without locking
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                worker &w = *workers_[i];
+                w.jobs_stolen_ = 0;
+                for (std::size_t job_index = jobs_.size() * i / workers_.size(); job_index < jobs_.size() * (i + 1) / workers_.size(); ++job_index) {
+                    w.jobs_.push_back(job_index);
+                }
+            }
+
+            const ptime start = microsec_clock::universal_time();
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            pthread_mutex_lock(&mutex_);
+            busy_workers_ = workers_.size();
+            ++batches_started_;
+            pthread_cond_broadcast(&start_);
+            while (busy_workers_ != 0) {
+                pthread_cond_wait(&done_, &mutex_);
+            }
+            pthread_mutex_unlock(&mutex_);
+#else
+            run_jobs(*workers_.front());
+#endif
+            report.total_us_ = elapsed_us(start);
+
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                report.jobs_stolen_ += workers_[i]->jobs_stolen_;
+            }
+            jobs_.clear();
+            report_ = NULL;
+        }
+
+        //no job is added while a batch runs, so once every queue is found empty the worker is done
+        bool batch_pool::take_job(worker &w, std::size_t &job_index) {
+            w.lock();
+            if (!w.jobs_.empty()) {
+                job_index = w.jobs_.back();
+                w.jobs_.pop_back();
+                w.unlock();
+                return true;
+            }
+            w.unlock();
+
+            for (std::size_t i = 1; i < workers_.size(); ++i) {
+                worker &victim = *workers_[(w.index_ + i) % workers_.size()];
+                victim.lock();
+                if (!victim.jobs_.empty()) {
+                    job_index = victim.jobs_.front();
+                    victim.jobs_.pop_front();
+                    victim.unlock();
+                    ++w.jobs_stolen_;
+                    return true;
+                }
+                victim.unlock();
+            }
+            return false;
+        }
+
+        void batch_pool::run_job(worker &w, const std::size_t job_index) {
+            const job &the_job = jobs_[job_index];
+            batch_job_result &result = report_->results_[job_index];
+            result.worker_ = w.index_;
+
+            const ptime start = microsec_clock::universal_time();
+            if (!the_job.range_) {
+                //the job fails before it takes a VM, which the run would reject the arguments with too
+                vector<value_type_t> arg_types;
+                for (vector<batch_argument>::const_iterator arg_iter = the_job.args_.begin(); arg_iter != the_job.args_.end(); ++arg_iter) {
+                    arg_types.push_back(arg_iter->get_value_type());
+                }
+                result.error_ = freefoil_vm::check_arg_types("the entry point", the_job.program_->get_param_types(), arg_types);
+                if (!result.error_.empty()) {
+                    result.latency_us_ = elapsed_us(start);
+                    return;
+                }
+            }
+            try {
+                freefoil_vm &vm = w.get_vm(*the_job.program_, jit_threshold_);
+                if (the_job.range_) {
+                    result.sum_ = vm.sum_range(the_job.func_index_, the_job.lo_, the_job.hi_);
+                } else {
+                    vector<freefoil_vm::value> args;
+                    for (vector<batch_argument>::const_iterator arg_iter = the_job.args_.begin(); arg_iter != the_job.args_.end(); ++arg_iter) {
+                        args.push_back(arg_iter->make_value(vm));
+                    }
+                    vm.run(args);
+                }
+                result.succeeded_ = true;
+            } catch (const std::exception &e) {
+                result.error_ = e.what();
+            } catch (...) {
+                result.error_ = "unknown exception";
+            }
+            if (!result.succeeded_) {
+                w.drop_vm(*the_job.program_);
+            }
+            result.latency_us_ = elapsed_us(start);
+        }
+
+        void batch_pool::run_jobs(worker &w) {
+            std::size_t job_index;
+            while (take_job(w, job_index)) {
+                run_job(w, job_index);
+            }
+        }
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+        void batch_pool::stop() {
+            pthread_mutex_lock(&mutex_);
+            stopping_ = true;
+            pthread_cond_broadcast(&start_);
+            pthread_mutex_unlock(&mutex_);
+            for (std::size_t i = 0; i < workers_.size(); ++i) {
+                pthread_join(workers_[i]->thread_, NULL);
+            }
+            workers_.clear();
+            pthread_cond_destroy(&done_);
+            pthread_cond_destroy(&start_);
+            pthread_mutex_destroy(&mutex_);
+        }
+
+        void *batch_pool::worker_entry(void *w) {
+            worker * const self = static_cast<worker *>(w);
+            self->pool_->work(*self);
+            return NULL;
+        }
+
+        void batch_pool::work(worker &w) {
+            std::size_t batches_done = 0;
+            pthread_mutex_lock(&mutex_);
+            for (;;) {
+                while (batches_started_ == batches_done and !stopping_) {
+                    pthread_cond_wait(&start_, &mutex_);
+                }
+                if (stopping_) {
+                    break;
+                }
+                batches_done = batches_started_;
+
+                pthread_mutex_unlock(&mutex_);
+                run_jobs(w);
+                pthread_mutex_lock(&mutex_);
+                if (--busy_workers_ == 0) {
+                    pthread_cond_signal(&done_);
+                }
+            }
+            pthread_mutex_unlock(&mutex_);
+        }
+#endif
+    }
+}
@@ -0,0 +1,187 @@
+#ifndef BATCH_POOL_H_INCLUDED
+#define BATCH_POOL_H_INCLUDED
+
+#include "freefoil_vm.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+//the batch jobs run on POSIX threads;
+//define FREEFOIL_NO_PARALLEL_BATCH to run them one by one on the thread calling run() instead
+#if defined(__unix__) && defined(__GNUC__) && !defined(FREEFOIL_NO_PARALLEL_BATCH)
+#define FREEFOIL_PARALLEL_BATCH
+#endif
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+#include <pthread.h>
+#endif
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::vector;
+        using std::string;
+        using boost::shared_ptr;
+
+        //an argument of the entry point of a batch job; a string is made in the heap of the VM which runs the job
+        struct batch_argument {
+            enum argument_type {
+                int_argument,
+                float_argument,
+                bool_argument,
+                string_argument
+            };
+
+            argument_type type_;
+            int i_; //of a bool too
+            float f_;
+            string s_;
+
+            batch_argument(const int i)
+                :type_(int_argument), i_(i), f_(0.0f)
+                {}
+
+            batch_argument(const float f)
+                :type_(float_argument), i_(0), f_(f)
+                {}
+
+            batch_argument(const bool b)
+                :type_(bool_argument), i_(b ? 1 : 0), f_(0.0f)
+                {}
+
+            batch_argument(const string &s)
+                :type_(string_argument), i_(0), f_(0.0f), s_(s)
+                {}
+
+            value_type_t get_value_type() const {
+                switch (type_) {
+                case int_argument:
+                    return INT_TYPE;
+                case float_argument:
+                    return FLOAT_TYPE;
+                case bool_argument:
+                    return BOOL_TYPE;
+                default:
+                    return STRING_TYPE;
+                }
+            }
+
+            //the argument as the VM takes it
+            freefoil_vm::value make_value(freefoil_vm &vm) const {
+                switch (type_) {
+                case int_argument:
+                    return freefoil_vm::value(i_);
+                case float_argument:
+                    return freefoil_vm::value(f_);
+                case bool_argument:
+                    return freefoil_vm::value(i_ != 0);
+                default:
+                    return freefoil_vm::value(vm.make_string(s_));
+                }
+            }
+        };
+
+        struct batch_job_result {
+            bool succeeded_;
+            string error_;           //the message the run failed with
+            std::size_t worker_;     //the index of the worker which ran the job
+            std::size_t latency_us_; //of the run, the load of the program into a new VM included
+            freefoil_vm::value sum_; //of a range job
+
+            batch_job_result()
+                :succeeded_(false), worker_(0), latency_us_(0)
+                {}
+        };
+
+        struct batch_report {
+            vector<batch_job_result> results_; //in the order the jobs were added
+            std::size_t total_us_;             //from the start of the batch until its last job is done
+            std::size_t jobs_stolen_;          //run by the workers they were not given to
+
+            batch_report()
+                :total_us_(0), jobs_stolen_(0)
+                {}
+
+            double get_throughput() const {
+                return total_us_ == 0 ? 0.0 : results_.size() * 1000000.0 / total_us_;
+            }
+        };
+
+        //runs batches of independent jobs, each of which is a run of the entry point of a program, on a pool of workers.
+        //A batch is split into even runs of consecutive jobs, one per worker, so that the jobs of a program tend to
+        //stay with one worker; a worker takes its own jobs from the back of its queue, and once it has none it steals
+        //from the front of the queues of the others, so that the slow jobs don't keep the rest of the workers idle.
+        //Each worker keeps the VMs of the programs it ran last, so the code they decoded and jitted and their heaps
+        //are reused from job to job; the workers share the programs only, which the VMs never change.
+        //The workers are started with the pool and wait for the batches run() hands them. The output of the scripts
+        //goes to the standard output as they print it, so the output of the jobs run at once is interleaved.
+        class batch_pool {
+
+            batch_pool(const batch_pool &);
+            batch_pool &operator =(const batch_pool &);
+
+            //a run of the entry point, or a range job, which sums the runs of a user function over a range of indices
+            struct job {
+                const program_entry *program_;
+                vector<batch_argument> args_;
+                bool range_;
+                std::size_t func_index_;
+                int lo_;
+                int hi_;
+            };
+
+            struct worker;
+            typedef shared_ptr<worker> worker_shared_ptr;
+
+            vector<job> jobs_;
+            vector<worker_shared_ptr> workers_;
+            const std::size_t jit_threshold_;
+            batch_report *report_; //of the batch being run
+
+            bool take_job(worker &w, std::size_t &job_index);
+            void run_job(worker &w, const std::size_t job_index);
+            void run_jobs(worker &w);
+
+#if defined(FREEFOIL_PARALLEL_BATCH)
+            pthread_mutex_t mutex_;
+            pthread_cond_t start_; //a batch is handed to the workers, or the pool stops
+            pthread_cond_t done_;  //the last busy worker is done
+            std::size_t batches_started_;
+            std::size_t busy_workers_;
+            bool stopping_;
+
+            void stop();
+            void work(worker &w);
+            static void *worker_entry(void *w);
+#endif
+        public:
+            static const std::size_t MAX_CACHED_VMS = 4; //per worker
+
+            //workers_count == 0 takes a worker per online processor
+            explicit batch_pool(const std::size_t workers_count = 0, const std::size_t jit_threshold = freefoil_vm::DEFAULT_JIT_THRESHOLD);
+            ~batch_pool();
+
+            std::size_t get_workers_count() const {
+                return workers_.size();
+            }
+
+            //queues a run of the entry point of the program for the next batch; the program is to outlive the run.
+            //Returns the index of the job in the results of the batch
+            std::size_t add_job(const program_entry &program, const vector<batch_argument> &args = vector<batch_argument>());
+
+            //queues the sum of the runs of the user function over [lo, hi), as freefoil_vm::sum_range() makes it,
+            //for the next batch; the sum is in the result of the job
+            std::size_t add_range_job(const program_entry &program, const std::size_t func_index, const int lo, const int hi);
+
+            //runs the jobs queued since the previous batch and waits for all of them; the failures of the jobs are
+            //reported in their results
+            void run(batch_report &report);
+        };
+    }
+}
+
+#endif // BATCH_POOL_H_INCLUDED
@@ -0,0 +1,16 @@
+#!/bin/sh
+#writes a script with as many distinct string, int and float literals as the count, as the generated scripts have,
+#to time the compile with. The functions holding them are never called: the bytecode addresses the first 128
+#constants of each type only
+#usage: bench/literals.sh [count]
+
+awk -v count=${1:-20000} 'BEGIN {
+    print "void main(){ print(\"done\"); }"
+    for (first = 0; first < count; first += 100) {
+        printf "void literals%d(){", first
+        for (i = first; i < first + 100 && i < count; ++i) {
+            printf " print(\"literal %d\"); print(%d); print(%d.5);", i, i, i
+        }
+        print " }"
+    }
+}'
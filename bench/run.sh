@@ -0,0 +1,89 @@
+#!/bin/sh
+#times each workload of the bench directory with freefoil, and prints the best wall time of a few runs of it in
+#seconds; the compile is timed too. The options go to freefoil before the script. With -s the workload is fed to
+#the standard input as one line instead, as the builds from before freefoil ran script files take it, so that the
+#numbers of two builds can be compared. With -a the workload is translated with freefoil --aot and built as
+#"make aot" builds it, and the native executable is timed, without the translation and the build. The
+#literal-heavy workload is made by literals.sh on each run, rather than kept
+#usage: bench/run.sh [-n runs] [-s | -a] [freefoil binary] [options]
+
+runs=3
+stdin=0
+aot=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+    -n) runs=$2; shift 2 ;;
+    -s) stdin=1; shift ;;
+    -a) aot=1; shift ;;
+    *) break ;;
+    esac
+done
+freefoil=${1:-./freefoil}
+[ $# -gt 0 ] && shift
+dir=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$dir")
+output_file=${TMPDIR:-/tmp}/freefoil_bench.$$
+aot_dir=${TMPDIR:-/tmp}/freefoil_bench_aot.$$
+generated_dir=${TMPDIR:-/tmp}/freefoil_bench_generated.$$
+failed=0
+
+now() {
+    date +%s.%N
+}
+
+#the runtime the translated workloads link with is built once
+if [ $aot -eq 1 ]; then
+    case "$freefoil" in
+    /*) ;;
+    *) freefoil=$PWD/$freefoil ;;
+    esac
+    mkdir -p "$aot_dir"
+    for source in memory_manager pool_allocator; do
+        if ! ${CXX:-g++} -O2 -I"$root" -c -o "$aot_dir/$source.o" "$root/$source.cpp"; then
+            rm -rf "$aot_dir"
+            exit 1
+        fi
+    done
+fi
+
+mkdir -p "$generated_dir"
+"$dir/literals.sh" 2000 > "$generated_dir/literals.ff"
+
+for workload in "$dir"/*.ff "$generated_dir/literals.ff"; do
+    if [ $aot -eq 1 ]; then
+        if ! (cd "$aot_dir" && "$freefoil" "$@" --aot "$workload") > "$output_file" 2>&1 ||
+           ! ${CXX:-g++} -O2 -DFREEFOIL_AOT_MAIN -I"$root" -o "$aot_dir/workload" "$aot_dir/freefoil_aot.cpp" \
+                 "$aot_dir/memory_manager.o" "$aot_dir/pool_allocator.o" > "$output_file" 2>&1; then
+            echo "FAILED $(basename "$workload" .ff): can't translate it"
+            tail -3 "$output_file"
+            failed=1
+            continue
+        fi
+    fi
+    best=
+    run=0
+    while [ $run -lt "$runs" ]; do
+        start=$(now)
+        if [ $aot -eq 1 ]; then
+            "$aot_dir/workload" > "$output_file" 2>&1
+        elif [ $stdin -eq 1 ]; then
+            { tr '\n' ' ' < "$workload"; echo; echo q; } | "$freefoil" "$@" > "$output_file" 2>&1
+        else
+            "$freefoil" "$@" "$workload" > "$output_file" 2>&1
+        fi
+        code=$?
+        end=$(now)
+        if [ $code -ne 0 ]; then
+            echo "FAILED $(basename "$workload" .ff): exit $code"
+            tail -3 "$output_file"
+            failed=1
+            break
+        fi
+        best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 != "" && $3 < t) t = $3; printf "%.3f", t }')
+        run=$((run + 1))
+    done
+    [ $code -eq 0 ] && printf "%-12s %s\n" "$(basename "$workload" .ff)" "$best"
+done
+
+rm -rf "$output_file" "$aot_dir" "$generated_dir"
+exit $failed
@@ -0,0 +1,26 @@
+#!/bin/sh
+#runs the jobs of bench/scale.jobs as one batch on a worker, then on two and so on up to a worker per online
+#processor, and prints the batch report of each, so that the throughput can be compared
+#usage: bench/scale.sh [freefoil binary]
+
+freefoil=${1:-./freefoil}
+dir=$(dirname "$0")
+output_file=${TMPDIR:-/tmp}/freefoil_scale.$$
+processors=$(getconf _NPROCESSORS_ONLN)
+failed=0
+
+workers=1
+while [ $workers -le "$processors" ]; do
+    if "$freefoil" --batch "$dir/scale.jobs" $workers > "$output_file" 2>&1; then
+        printf "%3d workers: %s\n" $workers "$(grep '^batch:' "$output_file")"
+    else
+        echo "FAILED on $workers workers:"
+        grep '^job .*failed' "$output_file" | head -3
+        failed=1
+        break
+    fi
+    workers=$((workers + 1))
+done
+
+rm -f "$output_file"
+exit $failed
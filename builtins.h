@@ -0,0 +1,56 @@
+#ifndef BUILTINS_H_INCLUDED
+#define BUILTINS_H_INCLUDED
+
+#include "memory_manager.h"
+
+#include <iostream>
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        //bodies of the builtin functions, shared by the VMs and by the code the AOT translator emits;
+        //they are indexed in the order tree_analyzer::setup_builtin_funcs() declares them.
+        //The fiber, I/O and parallel builtins have no bodies here, as only the stack VM runs them
+        enum {
+            BUILTIN_print_int,
+            BUILTIN_print_float,
+            BUILTIN_print_bool,
+            BUILTIN_print_string,
+            BUILTIN_spawn,     //int spawn(string function_name)
+            BUILTIN_spawn_int, //int spawn(string function_name, int arg)
+            BUILTIN_yield,     //void yield()
+            BUILTIN_join,      //void join(int fiber)
+            BUILTIN_open,      //int open(string path)
+            BUILTIN_read,      //string read(int file)
+            BUILTIN_eof,       //bool eof(int file)
+            BUILTIN_close,     //void close(int file)
+            BUILTIN_parallel_for,       //int parallel_for(int lo, int hi, string function_name)
+            BUILTIN_parallel_for_float, //float parallel_for_float(int lo, int hi, string function_name)
+            BUILTINS_COUNT //must be the last one
+        };
+
+        inline void builtin_print_int(const int value) {
+            std::cout << value;
+        }
+
+        inline void builtin_print_float(const float value) {
+            std::cout << value;
+        }
+
+        inline void builtin_print_bool(const int value) {
+            std::cout << (value == 1 ? "true" : "false");
+        }
+
+        //a rope is flattened by the heap it lives in, so that it is walked once however many times it is printed
+        inline void builtin_print_string(memory_manager &mm, const gcobject &value) {
+            if (value.get_rtt() == rope_type) {
+                std::cout << mm.flatten(static_cast<const gcrope &>(value));
+            } else {
+                std::cout << value;
+            }
+        }
+    }
+}
+
+#endif // BUILTINS_H_INCLUDED
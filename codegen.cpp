@@ -3,6 +3,8 @@
 #include "freefoil_grammar.h"
 #include "value_descriptor.h"
 #include "opcodes.h"
+#include "verifier.h"
+#include "optimizer.h"
 
 #include <map>
 #include <iostream>
@@ -17,6 +19,49 @@ namespace Freefoil {
         return iter->value.value().get_cast();
     }
 
+    //finds the user function call the bool expression consists of, if it is nothing but that call taken as is;
+    //its result is then the result of the expression, so the call may be made in place of a return
+    static bool find_user_func_call(const iter_t &bool_expr_iter, iter_t &call_iter) {
+        static const parser_id chain[] = {
+            freefoil_grammar::bool_expr_ID,
+            freefoil_grammar::bool_term_ID,
+            freefoil_grammar::bool_factor_ID,
+            freefoil_grammar::bool_relation_ID,
+            freefoil_grammar::expr_ID,
+            freefoil_grammar::term_ID,
+            freefoil_grammar::factor_ID,
+        };
+
+        iter_t cur_iter = bool_expr_iter;
+        for (std::size_t i = 0; i < sizeof(chain) / sizeof(chain[0]); ++i) {
+            if (cur_iter->value.id() != chain[i] or get_cast(cur_iter) != value_descriptor::undefinedType or cur_iter->children.size() != 1) {
+                return false;   //an operation, a unary op, "not" or a cast is applied to the call's result
+            }
+            cur_iter = cur_iter->children.begin();
+        }
+        if (cur_iter->value.id() != freefoil_grammar::func_call_ID or get_cast(cur_iter) != value_descriptor::undefinedType or
+                cur_iter->value.value().get_func_kind() != node_attributes::USER_FUNC) {
+            return false;
+        }
+        call_iter = cur_iter;
+        return true;
+    }
+
+    static Runtime::value_type_t get_value_type(const value_descriptor::E_VALUE_TYPE type) {
+        switch (type) {
+        case value_descriptor::voidType:
+            return Runtime::VOID_TYPE;
+        case value_descriptor::floatType:
+            return Runtime::FLOAT_TYPE;
+        case value_descriptor::boolType:
+            return Runtime::BOOL_TYPE;
+        case value_descriptor::stringType:
+            return Runtime::STRING_TYPE;
+        default:
+            return Runtime::INT_TYPE;
+        }
+    }
+
     codegen::codegen() {
     }
 
@@ -31,6 +76,8 @@ namespace Freefoil {
                 cur_user_func_iter != user_func_iter_end;
                 ++cur_user_func_iter
             ) {
+            vector<codechunk_t *> jumps_past_end; //jumps to the last codechunk, which leave the function
+
             for (codechunk_list_t::const_iterator codechunk_begin_iter = (*cur_user_func_iter).begin(), curr_codechunk_iter = codechunk_begin_iter, codechunk_iter_end = (*cur_user_func_iter).end();
                     curr_codechunk_iter != codechunk_iter_end;
                     ++curr_codechunk_iter) {
@@ -50,22 +97,44 @@ namespace Freefoil {
                     codechunk_list_t::const_iterator iter = std::find(codechunk_begin_iter, codechunk_iter_end, curr_codechunk->jump_dst_);
                     assert(iter != codechunk_iter_end);
 
-                    codechunk_t *jump_dst =  *(++iter);
-                    dst2srcmap.insert(std::make_pair<codechunk_t *, codechunk_t *>(jump_dst, curr_codechunk));
+                    if (++iter != codechunk_iter_end) {
+                        dst2srcmap.insert(std::make_pair(*iter, curr_codechunk));
+                    } else {
+                        jumps_past_end.push_back(curr_codechunk);
+                    }
                 }
 
                 ++instruction_index;
             }
+
+            //codegen_func_impl gives such jumps a ret to land on, so these are left to the verifier to reject
+            for (vector<codechunk_t *>::const_iterator cur_iter = jumps_past_end.begin(); cur_iter != jumps_past_end.end(); ++cur_iter) {
+                (*cur_iter)->bytecode_ = instruction_index - (*cur_iter)->instruction_position_;
+            }
         }
     }
 
-    Runtime::program_entry_shared_ptr codegen::generate_program_entry(const Runtime::constants_pool &constants, bool show) const {
+    bool codegen::is_jump_dst(const codechunk_t *codechunk) const {
+
+        const codechunk_list_t &codechunks = codechunks_.back();
+        for (codechunk_list_t::const_iterator cur_iter = codechunks.begin(), iter_end = codechunks.end(); cur_iter != iter_end; ++cur_iter) {
+            if ((*cur_iter)->is_plug_ and (*cur_iter)->jump_dst_ == codechunk) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Runtime::program_entry_shared_ptr codegen::generate_program_entry(const Runtime::constants_pool &constants, bool optimize, bool show) const {
 
         assert(user_funcs_.size() == codechunks_.size());
 
         Runtime::function_templates_vector_t user_funcs_templates;
         user_funcs_templates.reserve(user_funcs_.size());
 
+        bytecode_verifier verifier(user_funcs_, builtin_funcs_);
+        bytecode_optimizer optimizer;
+
         if (show) {
             std::cout << "bytecode for compiled user functions:" << std::endl;
         }
@@ -81,12 +150,38 @@ namespace Freefoil {
                     ++curr_codechunk_iter
                 ) {
                 instructions.push_back((*curr_codechunk_iter)->bytecode_);
-                if (show) {
-                    std::cout << (int) (*curr_codechunk_iter)->bytecode_ << " ";
+            }
+            if (optimize) {
+                //the code is left as it is if the optimizer can't handle it
+                Runtime::instructions_stream_t optimized;
+                if (optimizer.optimize(instructions, optimized)) {
+                    instructions.swap(optimized);
+                }
+            }
+            if (show) {
+                for (std::size_t i = 0; i < instructions.size(); ++i) {
+                    std::cout << (int) instructions[i] << " ";
                 }
             }
             const function_shared_ptr_t &user_func = user_funcs_[function_index];
-            user_funcs_templates.push_back(Runtime::function_template(user_func->get_args_count(), user_func->get_locals_count(), instructions, user_func->get_type() == value_descriptor::voidType));
+
+            std::size_t max_stack_depth;
+            Runtime::stack_maps_t stack_maps;
+            vector<int> ref_slots;
+            if (!verifier.verify(instructions, max_stack_depth, stack_maps, ref_slots)) {
+                if (show) {
+                    std::cout << std::endl;
+                }
+                std::cout << "verifier: " << user_func->get_name() << ": " << verifier.get_error() << std::endl;
+                return Runtime::program_entry_shared_ptr();
+            }
+
+            vector<Runtime::value_type_t> param_types;
+            const param_descriptors_t &param_descriptors = user_func->get_param_descriptors();
+            for (param_descriptors_t::const_iterator param_iter = param_descriptors.begin(); param_iter != param_descriptors.end(); ++param_iter) {
+                param_types.push_back(get_value_type(param_iter->get_value_type()));
+            }
+            user_funcs_templates.push_back(Runtime::function_template(user_func->get_name(), param_types, user_func->get_locals_count(), max_stack_depth, instructions, get_value_type(user_func->get_type()), stack_maps, ref_slots));
             ++function_index;
         }
 	if (show) {
@@ -96,12 +191,13 @@ namespace Freefoil {
         return Runtime::program_entry_shared_ptr(new Runtime::program_entry(user_funcs_templates, constants, entry_point_func_index_));
     }
 
-    Runtime::program_entry_shared_ptr codegen::exec(const iter_t &tree_top, const function_shared_ptr_list_t &user_funcs, const Runtime::constants_pool &constants, bool optimize, bool show) {
+    Runtime::program_entry_shared_ptr codegen::exec(const iter_t &tree_top, const function_shared_ptr_list_t &user_funcs, const function_shared_ptr_list_t &builtin_funcs, const Runtime::constants_pool &constants, bool optimize, bool show) {
 
         std::cout << "codegen begin" << std::endl;
 
         codechunks_.clear();
         user_funcs_ = user_funcs;
+        builtin_funcs_ = builtin_funcs;
         function_shared_ptr_list_t::const_iterator entry_point_func_iter = std::find_if(
                     user_funcs.begin(),
                     user_funcs.end(),
@@ -124,15 +220,11 @@ namespace Freefoil {
             break;
         }
 
-        if (optimize) {
-            //TODO:
-        }
-
         resolve_jumps();
 
         std::cout << "codegen end" << std::endl;
 
-        return generate_program_entry(constants, show);
+        return generate_program_entry(constants, optimize, show);
     }
 
     void codegen::codegen_script(const iter_t &iter) {
@@ -154,10 +246,13 @@ namespace Freefoil {
         codegen_func_body(iter->children.begin() + 1);
 
         assert(iter->value.value().get_value_type() != value_descriptor::undefinedType);
-        if (iter->value.value().get_value_type() == value_descriptor::voidType) {
-            if (codechunks_.back().empty() or codechunks_.back().back()->bytecode_ != OPCODE_ret) {
-                code_emit(OPCODE_ret);
-            }
+        //the jumps out of the last statement land past its code, so they need a ret there: the one a void function
+        //returns with when it runs off its end. The other functions return along every path, which makes such jumps
+        //dead code, like the jmp after an if branch which returns, and their ret is never run
+        const codechunk_list_t &codechunks = codechunks_.back();
+        if (codechunks.empty() or is_jump_dst(codechunks.back()) or
+                (iter->value.value().get_value_type() == value_descriptor::voidType and codechunks.back()->bytecode_ != OPCODE_ret)) {
+            code_emit(OPCODE_ret);
         }
 
         if (codechunks_.size() - 1 == entry_point_func_index_) {
@@ -243,6 +338,9 @@ namespace Freefoil {
                 //set_jumps_dsts(false_jmps_.top(), codechunks_.back().back());
                 set_jmp_dst(false_jmp_to_be_backpatched, codechunks_.back().back());
 
+                //jz leaves the tested value on the stack when it jumps
+                code_emit(OPCODE_pop);
+
                 //false_jmps_.pop();
             } else {
                 codegen_block(cur_iter->children.begin());
@@ -262,6 +360,15 @@ namespace Freefoil {
         if (!iter->children.empty()) {
             assert(iter->children.size() == 1);
             assert(iter->children.begin()->value.id() == freefoil_grammar::bool_expr_ID);
+
+            iter_t call_iter;
+            if (find_user_func_call(iter->children.begin(), call_iter)) {
+                //the callee reuses our frame and returns its result straight to our caller
+                codegen_invoke_args_list(call_iter->children.begin() + 1);
+                code_emit(OPCODE_tailcall, call_iter->value.value().get_index());
+                return;
+            }
+
             codegen_bool_expr(iter->children.begin());
 
             value_descriptor::E_VALUE_TYPE val_type;
@@ -500,12 +607,8 @@ namespace Freefoil {
     void codegen::codegen_func_call(const iter_t &iter) {
 
         assert(iter->value.id() == freefoil_grammar::func_call_ID);
-        assert((iter->children.begin() + 1)->value.id() == freefoil_grammar::invoke_args_list_ID);
 
-        for (iter_t cur_iter = (iter->children.begin() + 1)->children.end() - 1, iter_end = (iter->children.begin() + 1)->children.begin(); cur_iter >= iter_end; --cur_iter) {
-            assert(cur_iter->value.id() == freefoil_grammar::bool_expr_ID);
-            codegen_bool_expr(cur_iter);
-        }
+        codegen_invoke_args_list(iter->children.begin() + 1);
 
         if (iter->value.value().get_func_kind() == node_attributes::BUILTIN_FUNC){
             code_emit(OPCODE_builtin_call, iter->value.value().get_index());
@@ -515,6 +618,18 @@ namespace Freefoil {
         }
     }
 
+    void codegen::codegen_invoke_args_list(const iter_t &iter) {
+
+        assert(iter->value.id() == freefoil_grammar::invoke_args_list_ID);
+
+        //the args are pushed from the last one, so that the first param is on top of the stack
+        for (iter_t cur_iter = iter->children.end(), iter_begin = iter->children.begin(); cur_iter != iter_begin; ) {
+            --cur_iter;
+            assert(cur_iter->value.id() == freefoil_grammar::bool_expr_ID);
+            codegen_bool_expr(cur_iter);
+        }
+    }
+
     void codegen::codegen_term(const iter_t &iter) {
 
         assert(iter->value.id() == freefoil_grammar::term_ID);
@@ -550,6 +665,7 @@ namespace Freefoil {
             //          set_jumps_dsts(false_jmps_.top(), code_chunks_.back().back());
             set_jmp_dst(true_jmp_to_be_backpatched, jmp_to_be_backpatched);
 
+            code_emit(OPCODE_pop); //jnz leaves the tested value on the stack when it jumps
             code_emit(OPCODE_push_false);
             //         set_jumps_dsts(true_jmps_.top(), code_chunks_.back().back());
             set_jmp_dst(jmp_to_be_backpatched, codechunks_.back().back());
@@ -792,6 +908,17 @@ namespace Freefoil {
         }
 
         const std::string cmp_operation_as_str(parse_str(iter));
+        //strings are compared by their characters, into an int which is compared with 1 for the equality and with 0 for the order
+        const value_descriptor::E_VALUE_TYPE compared_type = cast_type != value_descriptor::undefinedType ? cast_type : right_iter->value.value().get_value_type();
+        if (compared_type == value_descriptor::stringType) {
+            if (cmp_operation_as_str == "==" or cmp_operation_as_str == "!=") {
+                code_emit(OPCODE_seq);
+                code_emit(OPCODE_push_true);
+            } else {
+                code_emit(OPCODE_scmp);
+                code_emit(OPCODE_push_false);
+            }
+        }
         if (cmp_operation_as_str == "==") {
             code_emit_branch(OPCODE_ifeq);
         } else if (cmp_operation_as_str == "!=") {
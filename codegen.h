@@ -41,6 +41,7 @@ namespace Freefoil {
 
             codechunks_t codechunks_;
             function_shared_ptr_list_t user_funcs_;
+            function_shared_ptr_list_t builtin_funcs_;
             Runtime::ULONG entry_point_func_index_;
 
             void codegen_script(const iter_t &iter);
@@ -59,6 +60,7 @@ namespace Freefoil {
             void codegen_quoted_string(const iter_t &iter);
             void codegen_bool_constant(const iter_t &iter);
             void codegen_func_call(const iter_t &iter);
+            void codegen_invoke_args_list(const iter_t &iter);
             void codegen_ident(const iter_t &iter);
             void codegen_and_op(const iter_t &iter);
             void codegen_or_xor_op(const iter_t &iter);
@@ -75,11 +77,12 @@ namespace Freefoil {
             void code_emit_plug();
             void set_jumps_dsts(vector<codechunk_t *> &jumps_table, const codechunk_t *dst_code_chunk);
             void set_jmp_dst(codechunk_t *codechunk, const codechunk_t *dst_codechunk);
+            bool is_jump_dst(const codechunk_t *codechunk) const;
             void resolve_jumps();
-            Runtime::program_entry_shared_ptr generate_program_entry(const Runtime::constants_pool &constants, bool show) const;
+            Runtime::program_entry_shared_ptr generate_program_entry(const Runtime::constants_pool &constants, bool optimize, bool show) const;
         public:
             codegen();
-            Runtime::program_entry_shared_ptr exec(const iter_t &tree_top, const function_shared_ptr_list_t &user_funcs, const Runtime::constants_pool &constants, bool optimize, bool show);
+            Runtime::program_entry_shared_ptr exec(const iter_t &tree_top, const function_shared_ptr_list_t &user_funcs, const function_shared_ptr_list_t &builtin_funcs, const Runtime::constants_pool &constants, bool optimize, bool show);
         };
     }
 }
@@ -76,7 +76,7 @@ namespace Freefoil {
         if (parse(source, the_parse_info)) {
             if (the_tree_analyzer.parse(the_parse_info.trees.begin())) {
                 const Runtime::constants_pool &the_constants_pool = the_tree_analyzer.get_parsed_constants_pool();
-                return the_codegen.exec(the_parse_info.trees.begin(), the_tree_analyzer.get_parsed_funcs_list(), the_constants_pool, optimize, show);
+                return the_codegen.exec(the_parse_info.trees.begin(), the_tree_analyzer.get_parsed_funcs_list(), the_tree_analyzer.get_builtin_funcs_list(), the_constants_pool, optimize, show);
             }
         }
         return Runtime::program_entry_shared_ptr();
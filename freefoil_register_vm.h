@@ -0,0 +1,1058 @@
+#ifndef FREEFOIL_REGISTER_VM_H_INCLUDED
+#define FREEFOIL_REGISTER_VM_H_INCLUDED
+
+#include "runtime.h"
+#include "opcodes.h"
+#include "memory_manager.h"
+#include "builtins.h"
+#include "exceptions.h"
+#include "freefoil_vm.h"
+#include "vm_stack.h"
+
+#include <iostream>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+#if defined(FREEFOIL_THREADED_DISPATCH)
+#define VM_HANDLER(opcode) handlers[opcode] = &&L_##opcode
+#define VM_CASE(opcode) case opcode: L_##opcode:
+#define VM_DISPATCH() goto *pc_->handler_
+#else
+#define VM_CASE(opcode) case opcode:
+#define VM_DISPATCH() continue
+#endif
+
+//advance to the next register instruction and dispatch it
+#define VM_NEXT() ++pc_; VM_DISPATCH()
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using namespace Private;
+
+        using boost::scoped_ptr;
+
+        using std::map;
+        using std::vector;
+        using std::string;
+
+        //register machine alternative to freefoil_vm: runs the same program_entry, but every instruction
+        //addresses its operands as frame slots directly instead of moving them through the operands stack.
+        //The register code is translated from the stack bytecode when the program is loaded:
+        //every operands stack depth is given its own frame slot right below the function's locals,
+        //and the loads of variables are propagated into the instructions consuming them.
+        //The frames are laid out as freefoil_vm lays them out, on a vm_stack, and the stack maps of the bytecode
+        //give the temporaries holding strings at the safe points, so the heap is collected as the stack VM's is
+        class freefoil_register_vm : public gc_roots {
+
+            struct register_instruction;
+
+            union stack_item {
+                stack_item *pstack_item_;
+                const register_instruction *pc_;
+                gcobject_instance_t gcobj_;
+                int   i_;
+                float f_;
+            };
+
+            typedef void (freefoil_register_vm::*builtin_func_pointer_t)();
+
+            typedef struct builtin_func {
+                std::size_t args_count_;
+                builtin_func_pointer_t body_;
+                builtin_func(const std::size_t args_count, builtin_func_pointer_t body)
+                    :args_count_(args_count), body_(body)
+                    {}
+            } builtin_func_t;
+
+            vector<builtin_func_t> builtin_funcs_;
+
+            struct register_instruction {
+                const void *handler_; //address of the opcode handler (or of the central switch)
+                BYTE opcode_;
+                int dst_;  //frame slot (or callee's frame pointer for calls)
+                int src1_; //frame slot, integer value, constant index or function index
+                int src2_; //frame slot
+                const register_instruction *target_; //resolved jump destination
+            };
+
+            typedef vector<register_instruction> register_code_t;
+
+            struct register_function {
+                register_code_t code_;
+                std::size_t args_count_;
+                std::size_t frame_size_; //locals and temporaries
+                vector<int> ref_slots_; //the frame slots of the params and locals holding gcobject pointers
+                std::map<std::size_t, vector<int> > ref_temporaries_; //the temporaries holding gcobject pointers at each safe point, by its instruction
+            };
+
+            //the frame of a function at a GC safe point, as the stack VM has it
+            struct gc_safe_point {
+                const register_function *function_;
+                const vector<int> *ref_temporaries_;
+            };
+
+            memory_manager heap_; //of the objects of the run
+            vector<register_function> register_funcs_; //indexed as program_.user_funcs_
+            std::map<const register_instruction *, gc_safe_point> safe_points_;
+            vector<gcobject_instance_t> string_constants_; //indexed as the string table of program_.constants_pool_, marked as roots
+
+            const program_entry &program_;
+            const dispatch_mode dispatch_mode_;
+
+            //the frame record of freefoil_vm: the params lie past it, the locals and then the temporaries below fp_
+            enum {
+                FRAME_OLD_FP = 0,
+                FRAME_RETURN_PC = 1,
+                FRAME_RECORD_SIZE = 2
+            };
+
+            scoped_ptr<vm_stack> stack_;
+            stack_item *stack_begin_; //the lowest committed stack item
+
+            stack_item *sp_; //arguments pointer of builtin functions
+            const register_instruction *pc_; //current position in the register code
+            stack_item *fp_; //frame pointer
+
+            void print_int(){
+                builtin_print_int(pop_int());
+            }
+
+            void print_float(){
+                builtin_print_float(pop_float());
+            }
+
+            void print_string(){
+                builtin_print_string(heap_, *pop_gcobject());
+            }
+
+            void print_bool(){
+                builtin_print_bool(pop_int());
+            }
+
+            void init() {
+                stack_.reset(new vm_stack(freefoil_vm::DEFAULT_STACK_SIZE * sizeof(stack_item), freefoil_vm::DEFAULT_MAX_STACK_SIZE * sizeof(stack_item)));
+                stack_begin_ = reinterpret_cast<stack_item *>(stack_->begin());
+                sp_ = fp_ = reinterpret_cast<stack_item *>(stack_->end());
+
+                builtin_funcs_.clear();
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_register_vm::print_int));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_register_vm::print_float));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_register_vm::print_bool));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_register_vm::print_string));
+                //TODO: add others
+            }
+
+            //state of the stack to register translation of one function
+            class translator {
+
+                typedef std::pair<std::size_t, std::size_t> jump_t; //register instruction, and the operands stack depth it jumps with
+
+                struct label {
+                    vector<jump_t> incoming_; //forward jumps waiting for the label to be translated
+                    bool translated_;
+                    std::size_t index_; //register instruction the label is translated to
+                    std::size_t depth_;
+                    label():translated_(false), index_(0), depth_(0) {}
+                };
+
+                typedef map<std::size_t, label> labels_t;
+
+                const freefoil_register_vm &vm_;
+                const function_template &func_;
+                register_function &result_;
+
+                vector<int> operands_; //frame slot holding each operands stack item; a variable's slot if its load was propagated
+                labels_t labels_; //jump destinations, by bytecode position
+                vector<std::pair<std::size_t, std::size_t> > jumps_; //register instruction -> index of its destination
+                const stack_map_t *stack_map_; //of the instruction being translated, if it is a safe point
+                std::size_t max_depth_;
+                bool reachable_;
+                bool retargetable_; //the last instruction computed the top of the stack into its own temporary
+
+                int temporary(const std::size_t depth) const {
+                    return - static_cast<int>(func_.locals_count_) - 1 - static_cast<int>(depth);
+                }
+
+                //the frame slot of a param or a local as the bytecode addresses it: the params lie past the frame record
+                static int variable(const int offset) {
+                    return offset > 0 ? offset + FRAME_RECORD_SIZE - 1 : offset;
+                }
+
+                //the instruction emitted next is a safe point: the collector marks the temporaries below live_depth
+                //which hold strings while it runs; the stack items in variables are marked with the variables
+                void safe_point(const std::size_t live_depth) {
+                    if (stack_map_ == NULL) {
+                        throw freefoil_exception("register machine: no stack map at a safe point");
+                    }
+                    assert(stack_map_->size() == operands_.size());
+                    vector<int> &slots = result_.ref_temporaries_[result_.code_.size()];
+                    for (std::size_t depth = 0; depth < live_depth; ++depth) {
+                        if ((*stack_map_)[depth] and operands_[depth] == temporary(depth)) {
+                            slots.push_back(temporary(depth));
+                        }
+                    }
+                }
+
+                void emit(const int opcode, const int dst = 0, const int src1 = 0, const int src2 = 0) {
+                    register_instruction instruction;
+                    instruction.handler_ = NULL;
+                    instruction.opcode_ = opcode;
+                    instruction.dst_ = dst;
+                    instruction.src1_ = src1;
+                    instruction.src2_ = src2;
+                    instruction.target_ = NULL;
+                    result_.code_.push_back(instruction);
+                    retargetable_ = false;
+                }
+
+                void emit_branch(const int opcode, const std::size_t dst_pos, const std::size_t dst_depth, const int src1 = 0, const int src2 = 0) {
+                    emit(opcode, 0, src1, src2);
+                    label &dst = labels_[dst_pos];
+                    if (dst.translated_) {
+                        if (dst.depth_ != dst_depth) {
+                            throw freefoil_exception("register machine: inconsistent stack depth on a backward jump");
+                        }
+                        jumps_.push_back(std::make_pair(result_.code_.size() - 1, dst.index_));
+                    } else {
+                        dst.incoming_.push_back(jump_t(result_.code_.size() - 1, dst_depth));
+                    }
+                }
+
+                //the stack machine keeps addressing the top of the stack where paths of different depths meet
+                //(jz/jnz leave the tested value behind on some of them), so the deeper path drops its bottom items
+                void shift_down(const std::size_t depth, const std::size_t dst_depth) {
+                    for (std::size_t i = 0; i < dst_depth; ++i) {
+                        emit(REG_OPCODE_move, temporary(i), temporary(i + depth - dst_depth));
+                    }
+                }
+
+                void translate_label(label &l);
+
+                //the result of an operation goes to the temporary of the current depth
+                int push_temporary() {
+                    const int slot = temporary(operands_.size());
+                    operands_.push_back(slot);
+                    max_depth_ = std::max(max_depth_, operands_.size());
+                    return slot;
+                }
+
+                int pop() {
+                    assert(!operands_.empty());
+                    const int slot = operands_.back();
+                    operands_.pop_back();
+                    return slot;
+                }
+
+                void materialize(const std::size_t depth) {
+                    if (operands_[depth] != temporary(depth)) {
+                        emit(REG_OPCODE_move, temporary(depth), operands_[depth]);
+                        operands_[depth] = temporary(depth);
+                    }
+                }
+
+                //every stack item must be in its own temporary where control flow paths meet
+                void materialize_all() {
+                    for (std::size_t depth = 0; depth < operands_.size(); ++depth) {
+                        materialize(depth);
+                    }
+                }
+
+                void save(const int variable) {
+                    const int value = pop();
+                    for (std::size_t depth = 0; depth < operands_.size(); ++depth) {
+                        if (operands_[depth] == variable) {
+                            materialize(depth); //the variable is going to be overwritten
+                        }
+                    }
+                    if (retargetable_ and value == temporary(operands_.size())) {
+                        result_.code_.back().dst_ = variable;
+                    } else if (value != variable) {
+                        emit(REG_OPCODE_move, variable, value);
+                    }
+                    retargetable_ = false;
+                }
+
+                void binary(const int opcode) {
+                    const int src2 = pop();
+                    const int src1 = pop();
+                    const int dst = temporary(operands_.size());
+                    emit(opcode, dst, src1, src2);
+                    push_temporary();
+                    retargetable_ = true;
+                }
+
+                void unary(const int opcode) {
+                    const int src = pop();
+                    const int dst = temporary(operands_.size());
+                    emit(opcode, dst, src);
+                    push_temporary();
+                    retargetable_ = true;
+                }
+
+                void constant(const int opcode, const int value) {
+                    emit(opcode, push_temporary(), value);
+                    retargetable_ = true;
+                }
+
+                void compare_branch(const int opcode, const std::size_t dst_pos) {
+                    const int src2 = pop();
+                    const int src1 = pop();
+                    materialize_all();
+                    emit_branch(opcode, dst_pos, operands_.size(), src1, src2);
+                }
+
+                void translate(const int opcode, const BYTE *operands, const std::size_t dst_pos);
+
+            public:
+                translator(const freefoil_register_vm &vm, const function_template &func, register_function &result)
+                    :vm_(vm), func_(func), result_(result), stack_map_(NULL), max_depth_(0), reachable_(true), retargetable_(false)
+                    {}
+
+                void exec();
+            };
+
+            friend class translator;
+
+            void decode(const void * const *handlers, const void *switch_handler) {
+
+                register_funcs_.clear();
+                register_funcs_.resize(program_.user_funcs_.size());
+                safe_points_.clear();
+
+                for (std::size_t func_index = 0; func_index < program_.user_funcs_.size(); ++func_index) {
+                    register_function &f = register_funcs_[func_index];
+                    translator(*this, program_.user_funcs_[func_index], f).exec();
+
+                    for (register_code_t::iterator iter = f.code_.begin(); iter != f.code_.end(); ++iter) {
+                        if (handlers == NULL) {
+                            iter->handler_ = switch_handler;
+                        } else {
+                            iter->handler_ = handlers[iter->opcode_];
+                        }
+                    }
+
+                    for (std::map<std::size_t, vector<int> >::const_iterator map_iter = f.ref_temporaries_.begin(); map_iter != f.ref_temporaries_.end(); ++map_iter) {
+                        gc_safe_point &safe_point = safe_points_[&f.code_[map_iter->first]];
+                        safe_point.function_ = &f;
+                        safe_point.ref_temporaries_ = &map_iter->second;
+                    }
+                }
+            }
+
+            //pushes the frame record of the call of the function whose frame pointer is fp, right below its params,
+            //and goes to its first instruction; the stack is committed for the whole frame first
+            void enter_frame(const register_function &f, stack_item * const fp, const register_instruction *return_pc) {
+                if (fp - stack_begin_ < static_cast<std::ptrdiff_t>(f.frame_size_)) {
+                    grow_stack(reinterpret_cast<stack_item *>(stack_->end()) - fp + f.frame_size_);
+                }
+                fp[FRAME_RETURN_PC].pc_ = return_pc;
+                fp[FRAME_OLD_FP].pstack_item_ = fp_;
+                fp_ = fp;
+                pc_ = &f.code_[0];
+            }
+
+            //pops the frame record of the current function, and resumes the caller
+            void leave_frame() {
+                stack_item * const frame = fp_;
+                pc_ = frame[FRAME_RETURN_PC].pc_;
+                fp_ = frame[FRAME_OLD_FP].pstack_item_;
+            }
+
+            //commits the VM stack so that there are size stack items below its end
+            void grow_stack(const std::size_t size) {
+                if (!stack_->grow(size * sizeof(stack_item))) {
+                    throw freefoil_exception("stack overflow");
+                }
+                stack_begin_ = reinterpret_cast<stack_item *>(stack_->begin());
+            }
+
+            int pop_int() {
+                return (*sp_++).i_;
+            }
+
+            float pop_float() {
+                return (*sp_++).f_;
+            }
+
+            gcobject_instance_t pop_gcobject() {
+                return (*sp_++).gcobj_;
+            }
+
+            stack_item &slot(const int offset) const {
+                return *(fp_ + offset);
+            }
+
+        public:
+            freefoil_register_vm(const program_entry &program, const dispatch_mode mode = default_dispatch_mode) : program_(program), dispatch_mode_(mode) {
+            }
+
+            //runs the entry point, which has no params; the errors are thrown
+            void run() {
+
+                init();
+
+#if defined(FREEFOIL_THREADED_DISPATCH)
+                const void *handlers[REG_OPCODES_COUNT];
+                std::fill(handlers, handlers + REG_OPCODES_COUNT, &&L_bad_opcode);
+                VM_HANDLER(REG_OPCODE_move);
+                VM_HANDLER(REG_OPCODE_iconst);
+                VM_HANDLER(REG_OPCODE_fconst);
+                VM_HANDLER(REG_OPCODE_sconst);
+                VM_HANDLER(REG_OPCODE_iadd);
+                VM_HANDLER(REG_OPCODE_isub);
+                VM_HANDLER(REG_OPCODE_imul);
+                VM_HANDLER(REG_OPCODE_idiv);
+                VM_HANDLER(REG_OPCODE_fadd);
+                VM_HANDLER(REG_OPCODE_fsub);
+                VM_HANDLER(REG_OPCODE_fmul);
+                VM_HANDLER(REG_OPCODE_fdiv);
+                VM_HANDLER(REG_OPCODE_sadd);
+                VM_HANDLER(REG_OPCODE_seq);
+                VM_HANDLER(REG_OPCODE_scmp);
+                VM_HANDLER(REG_OPCODE_inegate);
+                VM_HANDLER(REG_OPCODE_fnegate);
+                VM_HANDLER(REG_OPCODE_f2i);
+                VM_HANDLER(REG_OPCODE_i2f);
+                VM_HANDLER(REG_OPCODE_ifeq);
+                VM_HANDLER(REG_OPCODE_ifneq);
+                VM_HANDLER(REG_OPCODE_ifleq);
+                VM_HANDLER(REG_OPCODE_ifgeq);
+                VM_HANDLER(REG_OPCODE_ifgreater);
+                VM_HANDLER(REG_OPCODE_ifless);
+                VM_HANDLER(REG_OPCODE_jz);
+                VM_HANDLER(REG_OPCODE_jnz);
+                VM_HANDLER(REG_OPCODE_jmp);
+                VM_HANDLER(REG_OPCODE_call);
+                VM_HANDLER(REG_OPCODE_builtin_call);
+                VM_HANDLER(REG_OPCODE_ret);
+                VM_HANDLER(REG_OPCODE_ret_value);
+                VM_HANDLER(REG_OPCODE_halt);
+#endif
+
+                const constants_pool &pool = program_.constants_pool_;
+                string_constants_.resize(pool.get_string_constants_count());
+                for (std::size_t i = 0; i < string_constants_.size(); ++i) {
+                    string_constants_[i] = heap_.make_old_string(pool.get_string_value_from_table(i));
+                }
+
+#if defined(FREEFOIL_THREADED_DISPATCH)
+                decode(dispatch_mode_ == threaded_dispatch ? handlers : NULL, &&L_switch_dispatch);
+#else
+                decode(NULL, NULL);
+#endif
+
+                //there is no way to pass the arguments in yet
+                if (program_.user_funcs_[program_.entry_point_func_index_].args_count_ != 0) {
+                    throw freefoil_exception("the register machine runs entry points with no params only");
+                }
+                const register_function &entry_point_func = register_funcs_[program_.entry_point_func_index_];
+                const register_instruction *pc_end = &*(entry_point_func.code_.end() - 1);
+                assert(pc_end->opcode_ == REG_OPCODE_halt);
+
+                const memory_manager::roots_activation roots_activation(heap_, *this);
+
+                //the frame of the entry point points to the end of the stack as its caller's, which ends the walk of mark_roots()
+                enter_frame(entry_point_func, reinterpret_cast<stack_item *>(stack_->end()) - FRAME_RECORD_SIZE, pc_end);
+
+                for (;;) {
+#if defined(FREEFOIL_THREADED_DISPATCH)
+L_switch_dispatch:
+#endif
+                    switch (pc_->opcode_) {
+
+                    VM_CASE(REG_OPCODE_move) {
+                        slot(pc_->dst_) = slot(pc_->src1_);
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_iconst) {
+                        slot(pc_->dst_).i_ = pc_->src1_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fconst) {
+                        slot(pc_->dst_).f_ = program_.constants_pool_.get_float_value_from_table(pc_->src1_);
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_sconst) {
+                        slot(pc_->dst_).gcobj_ = string_constants_[pc_->src1_];
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_iadd) {
+                        slot(pc_->dst_).i_ = slot(pc_->src1_).i_ + slot(pc_->src2_).i_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_isub) {
+                        slot(pc_->dst_).i_ = slot(pc_->src1_).i_ - slot(pc_->src2_).i_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_imul) {
+                        slot(pc_->dst_).i_ = slot(pc_->src1_).i_ * slot(pc_->src2_).i_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_idiv) {
+                        const int value2 = slot(pc_->src2_).i_;
+                        if (value2 == 0) {
+                            throw freefoil_exception("runtime exception: division by zero");
+                        }
+                        slot(pc_->dst_).i_ = slot(pc_->src1_).i_ / value2;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fadd) {
+                        slot(pc_->dst_).f_ = slot(pc_->src1_).f_ + slot(pc_->src2_).f_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fsub) {
+                        slot(pc_->dst_).f_ = slot(pc_->src1_).f_ - slot(pc_->src2_).f_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fmul) {
+                        slot(pc_->dst_).f_ = slot(pc_->src1_).f_ * slot(pc_->src2_).f_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fdiv) {
+                        const float value2 = slot(pc_->src2_).f_;
+                        if (value2 == 0.0) {
+                            throw freefoil_exception("runtime exception: division by zero");
+                        }
+                        slot(pc_->dst_).f_ = slot(pc_->src1_).f_ / value2;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_sadd) {
+                        slot(pc_->dst_).gcobj_ = heap_.concat(slot(pc_->src1_).gcobj_, slot(pc_->src2_).gcobj_);
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_seq) {
+                        slot(pc_->dst_).i_ = heap_.equal_strings(*slot(pc_->src1_).gcobj_, *slot(pc_->src2_).gcobj_) ? 1 : 0;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_scmp) {
+                        slot(pc_->dst_).i_ = heap_.compare_strings(*slot(pc_->src1_).gcobj_, *slot(pc_->src2_).gcobj_);
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_inegate) {
+                        slot(pc_->dst_).i_ = - slot(pc_->src1_).i_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_fnegate) {
+                        slot(pc_->dst_).f_ = - slot(pc_->src1_).f_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_f2i) {
+                        //warning: possibly, information lost
+                        slot(pc_->dst_).i_ = static_cast<int>(slot(pc_->src1_).f_);
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_i2f) {
+                        slot(pc_->dst_).f_ = slot(pc_->src1_).i_;
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifeq) {
+                        if (slot(pc_->src1_).i_ == slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifneq) {
+                        if (slot(pc_->src1_).i_ != slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifleq) {
+                        if (slot(pc_->src1_).i_ <= slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifgeq) {
+                        if (slot(pc_->src1_).i_ >= slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifgreater) {
+                        if (slot(pc_->src1_).i_ > slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ifless) {
+                        if (slot(pc_->src1_).i_ < slot(pc_->src2_).i_){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_jz) { //jmp if false, the value stays in its slot for the destination
+                        assert(slot(pc_->src1_).i_ == 0 or slot(pc_->src1_).i_ == 1);
+                        if (slot(pc_->src1_).i_ == 0){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_jnz) { //jmp if true, the value stays in its slot for the destination
+                        assert(slot(pc_->src1_).i_ == 0 or slot(pc_->src1_).i_ == 1);
+                        if (slot(pc_->src1_).i_ == 1){
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
+                        }
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_jmp) {
+                        pc_ = pc_->target_;
+                        VM_DISPATCH();
+                    }
+
+                    VM_CASE(REG_OPCODE_call) {
+                        enter_frame(register_funcs_[pc_->src1_], fp_ + pc_->dst_, pc_ + 1);
+                        VM_DISPATCH();
+                    }
+
+                    VM_CASE(REG_OPCODE_builtin_call) {
+                        const builtin_func_t &builtin_func = builtin_funcs_[pc_->src1_];
+
+                        sp_ = &slot(pc_->dst_);
+                        (this->*builtin_func.body_)();
+                        VM_NEXT();
+                    }
+
+                    VM_CASE(REG_OPCODE_ret) { //return void
+                        leave_frame();
+                        VM_DISPATCH();
+                    }
+
+                    VM_CASE(REG_OPCODE_ret_value) { //the value replaces the params in the caller's frame
+                        const stack_item retv = slot(pc_->src1_);
+                        stack_item * const frame = fp_;
+                        const int result = pc_->dst_;
+                        leave_frame();
+                        frame[result] = retv;
+                        VM_DISPATCH();
+                    }
+
+                    VM_CASE(REG_OPCODE_halt) {
+                        goto L_halt;
+                    }
+
+                    default: {
+#if defined(FREEFOIL_THREADED_DISPATCH)
+L_bad_opcode:
+#endif
+                        throw freefoil_exception("wrong opcode: " + boost::lexical_cast<string>(static_cast<int>(pc_->opcode_)));
+                    }
+                    }
+                }
+L_halt:
+                ;
+            }
+
+            //the string constants, and the params, locals and temporaries holding strings of every frame, from the
+            //current one down to the frame of the entry point; the collector updates the slots of the objects it moves
+            virtual void mark_roots(memory_manager &mm) {
+                for (vector<gcobject_instance_t>::iterator constant_iter = string_constants_.begin(); constant_iter != string_constants_.end(); ++constant_iter) {
+                    mm.mark(*constant_iter);
+                }
+
+                const stack_item * const stack_end = reinterpret_cast<stack_item *>(stack_->end());
+                const register_instruction *pc = pc_;
+                for (stack_item *fp = fp_; fp != stack_end; fp = fp[FRAME_OLD_FP].pstack_item_) {
+                    const std::map<const register_instruction *, gc_safe_point>::const_iterator safe_point_iter = safe_points_.find(pc);
+                    if (safe_point_iter == safe_points_.end()) {
+                        throw freefoil_exception("runtime exception: garbage collection at an instruction which is not a safe point");
+                    }
+                    const vector<int> &ref_slots = safe_point_iter->second.function_->ref_slots_;
+                    for (vector<int>::const_iterator slot_iter = ref_slots.begin(); slot_iter != ref_slots.end(); ++slot_iter) {
+                        mm.mark(fp[*slot_iter].gcobj_);
+                    }
+                    const vector<int> &ref_temporaries = *safe_point_iter->second.ref_temporaries_;
+                    for (vector<int>::const_iterator slot_iter = ref_temporaries.begin(); slot_iter != ref_temporaries.end(); ++slot_iter) {
+                        mm.mark(fp[*slot_iter].gcobj_);
+                    }
+                    pc = fp[FRAME_RETURN_PC].pc_ - 1; //the call the caller waits at
+                }
+            }
+
+            //runs the entry point, and prints the error it fails with, if any
+            void exec() {
+                try {
+                    run();
+                } catch (const std::exception &e) {
+                    std::cout << e.what() << std::endl;
+                } catch (...) {
+                    std::cout << "unknown exception" << std::endl;
+                }
+            }
+        };
+
+        inline void freefoil_register_vm::translator::translate_label(label &l) {
+
+            if (reachable_) {
+                materialize_all();
+            } else if (l.incoming_.empty()) {
+                return; //dead code
+            }
+
+            std::size_t depth = reachable_ ? operands_.size() : l.incoming_.front().second;
+            for (vector<jump_t>::const_iterator iter = l.incoming_.begin(); iter != l.incoming_.end(); ++iter) {
+                depth = std::min(depth, iter->second);
+            }
+
+            vector<std::size_t> jumps_to_label;
+            if (reachable_ and operands_.size() > depth) {
+                shift_down(operands_.size(), depth);
+            }
+
+            //the jumps of the deeper paths go through the stubs shifting their stack down
+            vector<std::size_t> stub_depths;
+            for (vector<jump_t>::const_iterator iter = l.incoming_.begin(); iter != l.incoming_.end(); ++iter) {
+                if (iter->second > depth and std::find(stub_depths.begin(), stub_depths.end(), iter->second) == stub_depths.end()) {
+                    stub_depths.push_back(iter->second);
+                }
+            }
+            if (reachable_ and !stub_depths.empty()) {
+                emit(REG_OPCODE_jmp);
+                jumps_to_label.push_back(result_.code_.size() - 1);
+            }
+            for (vector<std::size_t>::const_iterator stub_iter = stub_depths.begin(); stub_iter != stub_depths.end(); ++stub_iter) {
+                for (vector<jump_t>::const_iterator iter = l.incoming_.begin(); iter != l.incoming_.end(); ++iter) {
+                    if (iter->second == *stub_iter) {
+                        jumps_.push_back(std::make_pair(iter->first, result_.code_.size()));
+                    }
+                }
+                shift_down(*stub_iter, depth);
+                if (stub_iter + 1 != stub_depths.end()) {
+                    emit(REG_OPCODE_jmp);
+                    jumps_to_label.push_back(result_.code_.size() - 1);
+                }
+            }
+
+            l.translated_ = true;
+            l.index_ = result_.code_.size();
+            l.depth_ = depth;
+            for (vector<jump_t>::const_iterator iter = l.incoming_.begin(); iter != l.incoming_.end(); ++iter) {
+                if (iter->second == depth) {
+                    jumps_.push_back(std::make_pair(iter->first, l.index_));
+                }
+            }
+            for (vector<std::size_t>::const_iterator iter = jumps_to_label.begin(); iter != jumps_to_label.end(); ++iter) {
+                jumps_.push_back(std::make_pair(*iter, l.index_));
+            }
+            l.incoming_.clear();
+
+            operands_.clear();
+            for (std::size_t i = 0; i < depth; ++i) {
+                operands_.push_back(temporary(i));
+            }
+            reachable_ = true;
+            retargetable_ = false;
+        }
+
+        inline void freefoil_register_vm::translator::exec() {
+
+            const instructions_stream_t &instructions = func_.instructions_;
+
+            result_.args_count_ = func_.args_count_;
+            for (vector<int>::const_iterator slot_iter = func_.ref_slots_.begin(); slot_iter != func_.ref_slots_.end(); ++slot_iter) {
+                result_.ref_slots_.push_back(variable(*slot_iter));
+            }
+
+            //jump destinations have to be known up front, since the stack is materialized there
+            for (std::size_t pos = 0; pos < instructions.size(); ) {
+                const BYTE opcode = instructions[pos];
+                const int operands_count = get_operands_count(opcode);
+                if (is_branch(opcode)) {
+                    labels_[pos + operands_count + instructions[pos + operands_count]];
+                }
+                pos += 1 + operands_count;
+            }
+
+            for (std::size_t pos = 0; pos < instructions.size(); ) {
+                const BYTE opcode = instructions[pos];
+                const int operands_count = get_operands_count(opcode);
+
+                labels_t::iterator label_iter = labels_.find(pos);
+                if (label_iter != labels_.end()) {
+                    translate_label(label_iter->second);
+                }
+
+                //the halt instruction is kept even after the entry point's final ret, it is the return pc of exec
+                if (reachable_ or opcode == OPCODE_halt) {
+                    const stack_maps_t::const_iterator map_iter = func_.stack_maps_.find(pos);
+                    stack_map_ = map_iter != func_.stack_maps_.end() ? &map_iter->second : NULL;
+                    const std::size_t dst_pos = is_branch(opcode) ? pos + operands_count + instructions[pos + operands_count] : 0;
+                    const superinstruction *fused = find_superinstruction(opcode);
+                    if (fused == NULL) {
+                        translate(opcode, &instructions[pos + 1], dst_pos);
+                    } else {
+                        //fused sequences are translated as their parts, which then get the register forms of their own
+                        const BYTE *operands = &instructions[pos + 1];
+                        for (std::size_t i = 0; i < fused->length_; ++i) {
+                            translate(fused->pattern_[i], operands, dst_pos);
+                            operands += get_operands_count(fused->pattern_[i]);
+                        }
+                    }
+                }
+
+                pos += 1 + operands_count;
+            }
+
+            for (labels_t::const_iterator iter = labels_.begin(); iter != labels_.end(); ++iter) {
+                if (!iter->second.incoming_.empty()) {
+                    throw freefoil_exception("register machine: wrong jump destination");
+                }
+            }
+
+            for (std::size_t i = 0; i < jumps_.size(); ++i) {
+                result_.code_[jumps_[i].first].target_ = &result_.code_[0] + jumps_[i].second;
+            }
+
+            result_.frame_size_ = func_.locals_count_ + max_depth_;
+        }
+
+        inline void freefoil_register_vm::translator::translate(const int opcode, const BYTE *operands, const std::size_t dst_pos) {
+
+            switch (opcode) {
+
+            case OPCODE_iload:
+            case OPCODE_fload:
+            case OPCODE_sload:
+                operands_.push_back(variable(operands[0]));
+                max_depth_ = std::max(max_depth_, operands_.size());
+                break;
+
+            case OPCODE_isave:
+            case OPCODE_fsave:
+            case OPCODE_ssave:
+                save(variable(operands[0]));
+                break;
+
+            case OPCODE_iload_const:
+                constant(REG_OPCODE_iconst, vm_.program_.constants_pool_.get_int_value_from_table(operands[0]));
+                break;
+
+            case OPCODE_fload_const:
+                constant(REG_OPCODE_fconst, operands[0]);
+                break;
+
+            case OPCODE_sload_const:
+                constant(REG_OPCODE_sconst, operands[0]);
+                break;
+
+            case OPCODE_push_true:
+                constant(REG_OPCODE_iconst, 1);
+                break;
+
+            case OPCODE_push_false:
+                constant(REG_OPCODE_iconst, 0);
+                break;
+
+            case OPCODE_iadd:
+                binary(REG_OPCODE_iadd);
+                break;
+
+            case OPCODE_isub:
+                binary(REG_OPCODE_isub);
+                break;
+
+            case OPCODE_imul:
+                binary(REG_OPCODE_imul);
+                break;
+
+            case OPCODE_idiv:
+                binary(REG_OPCODE_idiv);
+                break;
+
+            case OPCODE_fadd:
+                binary(REG_OPCODE_fadd);
+                break;
+
+            case OPCODE_fsub:
+                binary(REG_OPCODE_fsub);
+                break;
+
+            case OPCODE_fmul:
+                binary(REG_OPCODE_fmul);
+                break;
+
+            case OPCODE_fdiv:
+                binary(REG_OPCODE_fdiv);
+                break;
+
+            case OPCODE_sadd:
+                safe_point(operands_.size());
+                binary(REG_OPCODE_sadd);
+                break;
+
+            case OPCODE_seq:
+                binary(REG_OPCODE_seq);
+                break;
+
+            case OPCODE_scmp:
+                binary(REG_OPCODE_scmp);
+                break;
+
+            case OPCODE_inegate:
+                unary(REG_OPCODE_inegate);
+                break;
+
+            case OPCODE_fnegate:
+                unary(REG_OPCODE_fnegate);
+                break;
+
+            case OPCODE_f2i:
+                unary(REG_OPCODE_f2i);
+                break;
+
+            case OPCODE_i2f:
+                unary(REG_OPCODE_i2f);
+                break;
+
+            case OPCODE_ifeq:
+                compare_branch(REG_OPCODE_ifeq, dst_pos);
+                break;
+
+            case OPCODE_ifneq:
+                compare_branch(REG_OPCODE_ifneq, dst_pos);
+                break;
+
+            case OPCODE_ifleq:
+                compare_branch(REG_OPCODE_ifleq, dst_pos);
+                break;
+
+            case OPCODE_ifgeq:
+                compare_branch(REG_OPCODE_ifgeq, dst_pos);
+                break;
+
+            case OPCODE_ifgreater:
+                compare_branch(REG_OPCODE_ifgreater, dst_pos);
+                break;
+
+            case OPCODE_ifless:
+                compare_branch(REG_OPCODE_ifless, dst_pos);
+                break;
+
+            case OPCODE_jz:
+            case OPCODE_jnz: {
+                //the tested value stays on the stack at the destination
+                materialize_all();
+                const int src = operands_.back();
+                emit_branch(opcode == OPCODE_jz ? REG_OPCODE_jz : REG_OPCODE_jnz, dst_pos, operands_.size(), src);
+                pop();
+                break;
+            }
+
+            case OPCODE_pop:
+                pop();
+                break;
+
+            case OPCODE_jmp:
+                materialize_all();
+                emit_branch(REG_OPCODE_jmp, dst_pos, operands_.size());
+                reachable_ = false;
+                break;
+
+            case OPCODE_call:
+            case OPCODE_tailcall: { //a tail call runs as a plain call, which result is returned
+                const function_template &f = vm_.program_.user_funcs_[operands[0]];
+                assert(operands_.size() >= static_cast<std::size_t>(f.args_count_));
+                materialize_all();
+                //the record of the callee's frame goes right below its params, into the temporaries past the top of the stack
+                safe_point(operands_.size() - f.args_count_);
+                emit(REG_OPCODE_call, temporary(operands_.size() + FRAME_RECORD_SIZE - 1), operands[0]);
+                operands_.resize(operands_.size() - f.args_count_);
+                if (!f.void_type_) {
+                    push_temporary();
+                }
+                if (opcode == OPCODE_tailcall) {
+                    emit(REG_OPCODE_ret_value, FRAME_RECORD_SIZE - 1 + func_.args_count_, pop());
+                    reachable_ = false;
+                }
+                break;
+            }
+
+            case OPCODE_builtin_call: {
+                if (operands[0] > BUILTIN_print_string) {
+                    throw freefoil_exception("register machine: fibers, files and parallel_for are run by the stack VM only");
+                }
+                const std::size_t args_count = vm_.builtin_funcs_[operands[0]].args_count_;
+                assert(operands_.size() >= args_count);
+                materialize_all();
+                safe_point(operands_.size());
+                emit(REG_OPCODE_builtin_call, temporary(operands_.size() - 1), operands[0]);
+                operands_.resize(operands_.size() - args_count);
+                break;
+            }
+
+            case OPCODE_ret:
+                emit(REG_OPCODE_ret);
+                reachable_ = false;
+                break;
+
+            case OPCODE_iret:
+            case OPCODE_fret:
+            case OPCODE_sret:
+                //the value goes where the caller's first param was
+                emit(REG_OPCODE_ret_value, FRAME_RECORD_SIZE - 1 + func_.args_count_, pop());
+                reachable_ = false;
+                break;
+
+            case OPCODE_halt:
+                emit(REG_OPCODE_halt);
+                reachable_ = false;
+                break;
+
+            default:
+                throw freefoil_exception("register machine: unsupported opcode " + boost::lexical_cast<string>(opcode));
+            }
+        }
+    }
+}
+
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_CASE
+#if defined(FREEFOIL_THREADED_DISPATCH)
+#undef VM_HANDLER
+#endif
+
+#endif // FREEFOIL_REGISTER_VM_H_INCLUDED
@@ -0,0 +1,76 @@
+#include "freefoil_vm.h"
+#include "batch_pool.h"
+#include "exceptions.h"
+
+#include <sstream>
+
+namespace Freefoil {
+    namespace Runtime {
+
+        void freefoil_vm::parallel_for_int() {
+            parallel_for(INT_TYPE);
+        }
+
+        void freefoil_vm::parallel_for_float() {
+            parallel_for(FLOAT_TYPE);
+        }
+
+        //the range is cut into a few chunks per worker, and the sums of the chunks are added up in their order, so
+        //that a float sum depends on the count of the workers only
+        void freefoil_vm::parallel_for(const value_type_t reduction) {
+            const int lo = pop_int();
+            const int hi = pop_int();
+            std::ostringstream function_name;
+            function_name << *pop_gcobject();
+
+            std::size_t func_index = 0;
+            while (func_index < program_.user_funcs_.size()) {
+                const function_template &f = program_.user_funcs_[func_index];
+                if (f.name_ == function_name.str() and f.param_types_.size() == 1 and f.param_types_[0] == INT_TYPE and
+                    (f.return_type_ == reduction or (reduction == INT_TYPE and f.return_type_ == VOID_TYPE))) {
+                    break;
+                }
+                ++func_index;
+            }
+            if (func_index == program_.user_funcs_.size()) {
+                throw freefoil_exception("runtime exception: no function " + function_name.str() + " taking an int and returning " +
+                                         (reduction == FLOAT_TYPE ? "a float" : "an int or nothing") + " to run in parallel");
+            }
+            if (batch_worker_) {
+                throw freefoil_exception("runtime exception: parallel_for can't be run by a batch worker");
+            }
+
+            value sum = reduction == FLOAT_TYPE ? value(0.0f) : value(0);
+            if (lo < hi) {
+                if (!parallel_pool_) {
+                    parallel_pool_.reset(new batch_pool(0, jit_threshold_));
+                }
+                const long long count = static_cast<long long>(hi) - lo;
+                long long chunks = static_cast<long long>(parallel_pool_->get_workers_count() * PARALLEL_CHUNKS_PER_WORKER);
+                if (chunks > count) {
+                    chunks = count;
+                }
+                for (long long i = 0; i < chunks; ++i) {
+                    parallel_pool_->add_range_job(program_, func_index, static_cast<int>(lo + count * i / chunks), static_cast<int>(lo + count * (i + 1) / chunks));
+                }
+                batch_report report;
+                parallel_pool_->run(report);
+                for (vector<batch_job_result>::const_iterator result_iter = report.results_.begin(); result_iter != report.results_.end(); ++result_iter) {
+                    if (!result_iter->succeeded_) {
+                        throw freefoil_exception("runtime exception: parallel_for: " + result_iter->error_);
+                    }
+                    if (reduction == FLOAT_TYPE) {
+                        sum.f_ += result_iter->sum_.f_;
+                    } else {
+                        sum.i_ += result_iter->sum_.i_;
+                    }
+                }
+            }
+            if (reduction == FLOAT_TYPE) {
+                push_float(sum.f_);
+            } else {
+                push_int(sum.i_);
+            }
+        }
+    }
+}
@@ -4,16 +4,49 @@
 #include "runtime.h"
 #include "opcodes.h"
 #include "memory_manager.h"
+#include "builtins.h"
 #include "exceptions.h"
+#include "vm_stack.h"
+#include "jit_x64.h"
+#include "tier_compiler.h"
+#include "io_poller.h"
 
 #include <iostream>
 #include <cassert>
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <limits>
+#include <sstream>
 
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+//threaded dispatch relies on the GCC "labels as values" extension;
+//define FREEFOIL_NO_THREADED_DISPATCH to build the portable switch loop only
+#if defined(__GNUC__) && !defined(FREEFOIL_NO_THREADED_DISPATCH)
+#define FREEFOIL_THREADED_DISPATCH
+#endif
+
+#if defined(FREEFOIL_THREADED_DISPATCH)
+#define VM_HANDLER(opcode) handlers[opcode] = &&L_##opcode
+#define VM_CASE(opcode) case opcode: L_##opcode:
+#define VM_DISPATCH() goto *pc_->handler_
+#else
+#define VM_CASE(opcode) case opcode:
+#define VM_DISPATCH() continue
+#endif
+
+//advance to the next decoded instruction and dispatch it
+#define VM_NEXT() ++pc_; VM_DISPATCH()
 
 namespace Freefoil {
 
@@ -22,6 +55,7 @@ namespace Freefoil {
         using namespace Private;
 
         using boost::scoped_array;
+        using boost::scoped_ptr;
         using boost::shared_ptr;
 
         using std::map;
@@ -30,15 +64,30 @@ namespace Freefoil {
 
         typedef memory_manager::gcobject_instance_t gcobject_instance_t;
 
-        extern memory_manager g_mm;
+        class batch_pool;
 
-        class freefoil_vm {
+        enum dispatch_mode {
+            switch_dispatch,    //one central switch for all the opcodes
+            threaded_dispatch,  //each opcode handler jumps to the next handler on its own
+        };
+
+#if defined(FREEFOIL_THREADED_DISPATCH)
+        static const dispatch_mode default_dispatch_mode = threaded_dispatch;
+#else
+        static const dispatch_mode default_dispatch_mode = switch_dispatch;
+#endif
+
+        class freefoil_vm : public gc_roots {
+            friend class batch_pool;
 
 //static const int i = 1;
 //#define is_bigendian() ( (*(char*)&i) == 0 )
 
+            struct threaded_instruction;
+
             union stack_item {
                 stack_item *pstack_item_;
+                const threaded_instruction *pc_;
                 gcobject_instance_t gcobj_;
                 int   i_;
                 float f_;
@@ -56,459 +105,2699 @@ namespace Freefoil {
 
             vector<builtin_func_t> builtin_funcs_;
 
-            const program_entry &program_;
+            //top of stack caching: the decoded stream may address specialized versions of the handlers,
+            //which either take the top of the stack from the tos register (s1 input) or leave it there (s1 output);
+            //s0 is the plain state, when every stack item is in memory. The state is known statically at every
+            //instruction: functions start, jumps land and calls return in s0.
+            enum tos_opcode_kind {
+                TOS_iload_s01 = OPCODES_COUNT,
+                TOS_iload_s11,
+                TOS_fload_s01,
+                TOS_fload_s11,
+                TOS_iload_const_s01,
+                TOS_iload_const_s11,
+                TOS_iload_iload_s01,
+                TOS_iload_iload_s11,
+                TOS_iload_iload_const_s01,
+                TOS_iload_iload_const_s11,
+                TOS_iadd_s01,
+                TOS_iadd_s11,
+                TOS_isub_s01,
+                TOS_isub_s11,
+                TOS_imul_s01,
+                TOS_imul_s11,
+                TOS_isave_s10,
+                TOS_ifeq_s10,
+                TOS_ifneq_s10,
+                TOS_ifleq_s10,
+                TOS_ifgeq_s10,
+                TOS_ifgreater_s10,
+                TOS_ifless_s10,
+                TOS_jz_s10,
+                TOS_jnz_s10,
+                TOS_iret_s10,
+                TOS_pop_s10,
+                TOS_flush_s10, //spills the tos register to the stack
+
+                //the stubs the bottom frames of the fiber stack segments return into, in s0
+                STUB_segment_return,
+                STUB_fiber_exit,
+                //the trap the jumps which leave the code of their function are sent to
+                STUB_bad_jump,
+
+                DECODED_OPCODES_COUNT //must be the last one
+            };
+
+            static const int NO_VARIANT = -1;
+
+            struct tos_variants {
+                int opcode_;
+                int s01_; //takes the stack from memory, leaves the top in the tos register
+                int s11_; //takes the top from the tos register, leaves the top in the tos register
+                int s10_; //takes the top from the tos register, leaves the whole stack in memory
+            };
+
+            static const tos_variants *find_tos_variants(const int opcode) {
+                static const tos_variants variants_table[] = {
+                    { OPCODE_iload, TOS_iload_s01, TOS_iload_s11, NO_VARIANT },
+                    { OPCODE_fload, TOS_fload_s01, TOS_fload_s11, NO_VARIANT },
+                    { OPCODE_iload_const, TOS_iload_const_s01, TOS_iload_const_s11, NO_VARIANT },
+                    { OPCODE_iload_iload, TOS_iload_iload_s01, TOS_iload_iload_s11, NO_VARIANT },
+                    { OPCODE_iload_iload_const, TOS_iload_iload_const_s01, TOS_iload_iload_const_s11, NO_VARIANT },
+                    { OPCODE_iadd, TOS_iadd_s01, TOS_iadd_s11, NO_VARIANT },
+                    { OPCODE_isub, TOS_isub_s01, TOS_isub_s11, NO_VARIANT },
+                    { OPCODE_imul, TOS_imul_s01, TOS_imul_s11, NO_VARIANT },
+                    { OPCODE_isave, NO_VARIANT, NO_VARIANT, TOS_isave_s10 },
+                    { OPCODE_ifeq, NO_VARIANT, NO_VARIANT, TOS_ifeq_s10 },
+                    { OPCODE_ifneq, NO_VARIANT, NO_VARIANT, TOS_ifneq_s10 },
+                    { OPCODE_ifleq, NO_VARIANT, NO_VARIANT, TOS_ifleq_s10 },
+                    { OPCODE_ifgeq, NO_VARIANT, NO_VARIANT, TOS_ifgeq_s10 },
+                    { OPCODE_ifgreater, NO_VARIANT, NO_VARIANT, TOS_ifgreater_s10 },
+                    { OPCODE_ifless, NO_VARIANT, NO_VARIANT, TOS_ifless_s10 },
+                    { OPCODE_jz, NO_VARIANT, NO_VARIANT, TOS_jz_s10 },
+                    { OPCODE_jnz, NO_VARIANT, NO_VARIANT, TOS_jnz_s10 },
+                    { OPCODE_iret, NO_VARIANT, NO_VARIANT, TOS_iret_s10 },
+                    { OPCODE_pop, NO_VARIANT, NO_VARIANT, TOS_pop_s10 },
+                    //the stack neutral superinstructions run unchanged in either state
+                    { OPCODE_iload_iload_iadd_isave, NO_VARIANT, OPCODE_iload_iload_iadd_isave, NO_VARIANT },
+                    { OPCODE_iload_iload_isub_isave, NO_VARIANT, OPCODE_iload_iload_isub_isave, NO_VARIANT },
+                    { OPCODE_iload_iload_imul_isave, NO_VARIANT, OPCODE_iload_iload_imul_isave, NO_VARIANT },
+                    { OPCODE_iload_iload_const_iadd_isave, NO_VARIANT, OPCODE_iload_iload_const_iadd_isave, NO_VARIANT },
+                    { OPCODE_iload_iload_const_isub_isave, NO_VARIANT, OPCODE_iload_iload_const_isub_isave, NO_VARIANT },
+                };
+                for (std::size_t i = 0; i < sizeof(variants_table) / sizeof(variants_table[0]); ++i) {
+                    if (variants_table[i].opcode_ == opcode) {
+                        return &variants_table[i];
+                    }
+                }
+                return NULL;
+            }
+
+            //whether the opcode can take the top of the stack from the tos register
+            static bool takes_tos(const int opcode) {
+                const tos_variants *variants = find_tos_variants(opcode);
+                return variants != NULL and (variants->s11_ != NO_VARIANT or variants->s10_ != NO_VARIANT);
+            }
+
+            //instruction of the pre-decoded stream: the bytecode is translated once per program load,
+            //so that handlers neither decode operand bytes nor compute jump destinations
+            struct threaded_instruction {
+                const void *handler_; //address of the opcode handler (or of the central switch)
+                int opcode_; //bytecode opcode, or its top of stack caching version
+                int operands_[MAX_OPERANDS_COUNT]; //full-width operands: variable offsets, constant indices or function index
+                const threaded_instruction *target_; //resolved jump destination, or the first instruction of the callee
+#if defined(FREEFOIL_JIT)
+                const void *native_; //machine code of the instruction, known at function entries and call continuations of jitted functions
+#endif
+            };
+
+            typedef vector<threaded_instruction> threaded_code_t;
+            vector<threaded_code_t> threaded_funcs_; //indexed as program_.user_funcs_
+            std::list<threaded_code_t> retired_funcs_; //the baseline code of the optimized functions, which frames may still return into
+
+            vector<const void *> handlers_; //the handlers the code is decoded with, empty for the switch dispatch
+            const void *switch_handler_;
 
-            static const std::size_t STACK_SIZE = 512;
+            const program_entry &program_;
+            const dispatch_mode dispatch_mode_;
+            const bool tos_caching_;
+            const std::size_t jit_threshold_; //calls of a function before it is jitted, 0 disables the JIT
+            const bool perf_map_;
+            const std::size_t tier_threshold_; //calls of a function before it is recompiled by the optimizing tier, 0 disables the tier
+
+            //the frames of the stack at a GC safe point: the function the instruction belongs to, and which of its operand stack slots hold pointers
+            struct gc_safe_point {
+                const function_template *function_;
+                const stack_map_t *stack_map_;
+            };
+            std::map<const threaded_instruction *, gc_safe_point> safe_points_; //of every decoded instruction which is one, retired code included
+            std::list<stack_maps_t> optimized_stack_maps_; //of the code the optimizing tier compiled
+
+            memory_manager heap_; //of the objects of every run, so that the VMs on different threads share no heap
+
+            vector<gcobject_instance_t> string_constants_; //indexed as the string table of program_.constants_pool_, marked as roots
+
+            //indexed as program_.user_funcs_: the calls of each function, counted down to the next one the tier or the JIT
+            //has to look at, so that the other calls only decrement a counter
+            vector<std::size_t> call_counts_;
+            vector<std::size_t> call_countdowns_;
+            scoped_ptr<tier_compiler> tier_compiler_;
+            vector<bool> tier_pending_; //the functions which are yet to be requested or to get their optimized code
+
+            const std::size_t stack_size_; //in stack items
+            const std::size_t max_stack_size_;
+
+            //a call frame is one contiguous record on the stack:
+            //  fp_ + FRAME_RECORD_SIZE ...  params, pushed by the caller (first param at the lowest address)
+            //  fp_ + 1                      return pc
+            //  fp_                          caller's frame pointer
+            //  fp_ - 1 ...                  locals
+            //the bytecode addresses params from fp + 1, so the decoder rebiases their offsets past the record
+            enum {
+                FRAME_OLD_FP = 0,
+                FRAME_RETURN_PC = 1,
+                FRAME_RECORD_SIZE = 2
+            };
 
-            scoped_array<ULONG> pMemory_;
-            scoped_array<stack_item> pStack_;
+            scoped_ptr<vm_stack> stack_;
+            stack_item *stack_begin_; //the lowest stack item of the stack in use; the VM stack grows down from the end of vm_stack
 
             stack_item *sp_; //operands stack ponter
-            BYTE ip_;        //current decoded instruction
-            const BYTE *pc_; //current position in the instructions stream
+            const threaded_instruction *pc_; //current position in the decoded instructions stream
             stack_item *fp_; //frame pointer
-            ULONG *pMemory_sp_;
+
+            //green threads: spawn() starts a user function on a fiber, a stack of its own, which the VM switches to and from
+            //within one native thread. The switches are cooperative: at yield(), join() and the reads which would block,
+            //and at the calls once the running fiber has made FIBER_SLICE_CALLS of them, so that a busy fiber doesn't starve
+            //the others; as the language has no loops, a long computation is bound to make calls. A fiber stack is a chain of small segments: a call which
+            //finds no room in the current segment goes on in a new one, so a fiber takes a few hundred bytes until it goes
+            //deep. The main fiber runs the entry point on the VM stack, and the run is over once it and every fiber are.
+            struct stack_segment {
+                stack_segment *prev_;
+                const threaded_instruction *return_pc_; //of the call which made the first frame of the segment
+                stack_item *return_sp_; //in the previous segment, once the call has popped its params
+                std::size_t size_;      //of the stack items, which follow the header
+
+                stack_item *begin() {
+                    return reinterpret_cast<stack_item *>(this + 1);
+                }
+
+                stack_item *end() {
+                    return begin() + size_;
+                }
+            };
+
+            struct fiber {
+                int id_;
+                fiber *next_;    //in the run queue, or among the fibers joining the same one
+                fiber *joiners_;
+                stack_segment *segment_; //in use, NULL for the main fiber
+                stack_segment *spare_;   //the last one left, kept for the next call which needs one
+                std::size_t stack_items_; //of the segments, bounded by the max stack size
+                int func_index_;
+                stack_item arg_;
+                bool started_; //the frame of the function is pushed once the fiber is first scheduled
+                //the registers while the fiber waits: it resumes at pc_, and its stack walk starts at safe_point_,
+                //the instruction it was switched out at, or NULL for the main fiber waiting at the halt
+                stack_item *sp_;
+                stack_item *fp_;
+                const threaded_instruction *pc_;
+                const threaded_instruction *safe_point_;
+
+                fiber()
+                    :id_(0), next_(NULL), joiners_(NULL), segment_(NULL), spare_(NULL), stack_items_(0), func_index_(0), started_(true),
+                     sp_(NULL), fp_(NULL), pc_(NULL), safe_point_(NULL) {
+                    arg_.pstack_item_ = NULL;
+                }
+            };
+
+            static const int FIBER_SLICE_CALLS = 1000;
+            static const std::size_t FIBER_MIN_STACK_SIZE = 32;       //stack items of the first segment of a fiber, at least
+            static const std::size_t FIBER_MAX_SEGMENT_SIZE = 4096;   //stack items the segments double up to
+
+            vector<fiber *> fibers_; //spawned in the run, by id - 1; NULL once over
+            fiber main_fiber_;
+            fiber *current_fiber_;
+            fiber *run_queue_head_;
+            fiber *run_queue_tail_;
+            std::size_t live_fibers_; //spawned and not over
+            bool main_waiting_;   //for the fibers at the halt
+
+            //a builtin has queued the current fiber or made it wait: it resumes past the builtin call, or at it again
+            enum fiber_switch {
+                NO_SWITCH,
+                SWITCH_PAST_CALL,
+                SWITCH_RETRYING_CALL
+            };
+            fiber_switch pending_switch_;
+            int fiber_budget_;    //the calls left to the current fiber, huge while there are no others
+            threaded_instruction segment_return_;
+            threaded_instruction fiber_exit_;
+            threaded_instruction function_exit_; //a halt, which the function run_function() runs returns into
+
+            //a read which would block parks the fiber on the poller, which the scheduler polls as it switches the fibers,
+            //and waits on once none of them is runnable; the read is made again once the file is ready
+            static const std::size_t READ_CHUNK_SIZE = 4096;
+            io_poller poller_;
+            struct open_file_state {
+                fiber *waiter_; //the fiber the file is waited for by, if any
+                bool at_end_;   //a read has found the end of the file
+
+                open_file_state()
+                    :waiter_(NULL), at_end_(false)
+                    {}
+            };
+            std::map<int, open_file_state> open_files_; //the files the run opened
+
+            //parallel_for runs the user function on the workers of a batch pool, each of which has a VM of its own for
+            //the program; the VM waits for the range to be done, its fibers included. The pool is started by the first
+            //parallel_for, and the builtins are defined with it, in freefoil_vm.cpp. The VMs of the batch workers don't
+            //start pools of their own, as the workers keep the processors busy already
+            static const std::size_t PARALLEL_CHUNKS_PER_WORKER = 4; //so that stealing evens out the chunks which take longer
+            shared_ptr<batch_pool> parallel_pool_;
+            bool batch_worker_;
+
+            void parallel_for(const value_type_t reduction);
+            void parallel_for_int();
+            void parallel_for_float();
 
             //bool is_big_endian;
 
             void print_int(){
-                std::cout << pop_int();
+                builtin_print_int(pop_int());
             }
 
             void print_float(){
-                std::cout << pop_float();
+                builtin_print_float(pop_float());
             }
 
             void print_string(){
-                std::cout << *pop_gcobject();
+                builtin_print_string(heap_, *pop_gcobject());
             }
             
             void print_bool(){
-				std::cout << (pop_int() == 1 ? "true" : "false");
+				builtin_print_bool(pop_int());
 			}
 
+            void spawn() {
+                std::ostringstream function_name;
+                function_name << *pop_gcobject();
+                push_int(spawn_fiber(function_name.str(), NULL));
+            }
+
+            void spawn_int() {
+                std::ostringstream function_name;
+                function_name << *pop_gcobject();
+                stack_item arg;
+                arg.pstack_item_ = NULL;
+                arg.i_ = pop_int();
+                push_int(spawn_fiber(function_name.str(), &arg));
+            }
+
+            void yield() {
+                if (run_queue_head_ != NULL) {
+                    push_runnable(*current_fiber_);
+                    pending_switch_ = SWITCH_PAST_CALL;
+                }
+            }
+
+            void join() {
+                const int id = pop_int();
+                if (id < 1 or static_cast<std::size_t>(id) > fibers_.size()) {
+                    throw freefoil_exception("runtime exception: no fiber " + boost::lexical_cast<string>(id) + " to join");
+                }
+                fiber * const f = fibers_[id - 1];
+                if (f == NULL) {
+                    return; //over already
+                }
+                if (f == current_fiber_) {
+                    throw freefoil_exception("runtime exception: a fiber can't join itself");
+                }
+                current_fiber_->next_ = f->joiners_;
+                f->joiners_ = current_fiber_;
+                pending_switch_ = SWITCH_PAST_CALL;
+            }
+
+            void open_file() {
+                std::ostringstream path;
+                path << *pop_gcobject();
+                const int fd = io_poller::open_file(path.str().c_str());
+                if (fd == -1) {
+                    throw freefoil_exception("runtime exception: can't open " + path.str());
+                }
+                open_files_[fd] = open_file_state();
+                push_int(fd);
+            }
+
+            //what the file has, up to READ_CHUNK_SIZE bytes, and the empty string at its end, which eof() tells from
+            //the others. The file stays on the stack until the read is done, as a read which would block is made again
+            void read_file() {
+                const int fd = sp_->i_;
+                open_file_state &file = get_open_file(fd);
+                if (file.waiter_ != NULL and file.waiter_ != current_fiber_) {
+                    throw freefoil_exception("runtime exception: another fiber reads the file " + boost::lexical_cast<string>(fd));
+                }
+                file.waiter_ = NULL;
+                char buffer[READ_CHUNK_SIZE];
+                long count = io_poller::read_file(fd, buffer, sizeof(buffer));
+                if (count == -1) {
+                    if (poller_.watch(fd, current_fiber_)) {
+                        file.waiter_ = current_fiber_;
+                        pending_switch_ = SWITCH_RETRYING_CALL;
+                        return;
+                    }
+                    io_poller::set_blocking(fd);
+                    count = io_poller::read_file(fd, buffer, sizeof(buffer));
+                }
+                file.at_end_ = count == 0;
+                ++sp_;
+                push_gcobject(heap_.make_string(string(buffer, count)));
+            }
+
+            void file_at_end() {
+                push_int(get_open_file(pop_int()).at_end_ ? 1 : 0);
+            }
+
+            void close_file() {
+                const int fd = pop_int();
+                if (get_open_file(fd).waiter_ != NULL) {
+                    throw freefoil_exception("runtime exception: another fiber reads the file " + boost::lexical_cast<string>(fd));
+                }
+                poller_.forget(fd);
+                io_poller::close_file(fd);
+                open_files_.erase(fd);
+            }
+
+            open_file_state &get_open_file(const int fd) {
+                const std::map<int, open_file_state>::iterator file_iter = open_files_.find(fd);
+                if (file_iter == open_files_.end()) {
+                    throw freefoil_exception("runtime exception: no open file " + boost::lexical_cast<string>(fd));
+                }
+                return file_iter->second;
+            }
+
             void init() {
-                pStack_.reset(new stack_item[STACK_SIZE]);
-                sp_ = fp_ = pStack_.get() + STACK_SIZE;
-                pMemory_.reset(new ULONG[STACK_SIZE]);
-                pMemory_sp_ = pMemory_.get() + STACK_SIZE;
+                stack_.reset(new vm_stack(stack_size_ * sizeof(stack_item), max_stack_size_ * sizeof(stack_item)));
+                stack_begin_ = reinterpret_cast<stack_item *>(stack_->begin());
+                sp_ = fp_ = reinterpret_cast<stack_item *>(stack_->end());
 
                 builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::print_int));
                 builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::print_float));
                 builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::print_bool));
                 builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::print_string));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::spawn));
+                builtin_funcs_.push_back(builtin_func_t(2, &freefoil_vm::spawn_int));
+                builtin_funcs_.push_back(builtin_func_t(0, &freefoil_vm::yield));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::join));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::open_file));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::read_file));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::file_at_end));
+                builtin_funcs_.push_back(builtin_func_t(1, &freefoil_vm::close_file));
+                builtin_funcs_.push_back(builtin_func_t(3, &freefoil_vm::parallel_for_int));
+                builtin_funcs_.push_back(builtin_func_t(3, &freefoil_vm::parallel_for_float));
                 //TODO: add others
             }
 
+            //the function takes the arg, an int, if there is one; the fiber is queued to run after the ones queued already
+            int spawn_fiber(const string &function_name, const stack_item *arg) {
+                const int args_count = arg != NULL ? 1 : 0;
+                std::size_t func_index = 0;
+                while (func_index < program_.user_funcs_.size()) {
+                    const function_template &f = program_.user_funcs_[func_index];
+                    if (f.name_ == function_name and f.param_types_.size() == static_cast<std::size_t>(args_count) and
+                        (args_count == 0 or f.param_types_[0] == INT_TYPE)) {
+                        break;
+                    }
+                    ++func_index;
+                }
+                if (func_index == program_.user_funcs_.size()) {
+                    throw freefoil_exception("runtime exception: no function " + function_name + " to spawn with " +
+                                             (arg != NULL ? "an int arg" : "no args"));
+                }
+
+                fiber * const f = new fiber();
+                f->func_index_ = static_cast<int>(func_index);
+                if (arg != NULL) {
+                    f->arg_ = *arg;
+                }
+                f->started_ = false;
+                fibers_.push_back(f);
+                f->id_ = static_cast<int>(fibers_.size());
+                ++live_fibers_;
+                push_runnable(*f);
+                if (fiber_budget_ > FIBER_SLICE_CALLS) {
+                    fiber_budget_ = FIBER_SLICE_CALLS;
+                }
+                return f->id_;
+            }
+
+            void push_runnable(fiber &f) {
+                f.next_ = NULL;
+                if (run_queue_tail_ != NULL) {
+                    run_queue_tail_->next_ = &f;
+                } else {
+                    run_queue_head_ = &f;
+                }
+                run_queue_tail_ = &f;
+            }
+
+            //saves the registers of the current fiber, which is either queued or waiting already
+            void suspend_fiber(const threaded_instruction *resume_pc, const threaded_instruction *safe_point) {
+                fiber &f = *current_fiber_;
+                f.sp_ = sp_;
+                f.fp_ = fp_;
+                f.pc_ = resume_pc;
+                f.safe_point_ = safe_point;
+            }
+
+            //switches to the first fiber of the run queue, in s0; the fibers whose files are ready are queued first
+            void resume_next_fiber() {
+                if (poller_.has_waiters()) {
+                    poll_files(run_queue_head_ == NULL);
+                }
+                fiber * const next = run_queue_head_;
+                if (next == NULL) {
+                    throw freefoil_exception("runtime exception: deadlock, every fiber waits for another one");
+                }
+                run_queue_head_ = next->next_;
+                if (run_queue_head_ == NULL) {
+                    run_queue_tail_ = NULL;
+                }
+                current_fiber_ = next;
+                fiber_budget_ = live_fibers_ != 0 ? FIBER_SLICE_CALLS : INT_MAX;
+
+                if (!next->started_) {
+                    start_fiber(*next);
+                    return;
+                }
+                sp_ = next->sp_;
+                fp_ = next->fp_;
+                pc_ = next->pc_;
+                stack_begin_ = next->segment_ != NULL ? next->segment_->begin() : reinterpret_cast<stack_item *>(stack_->begin());
+            }
+
+            void poll_files(const bool block) {
+                vector<void *> ready;
+                poller_.wait(ready, block);
+                for (vector<void *>::const_iterator waiter_iter = ready.begin(); waiter_iter != ready.end(); ++waiter_iter) {
+                    push_runnable(*static_cast<fiber *>(*waiter_iter));
+                }
+            }
+
+            //the function of the fiber returns into fiber_exit_, which ends the fiber
+            void start_fiber(fiber &f) {
+                const function_template &func = program_.user_funcs_[f.func_index_];
+                f.started_ = true;
+                stack_segment * const segment = take_segment(f, func.args_count_ + frame_room(func), FIBER_MIN_STACK_SIZE);
+                segment->prev_ = NULL;
+                segment->return_pc_ = NULL;
+                segment->return_sp_ = NULL;
+                f.segment_ = segment;
+                stack_begin_ = segment->begin();
+                sp_ = fp_ = segment->end();
+                if (func.args_count_ != 0) {
+                    push_item(f.arg_);
+                }
+                enter_frame(func.locals_count_, frame_room(func), &fiber_exit_);
+                pc_ = &threaded_funcs_[f.func_index_][0];
+            }
+
+            //the fiber is over: the fibers joining it are queued, and the main one too if it waits for the last fiber
+            void end_fiber() {
+                fiber * const f = current_fiber_;
+                fiber *joiner = f->joiners_;
+                while (joiner != NULL) {
+                    fiber * const next = joiner->next_;
+                    push_runnable(*joiner);
+                    joiner = next;
+                }
+                if (--live_fibers_ == 0 and main_waiting_) {
+                    main_waiting_ = false;
+                    push_runnable(main_fiber_);
+                }
+                fibers_[f->id_ - 1] = NULL;
+                current_fiber_ = NULL;
+                delete_fiber(f);
+            }
+
+            //a segment of at least size stack items, the spare one if it is big enough
+            stack_segment *take_segment(fiber &f, const std::size_t size, const std::size_t preferred_size) {
+                if (f.spare_ != NULL and f.spare_->size_ >= size) {
+                    stack_segment * const spare = f.spare_;
+                    f.spare_ = NULL;
+                    return spare;
+                }
+                const std::size_t segment_size = size > preferred_size ? size : preferred_size;
+                if (f.stack_items_ + segment_size > max_stack_size_) {
+                    throw freefoil_exception("stack overflow");
+                }
+                stack_segment * const segment = static_cast<stack_segment *>(std::malloc(sizeof(stack_segment) + segment_size * sizeof(stack_item)));
+                if (segment == NULL) {
+                    throw std::bad_alloc();
+                }
+                segment->size_ = segment_size;
+                f.stack_items_ += segment_size;
+                return segment;
+            }
+
+            void free_segment(fiber &f, stack_segment *segment) {
+                f.stack_items_ -= segment->size_;
+                std::free(segment);
+            }
+
+            void delete_fiber(fiber *f) {
+                while (f->segment_ != NULL) {
+                    stack_segment * const prev = f->segment_->prev_;
+                    free_segment(*f, f->segment_);
+                    f->segment_ = prev;
+                }
+                if (f->spare_ != NULL) {
+                    free_segment(*f, f->spare_);
+                }
+                delete f;
+            }
+
+            //drops the fibers and closes the files a run left, and makes the main fiber the running one
+            void reset_fibers() {
+                poller_.reset();
+                for (std::map<int, open_file_state>::const_iterator file_iter = open_files_.begin(); file_iter != open_files_.end(); ++file_iter) {
+                    io_poller::close_file(file_iter->first);
+                }
+                open_files_.clear();
+
+                for (vector<fiber *>::iterator fiber_iter = fibers_.begin(); fiber_iter != fibers_.end(); ++fiber_iter) {
+                    if (*fiber_iter != NULL) {
+                        delete_fiber(*fiber_iter);
+                    }
+                }
+                fibers_.clear();
+                main_fiber_ = fiber();
+                current_fiber_ = &main_fiber_;
+                run_queue_head_ = run_queue_tail_ = NULL;
+                live_fibers_ = 0;
+                main_waiting_ = false;
+                pending_switch_ = NO_SWITCH;
+                fiber_budget_ = INT_MAX;
+            }
+
+            //the current fiber, out of budget at a call, makes way for the next runnable one and makes the call once it resumes
+            bool preempt_fiber() {
+                fiber_budget_ = live_fibers_ != 0 ? FIBER_SLICE_CALLS : INT_MAX;
+                if (run_queue_head_ == NULL) {
+                    return false;
+                }
+                push_runnable(*current_fiber_);
+                suspend_fiber(pc_, pc_);
+                resume_next_fiber();
+                return true;
+            }
+
+            //gives the call at pc_, which finds no room in the segment of the fiber, a new segment: the params move
+            //to its top, and the frame returns into segment_return_, which goes back to the previous segment.
+            //The main fiber runs on the VM stack, which commits more of its reserve instead
+            const threaded_instruction *more_stack(const int room, const threaded_instruction *return_pc) {
+                fiber &f = *current_fiber_;
+                if (f.segment_ == NULL) {
+                    grow_stack(room);
+                    return return_pc;
+                }
+                const int args_count = program_.user_funcs_[pc_->operands_[0]].args_count_;
+                const std::size_t doubled_size = 2 * f.segment_->size_;
+                stack_segment * const segment = take_segment(f, args_count + room, doubled_size < FIBER_MAX_SEGMENT_SIZE ? doubled_size : FIBER_MAX_SEGMENT_SIZE);
+                segment->prev_ = f.segment_;
+                segment->return_pc_ = return_pc;
+                segment->return_sp_ = sp_ + args_count;
+                stack_item * const params = segment->end() - args_count;
+                std::copy(sp_, sp_ + args_count, params);
+                sp_ = params;
+                f.segment_ = segment;
+                stack_begin_ = segment->begin();
+                return &segment_return_;
+            }
+
+            //commits the VM stack so that there are size stack items of room below sp_
+            void grow_stack(const std::size_t size) {
+                const stack_item * const stack_end = reinterpret_cast<stack_item *>(stack_->end());
+                if (!stack_->grow((stack_end - sp_ + size) * sizeof(stack_item))) {
+                    throw freefoil_exception("stack overflow");
+                }
+                stack_begin_ = reinterpret_cast<stack_item *>(stack_->begin());
+            }
+
+            //the first frame of the segment has returned, and left its value, if any, at the end of the segment
+            void pop_segment() {
+                fiber &f = *current_fiber_;
+                stack_segment * const segment = f.segment_;
+                stack_item * const sp = segment->return_sp_ - (segment->end() - sp_);
+                std::copy(sp_, segment->end(), sp);
+                sp_ = sp;
+                pc_ = segment->return_pc_;
+                f.segment_ = segment->prev_;
+                stack_begin_ = f.segment_->begin();
+                if (f.spare_ != NULL) {
+                    free_segment(f, f.spare_);
+                }
+                f.spare_ = segment;
+            }
+
+            //makes the strings sload_const pushes; they never move, so the JIT takes their addresses as immediates
+            void make_string_constants() {
+                const constants_pool &pool = program_.constants_pool_;
+                string_constants_.resize(pool.get_string_constants_count());
+                for (std::size_t i = 0; i < string_constants_.size(); ++i) {
+                    string_constants_[i] = heap_.make_old_string(pool.get_string_value_from_table(i));
+                }
+            }
+
+            //translates the bytecode of every user function into the threaded code;
+            //handlers == NULL means that every instruction is dispatched through switch_handler
+            void decode(const void * const *handlers, const void *switch_handler) {
+
+                if (handlers != NULL) {
+                    handlers_.assign(handlers, handlers + DECODED_OPCODES_COUNT);
+                }
+                switch_handler_ = switch_handler;
+
+                threaded_funcs_.clear();
+                threaded_funcs_.resize(program_.user_funcs_.size());
+                safe_points_.clear();
+
+                for (std::size_t func_index = 0; func_index < program_.user_funcs_.size(); ++func_index) {
+                    const function_template &f = program_.user_funcs_[func_index];
+                    decode_function(f, f.instructions_, f.stack_maps_, threaded_funcs_[func_index]);
+                }
+
+                //calls are resolved once every function is decoded
+                for (std::size_t func_index = 0; func_index < threaded_funcs_.size(); ++func_index) {
+                    link_calls(threaded_funcs_[func_index]);
+                }
+
+                const int no_operands[MAX_OPERANDS_COUNT] = {};
+                threaded_code_t stubs;
+                vector<std::size_t> byte_position;
+                append(stubs, byte_position, 0, STUB_segment_return, no_operands, handlers, switch_handler);
+                append(stubs, byte_position, 0, STUB_fiber_exit, no_operands, handlers, switch_handler);
+                append(stubs, byte_position, 0, OPCODE_halt, no_operands, handlers, switch_handler);
+                segment_return_ = stubs[0];
+                fiber_exit_ = stubs[1];
+                function_exit_ = stubs[2];
+            }
+
+            //where the branch at pos goes, which is past the end of the code if its offset is wrong;
+            //relative offsets are the last operand and are counted from its own byte
+            static std::size_t get_jump_dst(const instructions_stream_t &instructions, const std::size_t pos) {
+                const std::size_t offset_pos = pos + get_operands_count(instructions[pos]);
+                if (offset_pos >= instructions.size()) {
+                    return instructions.size();
+                }
+                return std::min(offset_pos + instructions[offset_pos], instructions.size());
+            }
+
+            //translates the instructions of the function, which are either its own or their optimized version,
+            //and registers the safe points of the code with the stack maps of the instructions
+            void decode_function(const function_template &f, const instructions_stream_t &instructions, const stack_maps_t &stack_maps, threaded_code_t &code) {
+                const void * const *handlers = handlers_.empty() ? NULL : &handlers_[0];
+                const void *switch_handler = switch_handler_;
+
+                vector<std::size_t> decoded_index(instructions.size() + 1);
+                vector<std::size_t> byte_position;
+                vector<bool> is_jump_dst(instructions.size() + 1, false);
+                vector<bool> is_instruction(instructions.size() + 1, false);
+
+                for (std::size_t pos = 0; pos < instructions.size(); pos += 1 + get_operands_count(instructions[pos])) {
+                    is_instruction[pos] = true;
+                }
+                //the offsets of unreachable code are not checked by the verifier, so they are not trusted either:
+                //a jump which misses every instruction of the function is sent to a trap
+                bool has_bad_jumps = false;
+                for (std::size_t pos = 0; pos < instructions.size(); pos += 1 + get_operands_count(instructions[pos])) {
+                    if (is_branch(instructions[pos])) {
+                        const std::size_t dst_pos = get_jump_dst(instructions, pos);
+                        if (is_instruction[dst_pos]) {
+                            is_jump_dst[dst_pos] = true;
+                        } else {
+                            has_bad_jumps = true;
+                        }
+                    }
+                }
+
+                const int no_operands[MAX_OPERANDS_COUNT] = {};
+
+                bool tos_cached = false; //the state before the instruction being decoded
+
+                std::size_t pos = 0;
+                while (pos < instructions.size()) {
+                    const BYTE opcode = instructions[pos];
+                    const int operands_count = get_operands_count(opcode);
+                    assert(pos + operands_count < instructions.size());
+
+                    int decoded_opcode = opcode;
+                    if (tos_caching_) {
+                        const tos_variants *variants = find_tos_variants(opcode);
+                        if (tos_cached and (is_jump_dst[pos] or !takes_tos(opcode))) {
+                            //jumps land in the plain state
+                            append(code, byte_position, pos, TOS_flush_s10, no_operands, handlers, switch_handler);
+                            tos_cached = false;
+                        }
+                        if (tos_cached) {
+                            decoded_opcode = variants->s11_ != NO_VARIANT ? variants->s11_ : variants->s10_;
+                            tos_cached = variants->s11_ != NO_VARIANT;
+                        } else if (variants != NULL and variants->s01_ != NO_VARIANT) {
+                            //the top is left in the register only if the next instruction is going to take it from there
+                            const std::size_t next_pos = pos + 1 + operands_count;
+                            if (next_pos < instructions.size() and !is_jump_dst[next_pos] and takes_tos(instructions[next_pos])) {
+                                decoded_opcode = variants->s01_;
+                                tos_cached = true;
+                            }
+                        }
+                    }
+
+                    int operands[MAX_OPERANDS_COUNT] = {};
+                    for (int i = 0; i < operands_count; ++i) {
+                        operands[i] = instructions[pos + 1 + i];
+                        if (is_frame_slot_operand(opcode, i) and operands[i] > 0) {
+                            operands[i] += FRAME_RECORD_SIZE - 1; //params lie past the frame record
+                        }
+                    }
+                    if (is_return(opcode)) {
+                        operands[0] = f.args_count_; //the return pops the params along with the frame record
+                    } else if (opcode == OPCODE_call) {
+                        const function_template &callee = program_.user_funcs_[operands[0]];
+                        operands[1] = callee.locals_count_; //the callee's frame size
+                        operands[2] = frame_room(callee);
+                    } else if (opcode == OPCODE_tailcall) {
+                        operands[1] = program_.user_funcs_[operands[0]].locals_count_;
+                        operands[2] = f.args_count_; //the params area the callee's params are moved to
+                    }
+
+                    decoded_index[pos] = code.size();
+                    append(code, byte_position, pos, decoded_opcode, operands, handlers, switch_handler);
+
+                    pos += 1 + operands_count;
+                }
+                const std::size_t code_size = code.size();
+                decoded_index[instructions.size()] = code_size;
+                if (has_bad_jumps) {
+                    append(code, byte_position, instructions.size(), STUB_bad_jump, no_operands, handlers, switch_handler);
+                }
+
+                //now the code is not going to be reallocated, so jump destinations may be resolved
+                for (std::size_t i = 0; i < code_size; ++i) {
+                    const BYTE opcode = instructions[byte_position[i]];
+                    if (is_branch(opcode) and code[i].opcode_ != TOS_flush_s10) {
+                        const std::size_t dst_pos = get_jump_dst(instructions, byte_position[i]);
+                        code[i].target_ = &code[0] + (is_instruction[dst_pos] ? decoded_index[dst_pos] : code_size);
+                    }
+                }
+
+                for (stack_maps_t::const_iterator map_iter = stack_maps.begin(); map_iter != stack_maps.end(); ++map_iter) {
+                    assert(map_iter->first < instructions.size());
+                    gc_safe_point &safe_point = safe_points_[&code[0] + decoded_index[map_iter->first]];
+                    safe_point.function_ = &f;
+                    safe_point.stack_map_ = &map_iter->second;
+                }
+            }
+
+            void link_calls(threaded_code_t &code) const {
+                for (std::size_t i = 0; i < code.size(); ++i) {
+                    if (code[i].opcode_ == OPCODE_call or code[i].opcode_ == OPCODE_tailcall) {
+                        code[i].target_ = &threaded_funcs_[code[i].operands_[0]][0];
+                    }
+                }
+            }
+
+            static void append(threaded_code_t &code, vector<std::size_t> &byte_position, const std::size_t pos,
+                               const int opcode, const int *operands,
+                               const void * const *handlers, const void *switch_handler) {
+                threaded_instruction instruction;
+                instruction.opcode_ = opcode;
+                if (handlers == NULL) {
+                    instruction.handler_ = switch_handler;
+                } else {
+                    instruction.handler_ = (opcode > 0 and opcode < DECODED_OPCODES_COUNT) ? handlers[opcode] : handlers[0];
+                }
+                std::copy(operands, operands + MAX_OPERANDS_COUNT, instruction.operands_);
+                instruction.target_ = NULL;
+#if defined(FREEFOIL_JIT)
+                instruction.native_ = NULL;
+#endif
+
+                byte_position.push_back(pos);
+                code.push_back(instruction);
+            }
+
+            //whether the operand of the bytecode instruction is a variable offset relative to the frame pointer
+            static bool is_frame_slot_operand(const int opcode, const int operand) {
+                switch (opcode) {
+                case OPCODE_iload:
+                case OPCODE_fload:
+                case OPCODE_sload:
+                case OPCODE_isave:
+                case OPCODE_fsave:
+                case OPCODE_ssave:
+                    return operand == 0;
+                default:
+                    break;
+                }
+                //the operands of a superinstruction are the operands of its parts, in order
+                const superinstruction *fused = find_superinstruction(opcode);
+                if (fused != NULL) {
+                    int first_operand = 0;
+                    for (std::size_t i = 0; i < fused->length_; ++i) {
+                        const int operands_count = get_operands_count(fused->pattern_[i]);
+                        if (operand < first_operand + operands_count) {
+                            return is_frame_slot_operand(fused->pattern_[i], operand - first_operand);
+                        }
+                        first_operand += operands_count;
+                    }
+                }
+                return false;
+            }
+
+            static bool is_return(const int opcode) {
+                return opcode == OPCODE_ret or opcode == OPCODE_iret or opcode == OPCODE_fret or opcode == OPCODE_sret;
+            }
+
+            //pops the frame record and the params of the current function, and resumes the caller;
+            //the decoder stores the params count as the operand of every return
+            void leave_frame() {
+                stack_item * const frame = fp_;
+                sp_ = frame + FRAME_RECORD_SIZE + pc_->operands_[0];
+                pc_ = frame[FRAME_RETURN_PC].pc_;
+                fp_ = frame[FRAME_OLD_FP].pstack_item_;
+            }
+
+            //the stack items a function may use on top of its params: the verifier bounds its operand stack,
+            //so a room check on entry makes any checks on pushes needless
+            static int frame_room(const function_template &f) {
+                return FRAME_RECORD_SIZE + f.locals_count_ + f.max_stack_depth_;
+            }
+
+            //pushes the frame record for the call of a function, whose params are on top of the stack;
+            //a call which finds no room in the segment of a fiber goes on in a new one
+            void enter_frame(const int locals_count, const int room, const threaded_instruction *return_pc) {
+                if (!check_room(room)) {
+                    return_pc = more_stack(room, return_pc);
+                }
+                //the record is written through a local pointer: a store of a pointer into the stack could alias sp_ and pc_,
+                //and would have the compiler load them back
+                stack_item * const frame = sp_ - FRAME_RECORD_SIZE;
+                frame[FRAME_RETURN_PC].pc_ = return_pc;
+                frame[FRAME_OLD_FP].pstack_item_ = fp_;
+                fp_ = frame;
+                sp_ = frame - locals_count; //make room for local vars
+            }
+
             bool check_room(int size) {
-                return sp_ - pStack_.get() >= size;
+                return sp_ - stack_begin_ >= size;
             }
 
             void push_int(const int i) {
-                assert(check_room(1));
                 (*--sp_).i_ = i;
             }
 
             void push_float(const float f) {
-                assert(check_room(1));
                 (*--sp_).f_ = f;
             }
 
             void push_gcobject(const gcobject_instance_t &gcobj) {
-                assert(check_room(1));
                 (*--sp_).gcobj_ = gcobj;
             }
 
+            void push_item(const stack_item &item) {
+                *--sp_ = item;
+            }
+
             int pop_int() {
-                assert(sp_ >= pStack_.get());
 //                assert(sp_->type_ == int_type);
                 return (*sp_++).i_;
             }
 
             float pop_float() {
-                assert(sp_ >= pStack_.get());
 //                assert(sp_->type_ == float_type);
                 return (*sp_++).f_;
             }
 
             gcobject_instance_t pop_gcobject() {
-                assert(sp_ >= pStack_.get());
                 //assert(sp_->type_ == stack_item::string_type);
                 return (*sp_++).gcobj_;
             }
 
-            void push_memory(ULONG memory) {
-                *--pMemory_sp_ = memory;
-            }
+            //the integer variable addressed by the operand of the current decoded instruction
+            int &local_int(const int operand) const {
+                return (*(fp_ + pc_->operands_[operand])).i_;
+            }
+
+            //the integer constant addressed by the operand of the current decoded instruction
+            int const_int(const int operand) const {
+                return program_.constants_pool_.get_int_value_from_table(pc_->operands_[operand]);
+            }
+
+#if defined(FREEFOIL_JIT)
+            //baseline JIT: a hot function is translated from its threaded code into machine code, which keeps every value
+            //in the VM stack just as the interpreter does. So native code and the interpreter pass control to each other
+            //at any instruction: jitted calls and returns jump straight to the native code of their destination if there is one,
+            //and leave to the interpreter otherwise; instructions the JIT doesn't translate leave to the interpreter as well.
+            //All the jitted code runs in the native frame of the entry stub, so VM recursion doesn't grow the native stack.
+
+            //the interpreter registers, handed over to the native code and back
+            struct jit_registers {
+                stack_item *sp_;
+                stack_item *fp_;
+                stack_item tos_;
+                const stack_item *stack_begin_;
+                const threaded_instruction *pc_; //the instruction calling a helper which may collect garbage
+                const void *exit_; //the stub returning to the interpreter
+                freefoil_vm *vm_;
+                int fiber_budget_;
+            };
+
+            //runs the native code at the address, returns the instruction the interpreter has to continue with
+            typedef const threaded_instruction *(*native_entry_t)(jit_registers *registers, const void *address);
+
+            //a helper called by the native code, which returns the new stack pointer
+            typedef stack_item *(*jit_helper_t)(jit_registers *registers, stack_item *sp, int operand);
+
+            //the registers the native code keeps the interpreter registers in; all of them are callee saved
+            static const x64_register JIT_SP = R12;
+            static const x64_register JIT_FP = R13;
+            static const x64_register JIT_TOS = RBX;
+            static const x64_register JIT_REGISTERS = R14;
+            static const x64_register JIT_FIBER_BUDGET = R15; //no helper changes the budget, as the fiber builtins leave to the interpreter
+
+            static const int ITEM_SIZE = sizeof(stack_item);
+
+            scoped_ptr<jit_code_buffer> jit_code_;
+            native_entry_t native_entry_;
+            const void *native_exit_;
+
+            static stack_item *jit_builtin_call(jit_registers *registers, stack_item *sp, const int index) {
+                freefoil_vm &vm = *registers->vm_;
+                const builtin_func_t &builtin_func = vm.builtin_funcs_[index];
+                vm.sp_ = sp;
+                (vm.*builtin_func.body_)(); //pops its own args
+                return vm.sp_;
+            }
+
+            //the helpers which may collect garbage hand the interpreter registers over to the VM for its stack walk first
+            static freefoil_vm &jit_enter_collecting_helper(jit_registers *registers, stack_item *sp) {
+                freefoil_vm &vm = *registers->vm_;
+                vm.sp_ = sp;
+                vm.fp_ = registers->fp_;
+                vm.pc_ = registers->pc_;
+                return vm;
+            }
+
+            //the condition of the compare and branch instructions, all of which compare the deeper value with the upper one
+            static x64_condition jit_condition(const int opcode) {
+                switch (opcode) {
+                case OPCODE_ifeq: case OPCODE_iload_iload_ifeq: case OPCODE_iload_iload_const_ifeq: case TOS_ifeq_s10:
+                    return CC_E;
+                case OPCODE_ifneq: case OPCODE_iload_iload_ifneq: case OPCODE_iload_iload_const_ifneq: case TOS_ifneq_s10:
+                    return CC_NE;
+                case OPCODE_ifleq: case OPCODE_iload_iload_ifleq: case OPCODE_iload_iload_const_ifleq: case TOS_ifleq_s10:
+                    return CC_LE;
+                case OPCODE_ifgeq: case OPCODE_iload_iload_ifgeq: case OPCODE_iload_iload_const_ifgeq: case TOS_ifgeq_s10:
+                    return CC_GE;
+                case OPCODE_ifgreater: case OPCODE_iload_iload_ifgreater: case OPCODE_iload_iload_const_ifgreater: case TOS_ifgreater_s10:
+                    return CC_G;
+                default:
+                    assert(opcode == OPCODE_ifless or opcode == OPCODE_iload_iload_ifless or opcode == OPCODE_iload_iload_const_ifless or opcode == TOS_ifless_s10);
+                    return CC_L;
+                }
+            }
+
+            static void jit_push(x64_assembler &a, const x64_register value) {
+                a.sub_imm64(JIT_SP, ITEM_SIZE);
+                a.mov_store32(JIT_SP, 0, value);
+            }
+
+            static void jit_push64(x64_assembler &a, const x64_register value) {
+                a.sub_imm64(JIT_SP, ITEM_SIZE);
+                a.mov_store64(JIT_SP, 0, value);
+            }
+
+            static void jit_push_imm(x64_assembler &a, const int value) {
+                a.sub_imm64(JIT_SP, ITEM_SIZE);
+                a.mov_store32_imm(JIT_SP, 0, value);
+            }
+
+            //leaves the native code for the interpreter, which continues with the instruction
+            static void jit_exit(x64_assembler &a, const threaded_instruction *pc) {
+                a.mov_pointer(RAX, pc);
+                a.jmp_mem(JIT_REGISTERS, offsetof(jit_registers, exit_));
+            }
+
+            //continues with the instruction in rax: in its native code if it has one, in the interpreter otherwise
+            static void jit_continue(x64_assembler &a) {
+                a.mov_load64(RCX, RAX, offsetof(threaded_instruction, native_));
+                a.test_reg64(RCX, RCX);
+                const x64_assembler::label_t interpreted = a.jcc(CC_E);
+                a.jmp_reg(RCX);
+                a.bind(interpreted);
+                a.jmp_mem(JIT_REGISTERS, offsetof(jit_registers, exit_));
+            }
+
+            static stack_item *jit_sadd(jit_registers *registers, stack_item *sp, int) {
+                freefoil_vm &vm = jit_enter_collecting_helper(registers, sp);
+                const gcobject_instance_t value = vm.heap_.concat(sp[1].gcobj_, sp[0].gcobj_);
+                (*++sp).gcobj_ = value;
+                return sp;
+            }
+
+            static void jit_call_helper(x64_assembler &a, const jit_helper_t helper, const int operand) {
+                a.mov_reg64(RDI, JIT_REGISTERS);
+                a.mov_reg64(RSI, JIT_SP);
+                a.mov_imm32(RDX, operand);
+                a.mov_pointer(RAX, reinterpret_cast<const void *>(helper));
+                a.call_reg(RAX);
+                a.mov_reg64(JIT_SP, RAX);
+            }
+
+            //calls a helper which may collect garbage at the instruction, a GC safe point
+            static void jit_call_collecting_helper(x64_assembler &a, const jit_helper_t helper, const int operand, const threaded_instruction *instruction) {
+                a.mov_store64(JIT_REGISTERS, offsetof(jit_registers, fp_), JIT_FP);
+                a.mov_pointer(RAX, instruction);
+                a.mov_store64(JIT_REGISTERS, offsetof(jit_registers, pc_), RAX);
+                jit_call_helper(a, helper, operand);
+            }
+
+            //emits the stubs switching between the interpreter and the native code
+            bool jit_install_stubs() {
+                x64_assembler a;
+
+                a.push(RBX);
+                a.push(RBP);
+                a.push(R12);
+                a.push(R13);
+                a.push(R14);
+                a.push(R15);
+                a.sub_imm64(RSP, 8); //keeps the native stack 16 byte aligned for the helpers
+                a.mov_reg64(JIT_REGISTERS, RDI);
+                a.mov_load64(JIT_SP, JIT_REGISTERS, offsetof(jit_registers, sp_));
+                a.mov_load64(JIT_FP, JIT_REGISTERS, offsetof(jit_registers, fp_));
+                a.mov_load64(JIT_TOS, JIT_REGISTERS, offsetof(jit_registers, tos_));
+                a.mov_load32(JIT_FIBER_BUDGET, JIT_REGISTERS, offsetof(jit_registers, fiber_budget_));
+                a.jmp_reg(RSI);
+
+                const std::size_t exit_offset = a.size();
+                a.mov_store64(JIT_REGISTERS, offsetof(jit_registers, sp_), JIT_SP);
+                a.mov_store64(JIT_REGISTERS, offsetof(jit_registers, fp_), JIT_FP);
+                a.mov_store64(JIT_REGISTERS, offsetof(jit_registers, tos_), JIT_TOS);
+                a.mov_store32(JIT_REGISTERS, offsetof(jit_registers, fiber_budget_), JIT_FIBER_BUDGET);
+                a.add_imm64(RSP, 8);
+                a.pop(R15);
+                a.pop(R14);
+                a.pop(R13);
+                a.pop(R12);
+                a.pop(RBP);
+                a.pop(RBX);
+                a.ret();
+
+                const char *stubs = static_cast<const char *>(jit_code_->install(a.code(), "freefoil::jit_stubs"));
+                if (stubs == NULL) {
+                    return false;
+                }
+                native_entry_ = reinterpret_cast<native_entry_t>(reinterpret_cast<std::size_t>(stubs));
+                native_exit_ = stubs + exit_offset;
+                return true;
+            }
+
+            //translates the threaded code of the function into machine code; leaves the function interpreted if it fails
+            void jit_compile(const std::size_t func_index) {
+                if (!jit_code_) {
+                    jit_code_.reset(new jit_code_buffer(perf_map_));
+                    if (!jit_install_stubs()) {
+                        return;
+                    }
+                } else if (native_exit_ == NULL) {
+                    return;
+                }
+
+                threaded_code_t &code = threaded_funcs_[func_index];
+                x64_assembler a;
+                vector<std::size_t> offsets(code.size());
+                vector<std::pair<x64_assembler::label_t, std::size_t> > jumps; //and the index of the instruction they go to
+
+                for (std::size_t i = 0; i < code.size(); ++i) {
+                    offsets[i] = a.size();
+                    const threaded_instruction &instruction = code[i];
+                    const int *operands = instruction.operands_;
+                    const std::size_t target = instruction.target_ - &code[0];
+
+                    switch (instruction.opcode_) {
+                    case OPCODE_iload:
+                    case OPCODE_fload:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        break;
+
+                    case OPCODE_sload:
+                        a.mov_load64(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push64(a, RAX);
+                        break;
+
+                    case OPCODE_isave:
+                    case OPCODE_fsave: //the bits of the float move as they are
+                        a.mov_load32(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.mov_store32(JIT_FP, operands[0] * ITEM_SIZE, RAX);
+                        break;
+
+                    case OPCODE_ssave:
+                        a.mov_load64(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.mov_store64(JIT_FP, operands[0] * ITEM_SIZE, RAX);
+                        break;
+
+                    case OPCODE_iload_const:
+                        jit_push_imm(a, program_.constants_pool_.get_int_value_from_table(operands[0]));
+                        break;
+
+                    case OPCODE_fload_const: {
+                        const float value = program_.constants_pool_.get_float_value_from_table(operands[0]);
+                        int bits;
+                        std::memcpy(&bits, &value, sizeof(bits));
+                        jit_push_imm(a, bits);
+                        break;
+                    }
+
+                    case OPCODE_sload_const:
+                        a.mov_pointer(RAX, string_constants_[operands[0]]);
+                        jit_push64(a, RAX);
+                        break;
+
+                    case OPCODE_iadd:
+                        a.mov_load32(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.add_store32(JIT_SP, 0, RAX);
+                        break;
+
+                    case OPCODE_isub:
+                        a.mov_load32(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.sub_store32(JIT_SP, 0, RAX);
+                        break;
+
+                    case OPCODE_imul:
+                        a.mov_load32(RAX, JIT_SP, ITEM_SIZE);
+                        a.imul_load32(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.mov_store32(JIT_SP, 0, RAX);
+                        break;
+
+                    case OPCODE_fadd:
+                    case OPCODE_fsub:
+                    case OPCODE_fmul:
+                        a.movss_load(XMM0, JIT_SP, ITEM_SIZE);
+                        if (instruction.opcode_ == OPCODE_fadd) {
+                            a.addss_load(XMM0, JIT_SP, 0);
+                        } else if (instruction.opcode_ == OPCODE_fsub) {
+                            a.subss_load(XMM0, JIT_SP, 0);
+                        } else {
+                            a.mulss_load(XMM0, JIT_SP, 0);
+                        }
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.movss_store(JIT_SP, 0, XMM0);
+                        break;
+
+                    case OPCODE_fdiv: {
+                        a.xorps(XMM1, XMM1);
+                        a.ucomiss_load(XMM1, JIT_SP, 0);
+                        const x64_assembler::label_t unordered = a.jcc(CC_P);
+                        const x64_assembler::label_t nonzero = a.jcc(CC_NE);
+                        jit_exit(a, &instruction); //the interpreter throws the division by zero
+                        a.bind(unordered);
+                        a.bind(nonzero);
+                        a.movss_load(XMM0, JIT_SP, ITEM_SIZE);
+                        a.divss_load(XMM0, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.movss_store(JIT_SP, 0, XMM0);
+                        break;
+                    }
+
+                    case OPCODE_sadd:
+                        jit_call_collecting_helper(a, &freefoil_vm::jit_sadd, 0, &instruction);
+                        break;
+
+                    case OPCODE_inegate:
+                        a.neg_mem32(JIT_SP, 0);
+                        break;
+
+                    case OPCODE_fnegate:
+                        a.xor_mem32_imm(JIT_SP, 0, 0x80000000);
+                        break;
+
+                    case OPCODE_f2i:
+                        a.cvttss2si_load(RAX, JIT_SP, 0);
+                        a.mov_store32(JIT_SP, 0, RAX);
+                        break;
+
+                    case OPCODE_i2f:
+                        a.cvtsi2ss_load(XMM0, JIT_SP, 0);
+                        a.movss_store(JIT_SP, 0, XMM0);
+                        break;
+
+                    case OPCODE_jmp:
+                        jumps.push_back(std::make_pair(a.jmp(), target));
+                        break;
+
+                    case OPCODE_jz:
+                    case OPCODE_jnz: //the value stays on the stack when the jump is taken
+                        a.cmp_mem32_imm(JIT_SP, 0, instruction.opcode_ == OPCODE_jz ? 0 : 1);
+                        jumps.push_back(std::make_pair(a.jcc(CC_E), target));
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        break;
+
+                    case OPCODE_push_true:
+                        jit_push_imm(a, 1);
+                        break;
+
+                    case OPCODE_push_false:
+                        jit_push_imm(a, 0);
+                        break;
+
+                    case OPCODE_ifeq:
+                    case OPCODE_ifneq:
+                    case OPCODE_ifleq:
+                    case OPCODE_ifgeq:
+                    case OPCODE_ifgreater:
+                    case OPCODE_ifless:
+                        a.mov_load32(RAX, JIT_SP, ITEM_SIZE);
+                        a.mov_load32(RCX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, 2 * ITEM_SIZE);
+                        a.cmp_reg32(RAX, RCX);
+                        jumps.push_back(std::make_pair(a.jcc(jit_condition(instruction.opcode_)), target));
+                        break;
+
+                    case OPCODE_pop:
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        break;
+
+                    case OPCODE_builtin_call:
+                        if (operands[0] >= BUILTIN_spawn) {
+                            jit_exit(a, &instruction); //the interpreter runs the scheduler
+                        } else {
+                            jit_call_helper(a, &freefoil_vm::jit_builtin_call, operands[0]);
+                        }
+                        break;
+
+                    case OPCODE_call: {
+                        //the interpreter preempts the fiber once its budget runs out, or gives it another stack segment
+                        a.sub_imm32(JIT_FIBER_BUDGET, 1);
+                        const x64_assembler::label_t in_budget = a.jcc(CC_G);
+                        jit_exit(a, &instruction);
+                        a.bind(in_budget);
+                        a.lea64(RAX, JIT_SP, -operands[2] * ITEM_SIZE);
+                        a.cmp_load64(RAX, JIT_REGISTERS, offsetof(jit_registers, stack_begin_));
+                        const x64_assembler::label_t enough_room = a.jcc(CC_AE);
+                        jit_exit(a, &instruction);
+                        a.bind(enough_room);
+                        //the same frame record as enter_frame() pushes
+                        a.mov_pointer(RAX, &code[i + 1]);
+                        a.mov_store64(JIT_SP, (FRAME_RETURN_PC - FRAME_RECORD_SIZE) * ITEM_SIZE, RAX);
+                        a.mov_store64(JIT_SP, (FRAME_OLD_FP - FRAME_RECORD_SIZE) * ITEM_SIZE, JIT_FP);
+                        a.lea64(JIT_FP, JIT_SP, -FRAME_RECORD_SIZE * ITEM_SIZE);
+                        a.lea64(JIT_SP, JIT_FP, -operands[1] * ITEM_SIZE);
+                        a.mov_pointer(RAX, instruction.target_);
+                        jit_continue(a);
+                        break;
+                    }
+
+                    case OPCODE_ret:
+                    case OPCODE_iret:
+                    case OPCODE_fret:
+                    case OPCODE_sret:
+                    case TOS_iret_s10:
+                        if (instruction.opcode_ == OPCODE_sret) {
+                            a.mov_load64(RDX, JIT_SP, 0);
+                        } else if (instruction.opcode_ == OPCODE_iret or instruction.opcode_ == OPCODE_fret) {
+                            a.mov_load32(RDX, JIT_SP, 0);
+                        }
+                        //the same as leave_frame() does
+                        a.mov_reg64(RCX, JIT_FP);
+                        a.mov_load64(RAX, RCX, FRAME_RETURN_PC * ITEM_SIZE);
+                        a.lea64(JIT_SP, RCX, (FRAME_RECORD_SIZE + operands[0]) * ITEM_SIZE);
+                        a.mov_load64(JIT_FP, RCX, FRAME_OLD_FP * ITEM_SIZE);
+                        if (instruction.opcode_ == OPCODE_sret) {
+                            jit_push64(a, RDX);
+                        } else if (instruction.opcode_ == TOS_iret_s10) {
+                            jit_push(a, JIT_TOS);
+                        } else if (instruction.opcode_ != OPCODE_ret) {
+                            jit_push(a, RDX);
+                        }
+                        jit_continue(a);
+                        break;
+
+                    //superinstructions
+
+                    case OPCODE_iload_iload:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        a.mov_load32(RAX, JIT_FP, operands[1] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        break;
+
+                    case OPCODE_iload_iload_const:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        jit_push_imm(a, program_.constants_pool_.get_int_value_from_table(operands[1]));
+                        break;
+
+                    case OPCODE_iload_iload_iadd_isave:
+                    case OPCODE_iload_iload_isub_isave:
+                    case OPCODE_iload_iload_imul_isave:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        if (instruction.opcode_ == OPCODE_iload_iload_iadd_isave) {
+                            a.add_load32(RAX, JIT_FP, operands[1] * ITEM_SIZE);
+                        } else if (instruction.opcode_ == OPCODE_iload_iload_isub_isave) {
+                            a.sub_load32(RAX, JIT_FP, operands[1] * ITEM_SIZE);
+                        } else {
+                            a.imul_load32(RAX, JIT_FP, operands[1] * ITEM_SIZE);
+                        }
+                        a.mov_store32(JIT_FP, operands[2] * ITEM_SIZE, RAX);
+                        break;
+
+                    case OPCODE_iload_iload_const_iadd_isave:
+                    case OPCODE_iload_iload_const_isub_isave: {
+                        const int value = program_.constants_pool_.get_int_value_from_table(operands[1]);
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        if (instruction.opcode_ == OPCODE_iload_iload_const_iadd_isave) {
+                            a.add_imm32(RAX, value);
+                        } else {
+                            a.sub_imm32(RAX, value);
+                        }
+                        a.mov_store32(JIT_FP, operands[2] * ITEM_SIZE, RAX);
+                        break;
+                    }
+
+                    case OPCODE_iload_iload_ifeq:
+                    case OPCODE_iload_iload_ifneq:
+                    case OPCODE_iload_iload_ifleq:
+                    case OPCODE_iload_iload_ifgeq:
+                    case OPCODE_iload_iload_ifgreater:
+                    case OPCODE_iload_iload_ifless:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        a.cmp_load32(RAX, JIT_FP, operands[1] * ITEM_SIZE);
+                        jumps.push_back(std::make_pair(a.jcc(jit_condition(instruction.opcode_)), target));
+                        break;
+
+                    case OPCODE_iload_iload_const_ifeq:
+                    case OPCODE_iload_iload_const_ifneq:
+                    case OPCODE_iload_iload_const_ifleq:
+                    case OPCODE_iload_iload_const_ifgeq:
+                    case OPCODE_iload_iload_const_ifgreater:
+                    case OPCODE_iload_iload_const_ifless:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        a.cmp_imm32(RAX, program_.constants_pool_.get_int_value_from_table(operands[1]));
+                        jumps.push_back(std::make_pair(a.jcc(jit_condition(instruction.opcode_)), target));
+                        break;
+
+                    //top of stack caching versions, with the tos register in JIT_TOS
+
+                    case TOS_iload_s11:
+                    case TOS_fload_s11:
+                        jit_push(a, JIT_TOS);
+                        //fall through
+                    case TOS_iload_s01:
+                    case TOS_fload_s01:
+                        a.mov_load32(JIT_TOS, JIT_FP, operands[0] * ITEM_SIZE);
+                        break;
+
+                    case TOS_iload_const_s11:
+                        jit_push(a, JIT_TOS);
+                        //fall through
+                    case TOS_iload_const_s01:
+                        a.mov_imm32(JIT_TOS, program_.constants_pool_.get_int_value_from_table(operands[0]));
+                        break;
+
+                    case TOS_iload_iload_s11:
+                        jit_push(a, JIT_TOS);
+                        //fall through
+                    case TOS_iload_iload_s01:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        a.mov_load32(JIT_TOS, JIT_FP, operands[1] * ITEM_SIZE);
+                        break;
+
+                    case TOS_iload_iload_const_s11:
+                        jit_push(a, JIT_TOS);
+                        //fall through
+                    case TOS_iload_iload_const_s01:
+                        a.mov_load32(RAX, JIT_FP, operands[0] * ITEM_SIZE);
+                        jit_push(a, RAX);
+                        a.mov_imm32(JIT_TOS, program_.constants_pool_.get_int_value_from_table(operands[1]));
+                        break;
+
+                    case TOS_iadd_s01:
+                    case TOS_isub_s01:
+                    case TOS_imul_s01:
+                        a.mov_load32(JIT_TOS, JIT_SP, ITEM_SIZE);
+                        if (instruction.opcode_ == TOS_iadd_s01) {
+                            a.add_load32(JIT_TOS, JIT_SP, 0);
+                        } else if (instruction.opcode_ == TOS_isub_s01) {
+                            a.sub_load32(JIT_TOS, JIT_SP, 0);
+                        } else {
+                            a.imul_load32(JIT_TOS, JIT_SP, 0);
+                        }
+                        a.add_imm64(JIT_SP, 2 * ITEM_SIZE);
+                        break;
+
+                    case TOS_iadd_s11:
+                        a.add_load32(JIT_TOS, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        break;
+
+                    case TOS_isub_s11:
+                        a.mov_load32(RAX, JIT_SP, 0);
+                        a.sub_reg32(RAX, JIT_TOS);
+                        a.mov_reg32(JIT_TOS, RAX);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        break;
+
+                    case TOS_imul_s11:
+                        a.imul_load32(JIT_TOS, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        break;
+
+                    case TOS_isave_s10:
+                        a.mov_store32(JIT_FP, operands[0] * ITEM_SIZE, JIT_TOS);
+                        break;
+
+                    case TOS_ifeq_s10:
+                    case TOS_ifneq_s10:
+                    case TOS_ifleq_s10:
+                    case TOS_ifgeq_s10:
+                    case TOS_ifgreater_s10:
+                    case TOS_ifless_s10:
+                        a.mov_load32(RAX, JIT_SP, 0);
+                        a.add_imm64(JIT_SP, ITEM_SIZE);
+                        a.cmp_reg32(RAX, JIT_TOS);
+                        jumps.push_back(std::make_pair(a.jcc(jit_condition(instruction.opcode_)), target));
+                        break;
+
+                    case TOS_jz_s10:
+                    case TOS_jnz_s10: {
+                        a.cmp_imm32(JIT_TOS, instruction.opcode_ == TOS_jz_s10 ? 0 : 1);
+                        const x64_assembler::label_t not_taken = a.jcc(CC_NE);
+                        jit_push(a, JIT_TOS);
+                        jumps.push_back(std::make_pair(a.jmp(), target));
+                        a.bind(not_taken);
+                        break;
+                    }
+
+                    case TOS_pop_s10:
+                        break;
+
+                    case TOS_flush_s10:
+                        jit_push(a, JIT_TOS);
+                        break;
+
+                    default:
+                        //tail calls, halt, idiv and the opcodes the interpreter rejects
+                        jit_exit(a, &instruction);
+                        break;
+                    }
+                }
+
+                for (std::size_t i = 0; i < jumps.size(); ++i) {
+                    a.bind(jumps[i].first, offsets[jumps[i].second]);
+                }
+
+                const char *native = static_cast<const char *>(jit_code_->install(a.code(), "freefoil::" + program_.user_funcs_[func_index].name_));
+                if (native == NULL) {
+                    return;
+                }
+                code[0].native_ = native;
+                for (std::size_t i = 0; i + 1 < code.size(); ++i) {
+                    if (code[i].opcode_ == OPCODE_call) {
+                        code[i + 1].native_ = native + offsets[i + 1];
+                    }
+                }
+            }
+
+            //runs the native code of the current instruction, until it leaves for the interpreter
+            void run_native(stack_item &tos) {
+                jit_registers registers;
+                registers.sp_ = sp_;
+                registers.fp_ = fp_;
+                registers.tos_ = tos;
+                registers.stack_begin_ = stack_begin_;
+                registers.pc_ = NULL;
+                registers.exit_ = native_exit_;
+                registers.vm_ = this;
+                registers.fiber_budget_ = fiber_budget_;
+                pc_ = native_entry_(&registers, pc_->native_);
+                sp_ = registers.sp_;
+                fp_ = registers.fp_;
+                tos = registers.tos_;
+                fiber_budget_ = registers.fiber_budget_;
+            }
+#endif
+
+            //the entry of a function is the safe point its code is swapped at: the frame is laid out the same way in both tiers,
+            //and the baseline code is kept for the frames which return into it
+            void tier_up(const std::size_t func_index, const std::size_t calls) {
+                if (calls == tier_threshold_) {
+                    tier_compiler_->request(func_index);
+                }
+                const tier_compiler::function_state state = tier_compiler_->get_state(func_index);
+                if (state != tier_compiler::OPTIMIZED) {
+                    tier_pending_[func_index] = state == tier_compiler::QUEUED;
+                    return;
+                }
+                tier_pending_[func_index] = false;
+
+                instructions_stream_t optimized;
+                optimized_stack_maps_.push_back(stack_maps_t());
+                tier_compiler_->take(func_index, optimized, optimized_stack_maps_.back());
+                threaded_code_t code;
+                decode_function(program_.user_funcs_[func_index], optimized, optimized_stack_maps_.back(), code);
+
+                retired_funcs_.push_back(threaded_code_t());
+                retired_funcs_.back().swap(threaded_funcs_[func_index]);
+                threaded_funcs_[func_index].swap(code);
+
+                //the calls from the retired code go to the new code as well, so the frames returning into it call the optimized code
+                for (std::size_t i = 0; i < threaded_funcs_.size(); ++i) {
+                    link_calls(threaded_funcs_[i]);
+                }
+                for (std::list<threaded_code_t>::iterator retired_iter = retired_funcs_.begin(); retired_iter != retired_funcs_.end(); ++retired_iter) {
+                    link_calls(*retired_iter);
+                }
+                pc_ = &threaded_funcs_[func_index][0];
+
+#if defined(FREEFOIL_JIT)
+                //the jitted callers keep calling the baseline native code; the new code is jitted if the baseline one was
+                if (retired_funcs_.back()[0].native_ != NULL) {
+                    jit_compile(func_index);
+                }
+#endif
+            }
+
+            //counts the call of the function just entered, and runs its native code if there is one
+            void enter_function(const int func_index, stack_item &tos) {
+                if (--call_countdowns_[func_index] == 0) {
+                    count_calls(func_index);
+                }
+#if defined(FREEFOIL_JIT)
+                if (pc_->native_ != NULL) {
+                    run_native(tos);
+                }
+#else
+                (void) tos;
+#endif
+            }
+
+            //swaps in the optimized code of the function just entered once it is ready, and jits the function once it gets
+            //hot; then sets the countdown to the next call either of them has to look at
+            void count_calls(const int func_index) {
+                const std::size_t calls = call_counts_[func_index];
+                std::size_t next_calls = std::numeric_limits<std::size_t>::max();
+                if (tier_threshold_ != 0 and tier_pending_[func_index]) {
+                    if (calls >= tier_threshold_) {
+                        tier_up(func_index, calls);
+                    }
+                    if (tier_pending_[func_index]) {
+                        next_calls = calls < tier_threshold_ ? tier_threshold_ : calls + 1;
+                    }
+                }
+#if defined(FREEFOIL_JIT)
+                if (calls == jit_threshold_ and pc_->native_ == NULL) {
+                    jit_compile(func_index);
+                }
+#endif
+                if (calls < jit_threshold_) {
+                    next_calls = std::min(next_calls, jit_threshold_);
+                }
+                call_counts_[func_index] = next_calls;
+                call_countdowns_[func_index] = next_calls - calls;
+            }
+
+            //continues the caller in its native code after a return, if it was jitted
+            void return_to_caller(stack_item &tos) {
+#if defined(FREEFOIL_JIT)
+                if (pc_->native_ != NULL) {
+                    run_native(tos);
+                }
+#else
+                (void) tos;
+#endif
+            }
+
+        public:
+            static const std::size_t DEFAULT_STACK_SIZE = 512; //stack items committed at start
+            static const std::size_t DEFAULT_MAX_STACK_SIZE = 1024 * 1024; //stack items reserved
+            static const std::size_t DEFAULT_JIT_THRESHOLD = 100; //calls of a function before it is jitted
+            static const std::size_t DEFAULT_TIER_THRESHOLD = 20; //calls of a function before it is recompiled by the optimizing tier
+
+            //jit_threshold == 0 keeps every function interpreted; perf_map lists the jitted functions in /tmp/perf-<pid>.map;
+            //tier_threshold == 0 runs the code as it is loaded, otherwise the program is expected to come from the codegen
+            //without optimizations, and its hot functions are optimized in the background
+            freefoil_vm(const program_entry &program, const dispatch_mode mode = default_dispatch_mode, const bool tos_caching = true,
+                        const std::size_t jit_threshold = DEFAULT_JIT_THRESHOLD, const bool perf_map = false,
+                        const std::size_t tier_threshold = 0,
+                        const std::size_t stack_size = DEFAULT_STACK_SIZE, const std::size_t max_stack_size = DEFAULT_MAX_STACK_SIZE)
+                :switch_handler_(NULL),
+                 program_(program), dispatch_mode_(mode), tos_caching_(tos_caching), jit_threshold_(jit_threshold), perf_map_(perf_map),
+                 tier_threshold_(tier_threshold), stack_size_(stack_size), max_stack_size_(std::max(stack_size, max_stack_size)), batch_worker_(false)
+#if defined(FREEFOIL_JIT)
+                 , native_entry_(NULL), native_exit_(NULL)
+#endif
+                 {
+                reset_fibers();
+            }
+
+            ~freefoil_vm() {
+                //the heap frees what the runs left, the constants included
+                reset_fibers();
+            }
+
+            //the arguments and the return value of the entry point, as the host passes and gets them, tagged with their type
+            struct value {
+                value_type_t type_;
+                union {
+                    gcobject_instance_t gcobj_;
+                    int   i_;
+                    float f_;
+                };
+
+                value()
+                    :type_(VOID_TYPE), gcobj_(NULL)
+                    {}
+
+                explicit value(const int i)
+                    :type_(INT_TYPE), i_(i)
+                    {}
+
+                explicit value(const float f)
+                    :type_(FLOAT_TYPE), f_(f)
+                    {}
+
+                explicit value(const bool b)
+                    :type_(BOOL_TYPE), i_(b ? 1 : 0)
+                    {}
 
-            ULONG pop_memory() {
-                return *pMemory_sp_++;
-            }
+                explicit value(const gcobject_instance_t gcobj)
+                    :type_(STRING_TYPE), gcobj_(gcobj)
+                    {}
+            };
 
-        public:
-            freefoil_vm(const program_entry &program) : program_(program) {
+            //why the function can't be run with arguments of the types, or an empty string if it can
+            static string check_arg_types(const string &function_name, const vector<value_type_t> &param_types, const vector<value_type_t> &arg_types) {
+                if (arg_types.size() != param_types.size()) {
+                    return function_name + " takes " + boost::lexical_cast<string>(param_types.size()) + " arguments";
+                }
+                for (std::size_t i = 0; i < arg_types.size(); ++i) {
+                    if (arg_types[i] != param_types[i]) {
+                        return function_name + " takes " + get_type_name(param_types[i]) + " as its argument " +
+                               boost::lexical_cast<string>(i + 1) + ", not " + get_type_name(arg_types[i]);
+                    }
+                }
+                return string();
             }
 
-            ~freefoil_vm() {
-                //do nothing
+            //runs the entry point with as many arguments as it has params, the first one first, and returns the value
+            //it returns, if any. The stack, the builtins, the decoded and jitted code and the call counts are kept
+            //from run to run, and the objects the previous run left in the nursery are dropped at once, so a string
+            //the run returns lives until the next run only. String arguments are the ones make_string() makes.
+            value run(const vector<value> &args) {
+                return run_function(program_.entry_point_func_index_, args);
             }
 
-            void exec() {
-
-                init();
-
-                const function_template &entry_point_func = program_.user_funcs_[program_.entry_point_func_index_];
-                pc_ = &*entry_point_func.instructions_.begin();
-                const BYTE *pc_end = &*(entry_point_func.instructions_.end() - 1);
-                push_memory(program_.args_count_);
-                push_memory((ULONG)pc_end); //return pc
-                push_memory((ULONG)fp_); //old fp
-
-                //TODO: arguments
+            //the sum of what the user function, which takes an int and returns an int, a float or nothing, returns
+            //for each index of [lo, hi), one run of the function per index; the parallel_for builtins have the batch
+            //workers sum the chunks of the range
+            value sum_range(const std::size_t func_index, const int lo, const int hi) {
+                const value_type_t return_type = program_.user_funcs_[func_index].return_type_;
+                value sum = return_type == FLOAT_TYPE ? value(0.0f) : value(0);
+                vector<value> args(1);
+                for (int i = lo; i < hi; ++i) {
+                    args[0] = value(i);
+                    const value result = run_function(func_index, args);
+                    if (return_type == FLOAT_TYPE) {
+                        sum.f_ += result.f_;
+                    } else if (return_type == INT_TYPE) {
+                        sum.i_ += result.i_;
+                    }
+                }
+                return sum;
+            }
 
-                sp_ -= entry_point_func.locals_count_;
+            //runs the user function of the index as run() runs the entry point
+            value run_function(const std::size_t func_index, const vector<value> &args) {
 
-                g_mm.function_begin();
+                if (!stack_) {
+                    init();
+                }
 
-                try {
-                    while ((ip_ = *pc_++) != OPCODE_halt) {
-						
-                        switch (ip_) {
+#if defined(FREEFOIL_THREADED_DISPATCH)
+                //every opcode handler gets its own label, so that each of them ends with its own indirect branch
+                const void *handlers[DECODED_OPCODES_COUNT];
+                std::fill(handlers, handlers + DECODED_OPCODES_COUNT, &&L_bad_opcode);
+                VM_HANDLER(OPCODE_builtin_call);
+                VM_HANDLER(OPCODE_call);
+                VM_HANDLER(OPCODE_tailcall);
+                VM_HANDLER(OPCODE_ret);
+                VM_HANDLER(OPCODE_iret);
+                VM_HANDLER(OPCODE_fret);
+                VM_HANDLER(OPCODE_sret);
+                VM_HANDLER(OPCODE_iload_const);
+                VM_HANDLER(OPCODE_fload_const);
+                VM_HANDLER(OPCODE_sload_const);
+                VM_HANDLER(OPCODE_iload);
+                VM_HANDLER(OPCODE_fload);
+                VM_HANDLER(OPCODE_isave);
+                VM_HANDLER(OPCODE_fsave);
+                VM_HANDLER(OPCODE_ssave);
+                VM_HANDLER(OPCODE_fadd);
+                VM_HANDLER(OPCODE_fmul);
+                VM_HANDLER(OPCODE_fdiv);
+                VM_HANDLER(OPCODE_fsub);
+                VM_HANDLER(OPCODE_iadd);
+                VM_HANDLER(OPCODE_imul);
+                VM_HANDLER(OPCODE_idiv);
+                VM_HANDLER(OPCODE_isub);
+                VM_HANDLER(OPCODE_sload);
+                VM_HANDLER(OPCODE_sadd);
+                VM_HANDLER(OPCODE_seq);
+                VM_HANDLER(OPCODE_scmp);
+                VM_HANDLER(OPCODE_inegate);
+                VM_HANDLER(OPCODE_fnegate);
+                VM_HANDLER(OPCODE_f2i);
+                VM_HANDLER(OPCODE_i2f);
+                VM_HANDLER(OPCODE_jmp);
+                VM_HANDLER(OPCODE_jnz);
+                VM_HANDLER(OPCODE_jz);
+                VM_HANDLER(OPCODE_push_true);
+                VM_HANDLER(OPCODE_push_false);
+                VM_HANDLER(OPCODE_ifeq);
+                VM_HANDLER(OPCODE_ifneq);
+                VM_HANDLER(OPCODE_ifgreater);
+                VM_HANDLER(OPCODE_ifless);
+                VM_HANDLER(OPCODE_ifgeq);
+                VM_HANDLER(OPCODE_ifleq);
+                VM_HANDLER(OPCODE_halt);
+                VM_HANDLER(OPCODE_pop);
+                VM_HANDLER(OPCODE_iload_iload);
+                VM_HANDLER(OPCODE_iload_iload_const);
+                VM_HANDLER(OPCODE_iload_iload_iadd_isave);
+                VM_HANDLER(OPCODE_iload_iload_isub_isave);
+                VM_HANDLER(OPCODE_iload_iload_imul_isave);
+                VM_HANDLER(OPCODE_iload_iload_const_iadd_isave);
+                VM_HANDLER(OPCODE_iload_iload_const_isub_isave);
+                VM_HANDLER(OPCODE_iload_iload_ifeq);
+                VM_HANDLER(OPCODE_iload_iload_ifneq);
+                VM_HANDLER(OPCODE_iload_iload_ifleq);
+                VM_HANDLER(OPCODE_iload_iload_ifgeq);
+                VM_HANDLER(OPCODE_iload_iload_ifgreater);
+                VM_HANDLER(OPCODE_iload_iload_ifless);
+                VM_HANDLER(OPCODE_iload_iload_const_ifeq);
+                VM_HANDLER(OPCODE_iload_iload_const_ifneq);
+                VM_HANDLER(OPCODE_iload_iload_const_ifleq);
+                VM_HANDLER(OPCODE_iload_iload_const_ifgeq);
+                VM_HANDLER(OPCODE_iload_iload_const_ifgreater);
+                VM_HANDLER(OPCODE_iload_iload_const_ifless);
+                VM_HANDLER(TOS_iload_s01);
+                VM_HANDLER(TOS_iload_s11);
+                VM_HANDLER(TOS_fload_s01);
+                VM_HANDLER(TOS_fload_s11);
+                VM_HANDLER(TOS_iload_const_s01);
+                VM_HANDLER(TOS_iload_const_s11);
+                VM_HANDLER(TOS_iload_iload_s01);
+                VM_HANDLER(TOS_iload_iload_s11);
+                VM_HANDLER(TOS_iload_iload_const_s01);
+                VM_HANDLER(TOS_iload_iload_const_s11);
+                VM_HANDLER(TOS_iadd_s01);
+                VM_HANDLER(TOS_iadd_s11);
+                VM_HANDLER(TOS_isub_s01);
+                VM_HANDLER(TOS_isub_s11);
+                VM_HANDLER(TOS_imul_s01);
+                VM_HANDLER(TOS_imul_s11);
+                VM_HANDLER(TOS_isave_s10);
+                VM_HANDLER(TOS_ifeq_s10);
+                VM_HANDLER(TOS_ifneq_s10);
+                VM_HANDLER(TOS_ifleq_s10);
+                VM_HANDLER(TOS_ifgeq_s10);
+                VM_HANDLER(TOS_ifgreater_s10);
+                VM_HANDLER(TOS_ifless_s10);
+                VM_HANDLER(TOS_jz_s10);
+                VM_HANDLER(TOS_jnz_s10);
+                VM_HANDLER(TOS_iret_s10);
+                VM_HANDLER(TOS_pop_s10);
+                VM_HANDLER(TOS_flush_s10);
+                VM_HANDLER(STUB_segment_return);
+                VM_HANDLER(STUB_fiber_exit);
+                VM_HANDLER(STUB_bad_jump);
+
+                if (string_constants_.empty()) {
+                    make_string_constants();
+                }
 
-                        case OPCODE_builtin_call: {
-                            const builtin_func_t &builtin_func = builtin_funcs_[*pc_++];
+                if (threaded_funcs_.empty()) {
+                    decode(dispatch_mode_ == threaded_dispatch ? handlers : NULL, &&L_switch_dispatch);
+                }
+#else
+                if (string_constants_.empty()) {
+                    make_string_constants();
+                }
 
-                            g_mm.function_begin();
-                            (this->*builtin_func.body_)();
-                            sp_ += builtin_func.args_count_;
-                            g_mm.function_end();
-                            break;
-                        }
+                if (threaded_funcs_.empty()) {
+                    decode(NULL, NULL);
+                }
+#endif
 
-                        case OPCODE_call: {
-                            const BYTE user_func_index = *pc_;
-                            const function_template &f = program_.user_funcs_[user_func_index];
+                if (call_counts_.empty()) {
+                    call_counts_.assign(threaded_funcs_.size(), 1);
+                    call_countdowns_.assign(threaded_funcs_.size(), 1);
+                }
+                if (tier_threshold_ != 0 and !tier_compiler_) {
+                    tier_compiler_.reset(new tier_compiler(program_));
+                    tier_pending_.assign(threaded_funcs_.size(), true);
+                }
 
-                            push_memory(f.args_count_);
+                const function_template &entry_point = program_.user_funcs_[func_index];
+                vector<value_type_t> arg_types;
+                for (vector<value>::const_iterator arg_iter = args.begin(); arg_iter != args.end(); ++arg_iter) {
+                    arg_types.push_back(arg_iter->type_);
+                }
+                const string args_error = check_arg_types(func_index == program_.entry_point_func_index_ ? string("the entry point") : "the function " + entry_point.name_,
+                                                          entry_point.param_types_, arg_types);
+                if (!args_error.empty()) {
+                    throw freefoil_exception(args_error);
+                }
 
-                            const BYTE *return_pc = ++pc_;
-                            push_memory((ULONG)return_pc);
+                //the entry point ends with a halt of its own, the other functions return into function_exit_
+                const threaded_code_t &entry_point_func = threaded_funcs_[func_index];
+                const threaded_instruction *pc_end = func_index == program_.entry_point_func_index_ ? &*(entry_point_func.end() - 1) : &function_exit_;
 
-                            const stack_item *old_frame = sp_;
-                            push_memory((ULONG)old_frame);
+                //nothing points into the nursery between the runs, as the stack is unwound and old objects never do
+                heap_.reset_nursery();
+                reset_fibers();
+                stack_begin_ = reinterpret_cast<stack_item *>(stack_->begin());
+                sp_ = fp_ = reinterpret_cast<stack_item *>(stack_->end());
+                value result;
 
-                            --sp_;
-                            fp_ = sp_;
+                stack_item tos; //the top of the stack while the decoded stream is in the s1 state
 
-                            check_room(f.locals_count_);
-                            sp_ -= f.locals_count_; //make room for local vars
-                            pc_ = &*f.instructions_.begin();    //advance pc_ to the function's first instruction
+                {
+                    const memory_manager::roots_activation roots_activation(heap_, *this);
 
-                            g_mm.function_begin();
+                    //pushed as a call pushes them, the last one first
+                    if (!check_room(args.size())) {
+                        grow_stack(args.size());
+                    }
+                    for (vector<value>::const_reverse_iterator arg_iter = args.rbegin(); arg_iter != args.rend(); ++arg_iter) {
+                        switch (arg_iter->type_) {
+                        case FLOAT_TYPE:
+                            push_float(arg_iter->f_);
+                            break;
+                        case STRING_TYPE:
+                            push_gcobject(arg_iter->gcobj_);
                             break;
+                        default:
+                            push_int(arg_iter->i_);
+                            break;
+                        }
+                    }
+                    enter_frame(entry_point.locals_count_, frame_room(entry_point), pc_end);
+                    pc_ = &*entry_point_func.begin();
+
+                    for (;;) {
+#if defined(FREEFOIL_THREADED_DISPATCH)
+L_switch_dispatch:
+#endif
+                        switch (pc_->opcode_) {
+
+                        VM_CASE(OPCODE_builtin_call) {
+                            const builtin_func_t &builtin_func = builtin_funcs_[pc_->operands_[0]];
+
+                            (this->*builtin_func.body_)(); //pops its own args
+                            if (pending_switch_ != NO_SWITCH) {
+                                //yield() and join() switch the fibers once their args are popped, a read which would block before
+                                suspend_fiber(pending_switch_ == SWITCH_PAST_CALL ? pc_ + 1 : pc_, pc_);
+                                pending_switch_ = NO_SWITCH;
+                                resume_next_fiber();
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ret: {  //return void
-                            fp_ = (stack_item *)pop_memory();
-                            pc_ = (const BYTE *) pop_memory();
-                            sp_ = fp_; //restore old fp_
+                        VM_CASE(OPCODE_call) {
+                            if (--fiber_budget_ <= 0 and preempt_fiber()) {
+                                VM_DISPATCH();
+                            }
+                            const threaded_instruction * const call = pc_;
+                            enter_frame(call->operands_[1], call->operands_[2], call + 1);
+                            pc_ = call->target_;    //advance pc_ to the function's first instruction
 
-                            sp_ += pop_memory(); //args count
+                            enter_function(call->operands_[0], tos);
+                            VM_DISPATCH();
+                        }
 
-                            g_mm.function_end();
-                            break;
+                        VM_CASE(OPCODE_tailcall) {
+                            if (--fiber_budget_ <= 0 and preempt_fiber()) {
+                                VM_DISPATCH();
+                            }
+                            const function_template &f = program_.user_funcs_[pc_->operands_[0]];
+                            stack_item * const frame = fp_;
+                            const threaded_instruction * const return_pc = frame[FRAME_RETURN_PC].pc_;
+                            fp_ = frame[FRAME_OLD_FP].pstack_item_;
+
+                            //the callee's params take the place of ours (and of our frame record, if there are more of them)
+                            stack_item * const params_end = frame + FRAME_RECORD_SIZE + pc_->operands_[2];
+                            std::copy_backward(sp_, sp_ + f.args_count_, params_end);
+                            sp_ = params_end - f.args_count_;
+
+                            const int callee = pc_->operands_[0];
+                            enter_frame(pc_->operands_[1], frame_room(f), return_pc);
+                            pc_ = pc_->target_;
+
+                            enter_function(callee, tos);
+                            VM_DISPATCH();
                         }
 
-                        case OPCODE_iret: { //return int
-                            fp_ = (stack_item *) pop_memory();
-                            pc_ = (const BYTE *) pop_memory();
-                            const int retv = pop_int();
-                            sp_ = fp_;
+                        VM_CASE(OPCODE_ret) {  //return void
+                            leave_frame();
 
-                            sp_ += pop_memory(); //args count
+                            return_to_caller(tos);
+                            VM_DISPATCH();
+                        }
 
+                        VM_CASE(OPCODE_iret) { //return int
+                            const int retv = pop_int();
+                            leave_frame();
                             push_int(retv);
 
-                            g_mm.function_end();
-                            break;
+                            return_to_caller(tos);
+                            VM_DISPATCH();
                         }
 
-                        case OPCODE_fret: { //return float
-                            fp_ = (stack_item *) pop_memory();
-                            pc_ = (const BYTE *) pop_memory();
+                        VM_CASE(OPCODE_fret) { //return float
                             const float retv = pop_float();
-                            sp_= fp_;
-
-                            sp_ += pop_memory(); //args count
-
+                            leave_frame();
                             push_float(retv);
 
-                            g_mm.function_end();
-                            break;
+                            return_to_caller(tos);
+                            VM_DISPATCH();
                         }
 
-                        case OPCODE_sret: { //return string
-                            fp_ = (stack_item *) pop_memory();
-                            pc_ = (const BYTE *) pop_memory();
+                        VM_CASE(OPCODE_sret) { //return string
                             const gcobject_instance_t gcobj = pop_gcobject();
-                            sp_ = fp_;
-
-                            sp_ += pop_memory(); //args count
-
+                            leave_frame();
                             push_gcobject(gcobj);
 
-                            g_mm.function_end();
-                            break;
+                            return_to_caller(tos);
+                            VM_DISPATCH();
                         }
 
-                        case OPCODE_iload_const: {
-                            const BYTE int_constant_index = *pc_++;
-                            const int value = program_.constants_pool_.get_int_value_from_table(int_constant_index);
+                        VM_CASE(OPCODE_iload_const) {
+                            const int value = program_.constants_pool_.get_int_value_from_table(pc_->operands_[0]);
                             push_int(value);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fload_const: {
-                            const BYTE float_constant_index = *pc_++;
-                            const float value = program_.constants_pool_.get_float_value_from_table(float_constant_index);
+                        VM_CASE(OPCODE_fload_const) {
+                            const float value = program_.constants_pool_.get_float_value_from_table(pc_->operands_[0]);
                             push_float(value);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_sload_const: {
-                            const BYTE string_constant_index = *pc_++;
-                            const std::string &value = program_.constants_pool_.get_string_value_from_table(string_constant_index);
-                            gcobject_instance_t gcobj = g_mm.sload(value);
-                            push_gcobject(gcobj);
-                            break;
+                        VM_CASE(OPCODE_sload_const) {
+                            push_gcobject(string_constants_[pc_->operands_[0]]);
+                            VM_NEXT();
                         }
 
-                        case OPCODE_iload: {
-                            const BYTE variable_offset = *pc_++;
-                            push_int((*(fp_ + variable_offset)).i_);
-                            break;
+                        VM_CASE(OPCODE_iload) {
+                            push_int((*(fp_ + pc_->operands_[0])).i_);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_fload) {
+                            push_float((*(fp_ + pc_->operands_[0])).f_);
+                            VM_NEXT();
                         }
 
-                        case OPCODE_isave: {
+                        VM_CASE(OPCODE_isave) {
                             const int value = pop_int();
-                            const BYTE variable_offset = *pc_++;
-                            (*(fp_ + variable_offset)).i_ = value;
-                            break;
+                            (*(fp_ + pc_->operands_[0])).i_ = value;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fsave: {
+                        VM_CASE(OPCODE_fsave) {
                             const float value = pop_float();
-                            const BYTE variable_offset = *pc_++;
-                            (*(fp_ + variable_offset)).i_ = value;
-                            break;
+                            (*(fp_ + pc_->operands_[0])).f_ = value;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ssave: {
+                        VM_CASE(OPCODE_ssave) {
                             const gcobject_instance_t gcobj = pop_gcobject();
-                            const BYTE variable_offset = *pc_++;
-                            (*(fp_ + variable_offset)).gcobj_ = gcobj;
-                            break;
+                            (*(fp_ + pc_->operands_[0])).gcobj_ = gcobj;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fadd: {
+                        VM_CASE(OPCODE_fadd) {
                             const float value2 = pop_float();
                             push_float(pop_float() + value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fmul: {
+                        VM_CASE(OPCODE_fmul) {
                             const float value2 = pop_float();
                             push_float(pop_float() * value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fdiv: {
+                        VM_CASE(OPCODE_fdiv) {
                             const float value2 = pop_float();
                             if (value2 == 0.0) {
-                                throw freefoil_exception("runtime exception: divizion by zero");
+                                throw freefoil_exception("runtime exception: division by zero");
                             }
                             push_float(pop_float() / value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fsub: {
+                        VM_CASE(OPCODE_fsub) {
                             const float value2 = pop_float();
                             push_float(pop_float() - value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_iadd: {
+                        VM_CASE(OPCODE_iadd) {
                             const int value2 = pop_int();
                             push_int(pop_int() + value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_imul: {
+                        VM_CASE(OPCODE_imul) {
                             const int value2 = pop_int();
                             push_int(pop_int() * value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_idiv: {
+                        VM_CASE(OPCODE_idiv) {
                             const int value2 = pop_int();
-                            std::cout << value2 << std::endl;
                             if (value2 == 0) {
-                                throw freefoil_exception("runtime exception: divizion by zero");
+                                throw freefoil_exception("runtime exception: division by zero");
                             }
-                            push_float((float) (pop_int() / value2));
-                            break;
+                            push_int(pop_int() / value2);
+                            VM_NEXT();
                         }
 
-                        case OPCODE_isub: {
+                        VM_CASE(OPCODE_isub) {
                             const int value2 = pop_int();
                             push_int(pop_int() - value2);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_sload: {
-                            const BYTE variable_offset = *pc_++;
-                            push_gcobject((*(fp_ + variable_offset)).gcobj_);
-                            break;
+                        VM_CASE(OPCODE_sload) {
+                            push_gcobject((*(fp_ + pc_->operands_[0])).gcobj_);
+                            VM_NEXT();
                         }
 
-                        case OPCODE_sadd: {
-                             //TODO
-                            break;
+                        VM_CASE(OPCODE_sadd) {
+                            //the operands stay on the stack while the concatenation may collect garbage
+                            const gcobject_instance_t value = heap_.concat(sp_[1].gcobj_, sp_[0].gcobj_);
+                            ++sp_;
+                            sp_->gcobj_ = value;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_seq) {
+                            const gcobject_instance_t value2 = pop_gcobject();
+                            const gcobject_instance_t value1 = pop_gcobject();
+                            push_int(heap_.equal_strings(*value1, *value2) ? 1 : 0);
+                            VM_NEXT();
                         }
 
-                        case OPCODE_inegate: {
+                        VM_CASE(OPCODE_scmp) {
+                            const gcobject_instance_t value2 = pop_gcobject();
+                            const gcobject_instance_t value1 = pop_gcobject();
+                            push_int(heap_.compare_strings(*value1, *value2));
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_inegate) {
                             const int value = pop_int();
                             push_int(- value);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_fnegate: {
+                        VM_CASE(OPCODE_fnegate) {
                             const float value = pop_float();
                             push_float(- value);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_f2i: {
+                        VM_CASE(OPCODE_f2i) {
                             //warning: possibly, information lost
                             push_int(static_cast<int>(pop_float()));
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_i2f: {
+                        VM_CASE(OPCODE_i2f) {
                             push_float(pop_int());
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_jmp: {
-                            const BYTE relative_offset = *pc_;
-                            pc_ += relative_offset;
-                            break;
+                        VM_CASE(OPCODE_jmp) {
+                            pc_ = pc_->target_;
+                            VM_DISPATCH();
                         }
 
-                        case OPCODE_jnz: {  //jmp if true
+                        VM_CASE(OPCODE_jnz) {  //jmp if true
                             const int value = pop_int();
-                            assert(value == 0 or value == 1);  
+                            assert(value == 0 or value == 1);
                             if (value == 1){
-								push_int(value);
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                push_int(value);
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_jz: { //jmp if false
+                        VM_CASE(OPCODE_jz) { //jmp if false
                             const int value = pop_int();
                             assert(value == 0 or value == 1);
                             if (value == 0){
-								push_int(value);
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                push_int(value);
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_push_true: {
+                        VM_CASE(OPCODE_push_true) {
                             push_int(1);
-                            break;
-                        };
+                            VM_NEXT();
+                        }
 
-                        case OPCODE_push_false: {
+                        VM_CASE(OPCODE_push_false) {
                             push_int(0);
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ifeq: {
+                        VM_CASE(OPCODE_ifeq) {
                             if (pop_int() == pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ifneq: {
+                        VM_CASE(OPCODE_ifneq) {
                             if (pop_int() != pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
-                        };
+                            VM_NEXT();
+                        }
 
-                        case OPCODE_ifgreater: {
+                        VM_CASE(OPCODE_ifgreater) {
                             if (pop_int() < pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ifless: {
+                        VM_CASE(OPCODE_ifless) {
                             if (pop_int() > pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                        case OPCODE_ifgeq: {
+                        VM_CASE(OPCODE_ifgeq) {
                             if (pop_int() <= pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
                         }
 
-                         case OPCODE_ifleq: {
+                        VM_CASE(OPCODE_ifleq) {
                             if (pop_int() >= pop_int()){
-                                pc_ += *pc_;
-                            }else{
-                                ++pc_;
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
                             }
-                            break;
+                            VM_NEXT();
+                        }
+
+                        //superinstructions
+
+                        VM_CASE(OPCODE_iload_iload) {
+                            push_int(local_int(0));
+                            push_int(local_int(1));
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const) {
+                            push_int(local_int(0));
+                            push_int(const_int(1));
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_iadd_isave) {
+                            local_int(2) = local_int(0) + local_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_isub_isave) {
+                            local_int(2) = local_int(0) - local_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_imul_isave) {
+                            local_int(2) = local_int(0) * local_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_iadd_isave) {
+                            local_int(2) = local_int(0) + const_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_isub_isave) {
+                            local_int(2) = local_int(0) - const_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifeq) {
+                            if (local_int(0) == local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifneq) {
+                            if (local_int(0) != local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifleq) {
+                            if (local_int(0) <= local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifgeq) {
+                            if (local_int(0) >= local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifgreater) {
+                            if (local_int(0) > local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_ifless) {
+                            if (local_int(0) < local_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifeq) {
+                            if (local_int(0) == const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifneq) {
+                            if (local_int(0) != const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifleq) {
+                            if (local_int(0) <= const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifgeq) {
+                            if (local_int(0) >= const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifgreater) {
+                            if (local_int(0) > const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_iload_iload_const_ifless) {
+                            if (local_int(0) < const_int(1)){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        //top of stack caching versions
+
+                        VM_CASE(TOS_iload_s01) {
+                            tos.i_ = local_int(0);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_s11) {
+                            push_item(tos);
+                            tos.i_ = local_int(0);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_fload_s01) {
+                            tos.f_ = (*(fp_ + pc_->operands_[0])).f_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_fload_s11) {
+                            push_item(tos);
+                            tos.f_ = (*(fp_ + pc_->operands_[0])).f_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_const_s01) {
+                            tos.i_ = const_int(0);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_const_s11) {
+                            push_item(tos);
+                            tos.i_ = const_int(0);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_iload_s01) {
+                            push_int(local_int(0));
+                            tos.i_ = local_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_iload_s11) {
+                            push_item(tos);
+                            push_int(local_int(0));
+                            tos.i_ = local_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_iload_const_s01) {
+                            push_int(local_int(0));
+                            tos.i_ = const_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iload_iload_const_s11) {
+                            push_item(tos);
+                            push_int(local_int(0));
+                            tos.i_ = const_int(1);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iadd_s01) {
+                            const int value2 = pop_int();
+                            tos.i_ = pop_int() + value2;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iadd_s11) {
+                            tos.i_ = pop_int() + tos.i_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_isub_s01) {
+                            const int value2 = pop_int();
+                            tos.i_ = pop_int() - value2;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_isub_s11) {
+                            tos.i_ = pop_int() - tos.i_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_imul_s01) {
+                            const int value2 = pop_int();
+                            tos.i_ = pop_int() * value2;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_imul_s11) {
+                            tos.i_ = pop_int() * tos.i_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_isave_s10) {
+                            local_int(0) = tos.i_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifeq_s10) {
+                            if (pop_int() == tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifneq_s10) {
+                            if (pop_int() != tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifleq_s10) {
+                            if (pop_int() <= tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifgeq_s10) {
+                            if (pop_int() >= tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifgreater_s10) {
+                            if (pop_int() > tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_ifless_s10) {
+                            if (pop_int() < tos.i_){
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_jz_s10) {
+                            assert(tos.i_ == 0 or tos.i_ == 1);
+                            if (tos.i_ == 0){
+                                push_int(tos.i_);
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_jnz_s10) {
+                            assert(tos.i_ == 0 or tos.i_ == 1);
+                            if (tos.i_ == 1){
+                                push_int(tos.i_);
+                                pc_ = pc_->target_;
+                                VM_DISPATCH();
+                            }
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_iret_s10) {
+                            const int retv = tos.i_;
+                            leave_frame();
+                            push_int(retv);
+
+                            return_to_caller(tos);
+                            VM_DISPATCH();
+                        }
+
+                        VM_CASE(TOS_pop_s10) {
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(TOS_flush_s10) {
+                            push_item(tos);
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(OPCODE_pop) {
+                            ++sp_;
+                            VM_NEXT();
+                        }
+
+                        VM_CASE(STUB_segment_return) {
+                            pop_segment();
+
+                            return_to_caller(tos);
+                            VM_DISPATCH();
+                        }
+
+                        VM_CASE(STUB_fiber_exit) {
+                            end_fiber();
+                            resume_next_fiber();
+                            VM_DISPATCH();
+                        }
+
+                        VM_CASE(STUB_bad_jump) {
+                            throw freefoil_exception("runtime exception: jump out of the function code");
+                        }
+
+                        VM_CASE(OPCODE_halt) {
+                            if (live_fibers_ != 0) {
+                                //the main fiber waits for the others at the halt, with the value of the entry point on its stack
+                                main_waiting_ = true;
+                                suspend_fiber(pc_, NULL);
+                                resume_next_fiber();
+                                VM_DISPATCH();
+                            }
+                            goto L_halt;
                         }
 
                         //TODO:
 
                         default: {
-                            throw freefoil_exception("wrong opcode: " + ip_);
+#if defined(FREEFOIL_THREADED_DISPATCH)
+L_bad_opcode:
+#endif
+                            throw freefoil_exception("wrong opcode: " + boost::lexical_cast<string>(static_cast<int>(pc_->opcode_)));
                         }
                         }
                     }
-					
+L_halt:
+                    //the return of the entry point leaves its value on the stack
+                    switch (entry_point.return_type_) {
+                    case INT_TYPE:
+                        result = value(sp_->i_);
+                        break;
+                    case FLOAT_TYPE:
+                        result = value(sp_->f_);
+                        break;
+                    case BOOL_TYPE:
+                        result = value(sp_->i_ != 0);
+                        break;
+                    case STRING_TYPE:
+                        result = value(sp_->gcobj_);
+                        break;
+                    default:
+                        break;
+                    }
+                }
+                return result;
+            }
+
+            //runs the entry point, which has no params, and prints the error it fails with, if any
+            void exec() {
+                try {
+                    run(vector<value>());
                 } catch (const std::exception &e) {
                     std::cout << e.what() << std::endl;
                 } catch (...) {
                     std::cout << "unknown exception" << std::endl;
                 }
+            }
+
+            //a string argument for run(); it is made in the old space, so the start of the run doesn't drop it,
+            //and it lives as long as the run reaches it
+            gcobject_instance_t make_string(const string &str) {
+                return heap_.make_old_string(str);
+            }
+
+            memory_manager &get_heap() {
+                return heap_;
+            }
+
+            //the string constants, and the params and locals the bytecode handles as strings, and the operand stack slots
+            //the stack maps mark, of every frame of every fiber, from the current one down to the frame of the entry point;
+            //the collector updates the slots of the objects it moves out of the nursery
+            virtual void mark_roots(memory_manager &mm) {
+                for (vector<gcobject_instance_t>::iterator constant_iter = string_constants_.begin(); constant_iter != string_constants_.end(); ++constant_iter) {
+                    mm.mark(*constant_iter);
+                }
+
+                mark_frames(mm, pc_, sp_, fp_, current_fiber_->segment_);
+                if (current_fiber_ != &main_fiber_) {
+                    mark_waiting_fiber(mm, main_fiber_);
+                }
+                for (vector<fiber *>::iterator fiber_iter = fibers_.begin(); fiber_iter != fibers_.end(); ++fiber_iter) {
+                    if (*fiber_iter != NULL and *fiber_iter != current_fiber_ and (*fiber_iter)->started_) {
+                        mark_waiting_fiber(mm, **fiber_iter);
+                    }
+                }
+            }
+
+        private:
+            void mark_waiting_fiber(memory_manager &mm, fiber &f) {
+                if (f.safe_point_ != NULL) {
+                    mark_frames(mm, f.safe_point_, f.sp_, f.fp_, f.segment_);
+                } else if (f.sp_ != reinterpret_cast<stack_item *>(stack_->end())) {
+                    //the value of the entry point, of a type the VM doesn't know; mark() takes it for a pointer only if it is one
+                    mm.mark(f.sp_->gcobj_);
+                }
+            }
+
+            //walks the frames of a fiber, from the top one waiting at the instruction down to its first one
+            void mark_frames(memory_manager &mm, const threaded_instruction *pc, const stack_item *top, stack_item *fp, stack_segment *segment) {
+                const stack_item * const stack_end = reinterpret_cast<stack_item *>(stack_->end());
+                while (fp != stack_end) {
+                    const std::map<const threaded_instruction *, gc_safe_point>::const_iterator safe_point_iter = safe_points_.find(pc);
+                    if (safe_point_iter == safe_points_.end()) {
+                        //the roots of the frame are unknown, and skipping them would free or move live objects
+                        throw freefoil_exception("runtime exception: garbage collection at an instruction which is not a safe point");
+                    }
+                    const function_template &f = *safe_point_iter->second.function_;
+                    const stack_map_t &stack_map = *safe_point_iter->second.stack_map_;
 
-                g_mm.function_end();
-                //TODO: g_mm.dealloc();
+                    for (vector<int>::const_iterator slot_iter = f.ref_slots_.begin(); slot_iter != f.ref_slots_.end(); ++slot_iter) {
+                        const int offset = *slot_iter > 0 ? *slot_iter + FRAME_RECORD_SIZE - 1 : *slot_iter;
+                        mm.mark(fp[offset].gcobj_);
+                    }
+                    //the operand stack starts below the locals; the params of a call are the callee's, so they are marked with its frame
+                    stack_item * const bottom = fp - f.locals_count_ - 1;
+                    for (std::size_t i = 0; i < stack_map.size() and bottom - i >= top; ++i) {
+                        if (stack_map[i]) {
+                            mm.mark(bottom[-static_cast<std::ptrdiff_t>(i)].gcobj_);
+                        }
+                    }
+
+                    top = fp + FRAME_RECORD_SIZE + f.args_count_;
+                    const threaded_instruction *return_pc = fp[FRAME_RETURN_PC].pc_;
+                    //the first frame of a segment returns into the previous one through the stub, once per segment
+                    while (return_pc == &segment_return_) {
+                        top = segment->return_sp_;
+                        return_pc = segment->return_pc_;
+                        segment = segment->prev_;
+                    }
+                    if (return_pc == &fiber_exit_) {
+                        break;
+                    }
+                    pc = return_pc - 1; //the call the caller waits at
+                    fp = fp[FRAME_OLD_FP].pstack_item_;
+                }
             }
         };
 
@@ -516,4 +2805,11 @@ namespace Freefoil {
 
 }
 
+#undef VM_NEXT
+#undef VM_DISPATCH
+#undef VM_CASE
+#if defined(FREEFOIL_THREADED_DISPATCH)
+#undef VM_HANDLER
+#endif
+
 #endif // FREEFOIL_VM_H_INCLUDED
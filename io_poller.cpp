@@ -0,0 +1,137 @@
+#include "io_poller.h"
+#include "exceptions.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(FREEFOIL_EPOLL)
+#include <sys/epoll.h>
+#endif
+
+namespace Freefoil {
+    namespace Runtime {
+
+#if defined(FREEFOIL_EPOLL)
+
+        io_poller::io_poller()
+            :epoll_fd_(-1), waiting_(0) {
+        }
+
+        io_poller::~io_poller() {
+            if (epoll_fd_ != -1) {
+                ::close(epoll_fd_);
+            }
+        }
+
+        bool io_poller::watch(const int fd, void *waiter) {
+            //made on the first wait, as most of the VMs never wait for a file
+            if (epoll_fd_ == -1) {
+                epoll_fd_ = epoll_create(1);
+                if (epoll_fd_ == -1) {
+                    throw freefoil_exception("runtime exception: can't wait for the files");
+                }
+            }
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = waiter;
+            const bool registered = registered_.count(fd) != 0;
+            if (epoll_ctl(epoll_fd_, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0) {
+                if (errno == EPERM) {
+                    return false;
+                }
+                throw freefoil_exception("runtime exception: can't wait for the file");
+            }
+            registered_.insert(fd);
+            ++waiting_;
+            return true;
+        }
+
+        void io_poller::wait(vector<void *> &ready, const bool block) {
+            struct epoll_event events[16];
+            int count;
+            do {
+                count = epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(events[0]), block ? -1 : 0);
+            } while (count == -1 and errno == EINTR);
+            if (count == -1) {
+                throw freefoil_exception("runtime exception: can't wait for the files");
+            }
+            //a one shot file is disarmed once it fires, until it is watched again
+            for (int i = 0; i < count; ++i) {
+                ready.push_back(events[i].data.ptr);
+            }
+            waiting_ -= count;
+        }
+
+        void io_poller::forget(const int fd) {
+            if (registered_.erase(fd) != 0) {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+            }
+        }
+
+        void io_poller::reset() {
+            for (std::set<int>::const_iterator fd_iter = registered_.begin(); fd_iter != registered_.end(); ++fd_iter) {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, *fd_iter, NULL);
+            }
+            registered_.clear();
+            waiting_ = 0;
+        }
+
+#else
+
+        io_poller::io_poller()
+            :epoll_fd_(-1), waiting_(0) {
+        }
+
+        io_poller::~io_poller() {
+        }
+
+        bool io_poller::watch(const int, void *) {
+            return false;
+        }
+
+        void io_poller::wait(vector<void *> &, const bool) {
+        }
+
+        void io_poller::forget(const int) {
+        }
+
+        void io_poller::reset() {
+        }
+
+#endif
+
+        int io_poller::open_file(const char *path) {
+#if defined(FREEFOIL_EPOLL)
+            return ::open(path, O_RDONLY | O_NONBLOCK);
+#else
+            return ::open(path, O_RDONLY);
+#endif
+        }
+
+        long io_poller::read_file(const int fd, char *buffer, const std::size_t size) {
+            ssize_t count;
+            do {
+                count = ::read(fd, buffer, size);
+            } while (count == -1 and errno == EINTR);
+            if (count == -1) {
+                if (errno == EAGAIN or errno == EWOULDBLOCK) {
+                    return -1;
+                }
+                throw freefoil_exception("runtime exception: can't read the file");
+            }
+            return count;
+        }
+
+        void io_poller::set_blocking(const int fd) {
+            const int flags = fcntl(fd, F_GETFL);
+            if (flags != -1) {
+                fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+            }
+        }
+
+        void io_poller::close_file(const int fd) {
+            ::close(fd);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef IO_POLLER_H_INCLUDED
+#define IO_POLLER_H_INCLUDED
+
+#include <cstddef>
+#include <set>
+#include <vector>
+
+//the I/O builtins wait for the files on epoll, so that a read which would block parks the fiber making it only;
+//define FREEFOIL_NO_EPOLL to have them block the thread instead
+#if defined(__linux__) && !defined(FREEFOIL_NO_EPOLL)
+#define FREEFOIL_EPOLL
+#endif
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::vector;
+
+        //the readiness of the files the waiters of a VM wait for. A file is watched for one event at a time, so each
+        //wait has one waiter, which is handed back once the file is ready; the files are opened and read with the
+        //static functions, so that they are non-blocking exactly when they can be waited for.
+        //Without epoll there is nothing to wait on, and no file is ever watched.
+        class io_poller {
+
+            io_poller(const io_poller &);
+            io_poller &operator =(const io_poller &);
+
+            int epoll_fd_;
+            std::set<int> registered_; //the files epoll knows, armed or not
+            std::size_t waiting_;      //armed files
+        public:
+            io_poller();
+            ~io_poller();
+
+            //arms the file for the waiter, until it is readable or at its end; returns false if the file can't be
+            //waited for, e.g. a regular file, whose reads never block anyway
+            bool watch(const int fd, void *waiter);
+
+            //whether any waiter waits for a file
+            bool has_waiters() const {
+                return waiting_ != 0;
+            }
+
+            //appends the waiters of the armed files which are ready; blocks until there is at least one if block is set
+            void wait(vector<void *> &ready, const bool block);
+
+            //the file is to be closed; it is no longer waited for
+            void forget(const int fd);
+
+            //forgets every file, e.g. as the waiters are gone
+            void reset();
+
+            //the file opened for reading, in the non-blocking mode if its reads are to wait on a poller;
+            //returns -1 if it can't be opened
+            static int open_file(const char *path);
+
+            //reads up to size bytes; returns the count, 0 at the end of the file, or -1 if the read would block
+            static long read_file(const int fd, char *buffer, const std::size_t size);
+
+            //makes the reads of the file block, as it can't be waited for
+            static void set_blocking(const int fd);
+
+            static void close_file(const int fd);
+        };
+    }
+}
+
+#endif // IO_POLLER_H_INCLUDED
@@ -0,0 +1,73 @@
+#include "jit_x64.h"
+#include "exceptions.h"
+
+#if defined(FREEFOIL_JIT)
+
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace Freefoil {
+    namespace Runtime {
+
+        static const std::size_t CHUNK_SIZE = 64 * 1024;
+        static const std::size_t CODE_ALIGNMENT = 16;
+
+        jit_code_buffer::jit_code_buffer(const bool perf_map)
+            :used_(0), perf_map_(NULL) {
+            if (perf_map) {
+                char path[64];
+                std::sprintf(path, "/tmp/perf-%d.map", static_cast<int>(getpid()));
+                perf_map_ = std::fopen(path, "a");
+            }
+        }
+
+        jit_code_buffer::~jit_code_buffer() {
+            for (std::size_t i = 0; i < chunks_.size(); ++i) {
+                munmap(chunks_[i].begin_, chunks_[i].size_);
+            }
+            if (perf_map_ != NULL) {
+                std::fclose(perf_map_);
+            }
+        }
+
+        const void *jit_code_buffer::install(const vector<unsigned char> &code, const string &name) {
+            used_ = (used_ + CODE_ALIGNMENT - 1) / CODE_ALIGNMENT * CODE_ALIGNMENT;
+            if (chunks_.empty() or used_ + code.size() > chunks_.back().size_) {
+                const std::size_t page_size = sysconf(_SC_PAGESIZE);
+                const std::size_t size = (std::max(code.size(), CHUNK_SIZE) + page_size - 1) / page_size * page_size;
+                void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mapping == MAP_FAILED) {
+                    return NULL;
+                }
+                chunk new_chunk = { static_cast<char *>(mapping), size };
+                chunks_.push_back(new_chunk);
+                used_ = 0;
+            } else if (mprotect(chunks_.back().begin_, chunks_.back().size_, PROT_READ | PROT_WRITE) != 0) {
+                return NULL;
+            }
+
+            const std::size_t offset = used_;
+            char *address = chunks_.back().begin_ + offset;
+            std::memcpy(address, &code[0], code.size());
+            if (mprotect(chunks_.back().begin_, chunks_.back().size_, PROT_READ | PROT_EXEC) != 0) {
+                //the function stays interpreted; the functions installed in the chunk before it can't run any longer, though
+                if (offset != 0) {
+                    throw freefoil_exception("runtime exception: the jitted code can't be made executable again");
+                }
+                return NULL;
+            }
+            used_ += code.size();
+
+            if (perf_map_ != NULL) {
+                std::fprintf(perf_map_, "%lx %lx %s\n", reinterpret_cast<unsigned long>(address),
+                             static_cast<unsigned long>(code.size()), name.c_str());
+                std::fflush(perf_map_);
+            }
+            return address;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef JIT_X64_H_INCLUDED
+#define JIT_X64_H_INCLUDED
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+#include <string>
+
+//the baseline JIT emits x86-64 code and maps it with mmap/mprotect;
+//define FREEFOIL_NO_JIT to build the interpreters only
+#if defined(__x86_64__) && defined(__unix__) && defined(__GNUC__) && !defined(FREEFOIL_NO_JIT)
+#define FREEFOIL_JIT
+#endif
+
+#if defined(FREEFOIL_JIT)
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::vector;
+        using std::string;
+
+        //general purpose registers by their encoding
+        enum x64_register {
+            RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+            R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+        };
+
+        enum x64_xmm_register {
+            XMM0 = 0, XMM1 = 1
+        };
+
+        //condition codes of jcc
+        enum x64_condition {
+            CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_P = 0xA,
+            CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+        };
+
+        //emitter of the few x86-64 instructions the baseline JIT needs; memory operands are always [base + disp]
+        class x64_assembler {
+
+            vector<unsigned char> code_;
+
+            //two byte opcodes are given as 0x0Fxx
+            void emit_opcode(const unsigned opcode) {
+                if (opcode > 0xFF) {
+                    emit_byte(opcode >> 8);
+                }
+                emit_byte(opcode & 0xFF);
+            }
+
+            void emit_rex(const bool wide, const int reg, const int rm) {
+                const unsigned char rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+                if (rex != 0x40) {
+                    emit_byte(rex);
+                }
+            }
+
+            void op_mem(const unsigned opcode, const int reg, const x64_register base, const int disp,
+                        const bool wide = false, const unsigned char prefix = 0) {
+                if (prefix != 0) {
+                    emit_byte(prefix);
+                }
+                emit_rex(wide, reg, base);
+                emit_opcode(opcode);
+                //rbp and r13 have no displacement free form, rsp and r12 need a SIB byte
+                const bool short_disp = disp >= -128 and disp <= 127;
+                const unsigned char mod = (disp == 0 and (base & 7) != RBP) ? 0x00 : (short_disp ? 0x40 : 0x80);
+                emit_byte(mod | ((reg & 7) << 3) | (base & 7));
+                if ((base & 7) == RSP) {
+                    emit_byte(0x24);
+                }
+                if (mod == 0x40) {
+                    emit_byte(disp & 0xFF);
+                } else if (mod == 0x80) {
+                    emit_dword(disp);
+                }
+            }
+
+            void op_reg(const unsigned opcode, const int reg, const int rm, const bool wide = false, const unsigned char prefix = 0) {
+                if (prefix != 0) {
+                    emit_byte(prefix);
+                }
+                emit_rex(wide, reg, rm);
+                emit_opcode(opcode);
+                emit_byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+            }
+
+        public:
+            //a forward jump, whose rel32 is filled in by bind()
+            typedef std::size_t label_t;
+
+            std::size_t size() const {
+                return code_.size();
+            }
+
+            const vector<unsigned char> &code() const {
+                return code_;
+            }
+
+            void emit_byte(const unsigned value) {
+                code_.push_back(value & 0xFF);
+            }
+
+            void emit_dword(const unsigned value) {
+                for (int i = 0; i < 4; ++i) {
+                    emit_byte(value >> (8 * i));
+                }
+            }
+
+            //32 bit moves and arithmetics
+
+            void mov_load32(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x8B, dst, base, disp);
+            }
+
+            void mov_store32(const x64_register base, const int disp, const x64_register src) {
+                op_mem(0x89, src, base, disp);
+            }
+
+            void mov_store32_imm(const x64_register base, const int disp, const int value) {
+                op_mem(0xC7, 0, base, disp);
+                emit_dword(value);
+            }
+
+            void mov_imm32(const x64_register dst, const int value) {
+                emit_rex(false, 0, dst);
+                emit_byte(0xB8 + (dst & 7));
+                emit_dword(value);
+            }
+
+            void mov_reg32(const x64_register dst, const x64_register src) {
+                op_reg(0x89, src, dst);
+            }
+
+            void add_load32(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x03, dst, base, disp);
+            }
+
+            void sub_load32(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x2B, dst, base, disp);
+            }
+
+            void imul_load32(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x0FAF, dst, base, disp);
+            }
+
+            void add_store32(const x64_register base, const int disp, const x64_register src) {
+                op_mem(0x01, src, base, disp);
+            }
+
+            void sub_store32(const x64_register base, const int disp, const x64_register src) {
+                op_mem(0x29, src, base, disp);
+            }
+
+            void add_imm32(const x64_register dst, const int value) {
+                op_reg(0x81, 0, dst);
+                emit_dword(value);
+            }
+
+            void sub_imm32(const x64_register dst, const int value) {
+                op_reg(0x81, 5, dst);
+                emit_dword(value);
+            }
+
+            void sub_reg32(const x64_register dst, const x64_register src) {
+                op_reg(0x29, src, dst);
+            }
+
+            void cmp_reg32(const x64_register left, const x64_register right) {
+                op_reg(0x39, right, left);
+            }
+
+            void cmp_load32(const x64_register left, const x64_register base, const int disp) {
+                op_mem(0x3B, left, base, disp);
+            }
+
+            void cmp_imm32(const x64_register left, const int value) {
+                op_reg(0x81, 7, left);
+                emit_dword(value);
+            }
+
+            void cmp_mem32_imm(const x64_register base, const int disp, const int value) {
+                op_mem(0x81, 7, base, disp);
+                emit_dword(value);
+            }
+
+            void neg_mem32(const x64_register base, const int disp) {
+                op_mem(0xF7, 3, base, disp);
+            }
+
+            void xor_mem32_imm(const x64_register base, const int disp, const int value) {
+                op_mem(0x81, 6, base, disp);
+                emit_dword(value);
+            }
+
+            //64 bit moves and pointer arithmetics
+
+            void mov_load64(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x8B, dst, base, disp, true);
+            }
+
+            void mov_store64(const x64_register base, const int disp, const x64_register src) {
+                op_mem(0x89, src, base, disp, true);
+            }
+
+            void mov_reg64(const x64_register dst, const x64_register src) {
+                op_reg(0x89, src, dst, true);
+            }
+
+            void mov_imm64(const x64_register dst, const unsigned long long value) {
+                emit_rex(true, 0, dst);
+                emit_byte(0xB8 + (dst & 7));
+                emit_dword(static_cast<unsigned>(value));
+                emit_dword(static_cast<unsigned>(value >> 32));
+            }
+
+            void mov_pointer(const x64_register dst, const void *pointer) {
+                mov_imm64(dst, reinterpret_cast<std::size_t>(pointer));
+            }
+
+            void lea64(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x8D, dst, base, disp, true);
+            }
+
+            void add_imm64(const x64_register dst, const int value) {
+                op_reg(0x81, 0, dst, true);
+                emit_dword(value);
+            }
+
+            void sub_imm64(const x64_register dst, const int value) {
+                op_reg(0x81, 5, dst, true);
+                emit_dword(value);
+            }
+
+            void cmp_load64(const x64_register left, const x64_register base, const int disp) {
+                op_mem(0x3B, left, base, disp, true);
+            }
+
+            void test_reg64(const x64_register left, const x64_register right) {
+                op_reg(0x85, right, left, true);
+            }
+
+            //scalar single precision floats
+
+            void movss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F10, dst, base, disp, false, 0xF3);
+            }
+
+            void movss_store(const x64_register base, const int disp, const x64_xmm_register src) {
+                op_mem(0x0F11, src, base, disp, false, 0xF3);
+            }
+
+            void addss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F58, dst, base, disp, false, 0xF3);
+            }
+
+            void subss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F5C, dst, base, disp, false, 0xF3);
+            }
+
+            void mulss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F59, dst, base, disp, false, 0xF3);
+            }
+
+            void divss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F5E, dst, base, disp, false, 0xF3);
+            }
+
+            void xorps(const x64_xmm_register dst, const x64_xmm_register src) {
+                op_reg(0x0F57, dst, src);
+            }
+
+            void ucomiss_load(const x64_xmm_register left, const x64_register base, const int disp) {
+                op_mem(0x0F2E, left, base, disp);
+            }
+
+            void cvttss2si_load(const x64_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F2C, dst, base, disp, false, 0xF3);
+            }
+
+            void cvtsi2ss_load(const x64_xmm_register dst, const x64_register base, const int disp) {
+                op_mem(0x0F2A, dst, base, disp, false, 0xF3);
+            }
+
+            //control transfer
+
+            void push(const x64_register reg) {
+                emit_rex(false, 0, reg);
+                emit_byte(0x50 + (reg & 7));
+            }
+
+            void pop(const x64_register reg) {
+                emit_rex(false, 0, reg);
+                emit_byte(0x58 + (reg & 7));
+            }
+
+            void ret() {
+                emit_byte(0xC3);
+            }
+
+            void call_reg(const x64_register target) {
+                op_reg(0xFF, 2, target);
+            }
+
+            void jmp_reg(const x64_register target) {
+                op_reg(0xFF, 4, target);
+            }
+
+            void jmp_mem(const x64_register base, const int disp) {
+                op_mem(0xFF, 4, base, disp);
+            }
+
+            label_t jmp() {
+                emit_byte(0xE9);
+                emit_dword(0);
+                return code_.size();
+            }
+
+            label_t jcc(const x64_condition condition) {
+                emit_byte(0x0F);
+                emit_byte(0x80 + condition);
+                emit_dword(0);
+                return code_.size();
+            }
+
+            //points the jump at the offset in the code, the current position by default
+            void bind(const label_t label, const std::size_t offset) {
+                const unsigned rel = static_cast<unsigned>(offset - label);
+                for (int i = 0; i < 4; ++i) {
+                    code_[label - 4 + i] = (rel >> (8 * i)) & 0xFF;
+                }
+            }
+
+            void bind(const label_t label) {
+                bind(label, code_.size());
+            }
+        };
+
+        //executable memory the jitted functions are copied into. Chunks are writable only while code is being copied,
+        //and every function installed is listed in /tmp/perf-<pid>.map if requested, so that perf can name its samples
+        class jit_code_buffer {
+
+            jit_code_buffer(const jit_code_buffer &);
+            jit_code_buffer &operator =(const jit_code_buffer &);
+
+            struct chunk {
+                char *begin_;
+                std::size_t size_;
+            };
+
+            vector<chunk> chunks_;
+            std::size_t used_; //bytes used in the last chunk
+            std::FILE *perf_map_;
+
+        public:
+            explicit jit_code_buffer(const bool perf_map);
+            ~jit_code_buffer();
+
+            //copies the code into executable memory; returns NULL if no more memory can be mapped, or if it can't be
+            //made executable, e.g. under a policy which forbids writable memory to become executable
+            const void *install(const vector<unsigned char> &code, const string &name);
+        };
+    }
+}
+
+#endif
+
+#endif // JIT_X64_H_INCLUDED
@@ -1,20 +1,340 @@
 #include "compiler.h"
 #include "freefoil_vm.h"
+#include "freefoil_register_vm.h"
+#include "aot_translator.h"
+#include "batch_pool.h"
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+
+#if defined(__unix__)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
 
 using std::string;
+using std::vector;
+using Freefoil::Runtime::batch_argument;
+
+static void print_heap_stats(const Freefoil::Runtime::memory_manager &mm) {
+    const Freefoil::Runtime::gc_stats &stats = mm.get_stats();
+    std::cout << "gc: " << stats.minor_collections_ << " minor collections, " << stats.objects_promoted_ << " objects promoted, "
+              << stats.collections_ << " collections, " << stats.objects_reclaimed_ << " objects and "
+              << stats.bytes_reclaimed_ << " bytes reclaimed, pauses " << stats.total_pause_us_ << "us in total, "
+              << stats.max_pause_us_ << "us at most" << std::endl;
 
-//TODO: parse program args
-int main() {
+    Freefoil::Runtime::allocator_stats heap;
+    mm.get_allocator_stats(heap);
+    std::cout << "heap: " << heap.live_allocations_ << " objects in " << heap.live_bytes_ << " bytes, "
+              << heap.mapped_bytes_ << " bytes mapped, " << static_cast<int>(heap.get_fragmentation() * 100) << "% fragmentation, "
+              << heap.slabs_released_ << " slabs released" << std::endl;
+    for (std::size_t i = 0; i < heap.classes_.size(); ++i) {
+        const Freefoil::Runtime::allocator_stats::size_class_stats &cls = heap.classes_[i];
+        if (cls.slabs_ != 0) {
+            std::cout << "  " << cls.block_size_ << " bytes: " << cls.live_blocks_ << " of " << cls.capacity_blocks_
+                      << " blocks in " << cls.slabs_ << " slabs" << std::endl;
+        }
+    }
+}
+
+//a job of the batch mode: the path of a script, and the arguments of its entry point
+struct batch_script_job {
+    string script_;
+    vector<batch_argument> args_;
+};
+
+//an argument is written as a literal of the language: "a string", true or false, a float with a point, or an int
+static bool parse_batch_argument(const string &token, batch_argument &arg) {
+    try {
+        if (token.size() >= 2 and token[0] == '"' and token[token.size() - 1] == '"') {
+            arg = batch_argument(token.substr(1, token.size() - 2));
+        } else if (token == "true" or token == "false") {
+            arg = batch_argument(token == "true");
+        } else if (token.find('.') != string::npos) {
+            arg = batch_argument(boost::lexical_cast<float>(token));
+        } else {
+            arg = batch_argument(boost::lexical_cast<int>(token));
+        }
+        return true;
+    } catch (const boost::bad_lexical_cast &) {
+        return false;
+    }
+}
+
+//a line per job: the script, relative to the job file, and the arguments, separated by spaces; a string argument
+//may have spaces in it. Empty lines and the lines starting with # are skipped
+static bool load_job_file(const string &path, vector<batch_script_job> &jobs) {
+    std::ifstream file(path.c_str());
+    if (!file) {
+        std::cout << "can't open " << path << std::endl;
+        return false;
+    }
+    const string::size_type slash = path.rfind('/');
+    const string dir = slash == string::npos ? string() : path.substr(0, slash + 1);
+
+    string line;
+    for (std::size_t line_number = 1; getline(file, line); ++line_number) {
+        vector<string> tokens;
+        for (string::size_type pos = line.find_first_not_of(" \t\r"); pos != string::npos; pos = line.find_first_not_of(" \t\r", pos)) {
+            const string::size_type end = line[pos] == '"' ? line.find('"', pos + 1) + 1 : line.find_first_of(" \t\r", pos);
+            if (end == 0) {
+                std::cout << path << ":" << line_number << ": the string is not closed" << std::endl;
+                return false;
+            }
+            tokens.push_back(line.substr(pos, end == string::npos ? string::npos : end - pos));
+            pos = end;
+        }
+        if (tokens.empty() or tokens[0][0] == '#') {
+            continue;
+        }
 
-    bool optimize, save_2_file, show, execute;
+        batch_script_job job;
+        job.script_ = tokens[0][0] == '/' ? tokens[0] : dir + tokens[0];
+        for (std::size_t i = 1; i < tokens.size(); ++i) {
+            batch_argument arg(0);
+            if (!parse_batch_argument(tokens[i], arg)) {
+                std::cout << path << ":" << line_number << ": bad argument " << tokens[i] << std::endl;
+                return false;
+            }
+            job.args_.push_back(arg);
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+//a job with no arguments per file of the directory, in the order of their names
+static bool list_scripts(const string &path, vector<batch_script_job> &jobs) {
+#if defined(__unix__)
+    DIR * const dir = opendir(path.c_str());
+    if (dir == NULL) {
+        std::cout << "can't open " << path << std::endl;
+        return false;
+    }
+    vector<string> scripts;
+    while (const dirent * const entry = readdir(dir)) {
+        const string script = path + "/" + entry->d_name;
+        struct stat script_stat;
+        if (entry->d_name[0] != '.' and stat(script.c_str(), &script_stat) == 0 and S_ISREG(script_stat.st_mode)) {
+            scripts.push_back(script);
+        }
+    }
+    closedir(dir);
+    std::sort(scripts.begin(), scripts.end());
+    for (vector<string>::const_iterator iter = scripts.begin(); iter != scripts.end(); ++iter) {
+        batch_script_job job;
+        job.script_ = *iter;
+        jobs.push_back(job);
+    }
+    return true;
+#else
+    std::cout << "can't list " << path << std::endl;
+    return false;
+#endif
+}
+
+static bool is_directory(const string &path) {
+#if defined(__unix__)
+    struct stat path_stat;
+    return stat(path.c_str(), &path_stat) == 0 and S_ISDIR(path_stat.st_mode);
+#else
+    (void) path;
+    return false;
+#endif
+}
+
+//compiles every script of the batch once, runs the jobs on the pool and reports them; fails if any job does
+static int run_batch(const string &path, const std::size_t workers_count) {
+    vector<batch_script_job> jobs;
+    if (!(is_directory(path) ? list_scripts(path, jobs) : load_job_file(path, jobs))) {
+        return EXIT_FAILURE;
+    }
+
+    Freefoil::compiler c;
+    std::map<string, Freefoil::Runtime::program_entry_shared_ptr> programs;
+    Freefoil::Runtime::batch_pool pool(workers_count);
+    vector<std::size_t> job_indices; //of the jobs in the pool, by the jobs of the batch
+    bool succeeded = true;
+    for (vector<batch_script_job>::const_iterator job = jobs.begin(); job != jobs.end(); ++job) {
+        if (programs.find(job->script_) == programs.end()) {
+            std::ifstream script(job->script_.c_str());
+            std::ostringstream source;
+            source << script.rdbuf();
+            programs[job->script_] = script ? c.exec(source.str(), true, false) : Freefoil::Runtime::program_entry_shared_ptr();
+        }
+        const Freefoil::Runtime::program_entry_shared_ptr &program = programs[job->script_];
+        if (program) {
+            job_indices.push_back(pool.add_job(*program.get(), job->args_));
+        } else {
+            std::cout << job->script_ << ": can't compile" << std::endl;
+            job_indices.push_back(jobs.size());
+            succeeded = false;
+        }
+    }
+
+    Freefoil::Runtime::batch_report report;
+    pool.run(report);
+    std::cout << std::endl;
+
+    vector<std::size_t> latencies;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        if (job_indices[i] == jobs.size()) {
+            continue;
+        }
+        const Freefoil::Runtime::batch_job_result &result = report.results_[job_indices[i]];
+        std::cout << "job " << i << " " << jobs[i].script_ << ": " << result.latency_us_ << "us on worker " << result.worker_;
+        if (!result.succeeded_) {
+            std::cout << ", failed: " << result.error_;
+            succeeded = false;
+        }
+        std::cout << std::endl;
+        latencies.push_back(result.latency_us_);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "batch: " << latencies.size() << " jobs in " << report.total_us_ << "us on " << pool.get_workers_count() << " workers, "
+              << static_cast<std::size_t>(report.get_throughput()) << " jobs/s, " << report.jobs_stolen_ << " stolen";
+    if (!latencies.empty()) {
+        std::cout << "; latency " << latencies[latencies.size() / 2] << "us median, "
+                  << latencies[(latencies.size() - 1) * 99 / 100] << "us 99th percentile, " << latencies.back() << "us at most";
+    }
+    std::cout << std::endl;
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//runs the entry point of the script with the arguments, which are written as in a job file, on the stack VM,
+//or on the register VM, which runs entry points with no params only; fails if the script does. With --aot the
+//script is translated into freefoil_aot.cpp instead, which "make aot" builds into a native executable. With
+//--perf-map the jitted functions are listed in /tmp/perf-<pid>.map, so that perf names their samples
+static int run_script(const int argc, char **argv) {
+    bool register_machine = false, threaded = true, tos_caching = true, jit = true, perf_map = false, aot = false;
+    int arg_index = 1;
+    for (; arg_index < argc and string(argv[arg_index]).compare(0, 2, "--") == 0; ++arg_index) {
+        const string option = argv[arg_index];
+        if (option == "--register") {
+            register_machine = true;
+        } else if (option == "--switch") {
+            threaded = false;
+        } else if (option == "--no-tos") {
+            tos_caching = false;
+        } else if (option == "--no-jit") {
+            jit = false;
+        } else if (option == "--perf-map") {
+            perf_map = true;
+        } else if (option == "--aot") {
+            aot = true;
+        } else {
+            std::cout << "unknown option " << option << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (arg_index == argc) {
+        std::cout << "no script to run" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const string path = argv[arg_index++];
+    vector<batch_argument> args;
+    for (; arg_index < argc; ++arg_index) {
+        batch_argument arg(0);
+        if (!parse_batch_argument(argv[arg_index], arg)) {
+            std::cout << "bad argument " << argv[arg_index] << std::endl;
+            return EXIT_FAILURE;
+        }
+        args.push_back(arg);
+    }
+
+    std::ifstream script(path.c_str());
+    if (!script) {
+        std::cout << "can't open " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ostringstream source;
+    source << script.rdbuf();
+
+    Freefoil::compiler c;
+    //the stack VM starts from the unoptimized code and optimizes the hot functions on its own
+    const Freefoil::Runtime::program_entry_shared_ptr program = c.exec(source.str(), register_machine or aot, false);
+    if (!program) {
+        return EXIT_FAILURE;
+    }
+    if (aot) {
+        if (!args.empty()) {
+            std::cout << "the translated script takes no arguments" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::ofstream unit("freefoil_aot.cpp");
+        Freefoil::Runtime::aot_translator translator(*program.get());
+        if (!translator.translate(unit, "freefoil_main")) {
+            std::cout << "aot: " << translator.get_error() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    const Freefoil::Runtime::dispatch_mode mode = threaded ? Freefoil::Runtime::threaded_dispatch : Freefoil::Runtime::switch_dispatch;
+    if (register_machine) {
+        if (!args.empty()) {
+            std::cout << "the register machine takes no arguments" << std::endl;
+            return EXIT_FAILURE;
+        }
+        Freefoil::Runtime::freefoil_register_vm vm(*program.get(), mode);
+        try {
+            vm.run();
+        } catch (const std::exception &e) {
+            std::cout << std::endl << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    const std::size_t jit_threshold = jit ? Freefoil::Runtime::freefoil_vm::DEFAULT_JIT_THRESHOLD : 0;
+    Freefoil::Runtime::freefoil_vm vm(*program.get(), mode, tos_caching, jit_threshold, perf_map, Freefoil::Runtime::freefoil_vm::DEFAULT_TIER_THRESHOLD);
+    try {
+        vector<Freefoil::Runtime::freefoil_vm::value> values;
+        for (vector<batch_argument>::const_iterator arg = args.begin(); arg != args.end(); ++arg) {
+            values.push_back(arg->make_value(vm));
+        }
+        vm.run(values);
+    } catch (const std::exception &e) {
+        std::cout << std::endl << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << std::endl;
+    return EXIT_SUCCESS;
+}
+
+//freefoil --batch <directory or job file> [workers] runs the scripts in parallel;
+//freefoil [--register] [--switch] [--no-tos] [--no-jit] [--perf-map] [--aot] <script> [arguments] runs the script;
+//otherwise the programs are read from the standard input one per line
+int main(int argc, char **argv) {
+
+    if (argc >= 3 and string(argv[1]) == "--batch") {
+        const std::size_t workers_count = argc >= 4 ? std::strtoul(argv[3], NULL, 10) : 0;
+        return run_batch(argv[2], workers_count);
+    }
+    if (argc >= 2) {
+        return run_script(argc, argv);
+    }
+
+    bool optimize, save_2_file, show, execute, threaded, tos_caching, register_machine, jit, perf_map, aot, tiered;
     optimize = true;
     save_2_file = false;
     show = true;
     execute = true;
+    threaded = true;
+    tos_caching = true;
+    register_machine = false;
+    jit = true;
+    perf_map = false;
+    aot = false;
+    tiered = true;
 
     Freefoil::compiler c;
 
@@ -24,17 +344,40 @@ int main() {
 		std::cout << "please enter the program or press q to exit" << std::endl;
 		getline(std::cin, str);
 		
-		Freefoil::Runtime::program_entry_shared_ptr the_program = c.exec(str, optimize, show);
+		//the stack VM starts from the unoptimized code and optimizes the hot functions on its own
+		const bool tier_up = optimize and tiered and execute and !register_machine and !aot;
+		Freefoil::Runtime::program_entry_shared_ptr the_program = c.exec(str, optimize and !tier_up, show);
         if (the_program){
 
             if (save_2_file) {
                 //TODO:
             }
 
+            if (aot) {
+                //build it with "make aot" into a native executable
+                std::ofstream unit("freefoil_aot.cpp");
+                Freefoil::Runtime::aot_translator translator(*the_program.get());
+                if (!translator.translate(unit, "freefoil_main")) {
+                    std::cout << "aot: " << translator.get_error() << std::endl;
+                }
+            }
+
             if (execute) {
-                Freefoil::Runtime::freefoil_vm vm(*the_program.get());
-                vm.exec(); //TODO: add sending params
-                std::cout << std::endl;
+                const Freefoil::Runtime::dispatch_mode mode = threaded ? Freefoil::Runtime::threaded_dispatch : Freefoil::Runtime::switch_dispatch;
+                if (register_machine) {
+                    Freefoil::Runtime::freefoil_register_vm vm(*the_program.get(), mode);
+                    vm.exec();
+                    std::cout << std::endl;
+                } else {
+                    const std::size_t jit_threshold = jit ? Freefoil::Runtime::freefoil_vm::DEFAULT_JIT_THRESHOLD : 0;
+                    const std::size_t tier_threshold = tier_up ? Freefoil::Runtime::freefoil_vm::DEFAULT_TIER_THRESHOLD : 0;
+                    Freefoil::Runtime::freefoil_vm vm(*the_program.get(), mode, tos_caching, jit_threshold, perf_map, tier_threshold);
+                    vm.exec();
+                    std::cout << std::endl;
+                    if (show) {
+                        print_heap_stats(vm.get_heap());
+                    }
+                }
             }
         }
 	} while (str != "q");
@@ -1,21 +1,258 @@
 #include "memory_manager.h"
 
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
 namespace Freefoil{
         namespace Runtime{
-            memory_manager g_mm;    //global instance
+            gcstring *gcstring::create(memory_manager &mm, const char *chars, const std::size_t length, const bool in_old_space){
+                const std::size_t size = get_allocation_size(length);
+                return new (in_old_space ? mm.alloc_old(size) : mm.alloc(size)) gcstring(chars, length, 0);
+            }
+
+            gcobject *gcstring::promote(memory_manager &mm) const{
+                return new (mm.alloc_old(get_allocation_size(length_))) gcstring(chars_, length_, hash_);
+            }
+
+            gcrope *gcrope::create(memory_manager &mm, gcobject *left, gcobject *right, const std::size_t length){
+                return new (mm.alloc(sizeof(gcrope))) gcrope(left, right, NULL, length);
+            }
+
+            //the parts are traced and moved along after the copy
+            gcobject *gcrope::promote(memory_manager &mm) const{
+                return new (mm.alloc_old(sizeof(gcrope))) gcrope(left_, right_, flat_, length_);
+            }
+
+            void gcrope::trace(memory_manager &mm){
+                if (flat_ != NULL){
+                    mm.mark(flat_);
+                } else {
+                    mm.mark(left_);
+                    mm.mark(right_);
+                }
+            }
 
-            void *gcobject::operator new(std::size_t sz){
-                return g_mm.alloc(sz);
+            //the characters are copied for the write only, as the rope has no memory manager to flatten it with
+            std::ostream &gcrope::put(std::ostream &os) const{
+                string chars;
+                chars.reserve(length_);
+                memory_manager::write_chars(*this, chars);
+                return os.write(chars.data(), chars.size());
             }
-            void gcobject::operator delete(void *address){
-                g_mm.dealloc(address);
+
+            namespace {
+                using boost::posix_time::ptime;
+                using boost::posix_time::microsec_clock;
+
+                std::size_t elapsed_us(const ptime &start){
+                    return static_cast<std::size_t>((microsec_clock::universal_time() - start).total_microseconds());
+                }
+            }
+
+            void memory_manager::mark(gcobject_instance_t &slot){
+                assert(collecting_nursery_ or collecting_);
+                if (collecting_nursery_) {
+                    if (!in_nursery(slot)) {
+                        return;
+                    }
+                    const vector<gcobject_instance_t>::const_iterator iter = std::lower_bound(nursery_objects_.begin(), nursery_objects_.end(), slot);
+                    if (iter == nursery_objects_.end() or *iter != slot) {
+                        return;
+                    }
+                    gcobject_instance_t &forward = forwards_[iter - nursery_objects_.begin()];
+                    if (forward == NULL) {
+                        forward = slot->promote(*this);
+                        track(forward);
+                        gray_.push_back(forward);
+                        ++stats_.objects_promoted_;
+                    }
+                    slot = forward;
+                    return;
+                }
+                const vector<gcobject_instance_t>::const_iterator iter = std::lower_bound(objects_.begin(), objects_.end(), slot);
+                if (iter != objects_.end() and *iter == slot and !marks_[iter - objects_.begin()]){
+                    marks_[iter - objects_.begin()] = true;
+                    gray_.push_back(slot);
+                }
+            }
+
+            //marks the roots and everything reachable from them;
+            //the ropes may be long chains, so the marked objects are traced without recursion.
+            //If the roots can't be marked, the collection is given up before anything is freed or dropped: the slots
+            //marked already point to the promoted copies, the others still to the nursery objects
+            void memory_manager::mark_all(){
+                if (roots_ != NULL){
+                    try {
+                        roots_->mark_roots(*this);
+                    } catch (...) {
+                        gray_.clear();
+                        collecting_nursery_ = collecting_ = false;
+                        throw;
+                    }
+                }
+                while (!gray_.empty()){
+                    const gcobject_instance_t instance = gray_.back();
+                    gray_.pop_back();
+                    instance->trace(*this);
+                }
+            }
+
+            void memory_manager::write_chars(const gcobject &str, string &chars){
+                vector<const gcobject *> pending(1, &str);
+                while (!pending.empty()){
+                    const gcobject * const cur = pending.back();
+                    pending.pop_back();
+                    if (cur->get_rtt() == rope_type){
+                        const gcrope &rope = static_cast<const gcrope &>(*cur);
+                        if (rope.flat_ != NULL){
+                            pending.push_back(rope.flat_);
+                        } else {
+                            pending.push_back(rope.right_);
+                            pending.push_back(rope.left_);
+                        }
+                    } else {
+                        const gcstring &flat = static_cast<const gcstring &>(*cur);
+                        chars.append(flat.get_chars(), flat.get_length());
+                    }
+                }
+            }
+
+            memory_manager::gcobject_instance_t memory_manager::concat(gcobject_instance_t &left, gcobject_instance_t &right){
+                const std::size_t left_length = get_string_length(*left);
+                const std::size_t right_length = get_string_length(*right);
+                if (right_length == 0){
+                    return left;
+                }
+                if (left_length == 0){
+                    return right;
+                }
+
+                const std::size_t length = left_length + right_length;
+                gcobject_instance_t result;
+                if (length <= SHORT_CONCAT_LENGTH){
+                    make_room(gcstring::get_allocation_size(length));
+                    string chars;
+                    chars.reserve(length);
+                    write_chars(*left, chars);
+                    write_chars(*right, chars);
+                    result = gcstring::create(*this, chars.data(), length);
+                } else {
+                    make_room(sizeof(gcrope));
+                    result = gcrope::create(*this, left, right, length);
+                }
+                track(result);
+                return result;
             }
 
-            void *gcstring::operator new(std::size_t sz){
-                return g_mm.alloc(sz);
+            memory_manager::gcobject_instance_t memory_manager::make_string(const string &str){
+                make_room(gcstring::get_allocation_size(str.size()));
+                const gcobject_instance_t instance = gcstring::create(*this, str.data(), str.size());
+                track(instance);
+                return instance;
             }
-            void gcstring::operator delete(void *address){
-                g_mm.dealloc(address);
+
+            //the flat string goes into the old space, so that printing never collects garbage
+            //and the old ropes keep pointing to the old space only
+            const gcstring &memory_manager::flatten(const gcrope &rope){
+                if (rope.flat_ == NULL){
+                    string chars;
+                    chars.reserve(rope.length_);
+                    write_chars(rope, chars);
+                    gcstring * const flat = gcstring::create(*this, chars.data(), chars.size(), true);
+                    track(flat);
+                    rope.flat_ = flat;
+                    rope.left_ = rope.right_ = NULL;
+                }
+                return static_cast<const gcstring &>(*rope.flat_);
+            }
+
+            bool memory_manager::equal_strings(const gcobject &left, const gcobject &right){
+                if (&left == &right){
+                    return true;
+                }
+                if (get_string_length(left) != get_string_length(right)){
+                    return false;
+                }
+                return get_flat(left).equals(get_flat(right));
+            }
+
+            int memory_manager::compare_strings(const gcobject &left, const gcobject &right){
+                if (&left == &right){
+                    return 0;
+                }
+                const gcstring &left_flat = get_flat(left);
+                const gcstring &right_flat = get_flat(right);
+                const std::size_t length = std::min(left_flat.get_length(), right_flat.get_length());
+                const int result = std::memcmp(left_flat.get_chars(), right_flat.get_chars(), length);
+                if (result != 0){
+                    return result < 0 ? -1 : 1;
+                }
+                return left_flat.get_length() < right_flat.get_length() ? -1 : (left_flat.get_length() > right_flat.get_length() ? 1 : 0);
+            }
+
+            void memory_manager::collect_nursery(){
+                collecting_nursery_ = true;
+                forwards_.assign(nursery_objects_.size(), NULL);
+                const std::size_t promoted_before = stats_.objects_promoted_;
+                const std::size_t heap_bytes_before = heap_bytes_;
+
+                mark_all();
+
+                //the dead objects are dropped all at once
+                stats_.bytes_reclaimed_ += (nursery_top_ - nursery_.get()) - (heap_bytes_ - heap_bytes_before);
+                stats_.objects_reclaimed_ += nursery_objects_.size() - (stats_.objects_promoted_ - promoted_before);
+                nursery_objects_.clear();
+                nursery_top_ = nursery_.get();
+                collecting_nursery_ = false;
+                ++stats_.minor_collections_;
+            }
+
+            void memory_manager::minor_collect(){
+                const ptime start = microsec_clock::universal_time();
+                collect_nursery();
+                record_pause(elapsed_us(start));
+            }
+
+            void memory_manager::record_pause(const std::size_t pause_us){
+                stats_.total_pause_us_ += pause_us;
+                stats_.max_pause_us_ = std::max(stats_.max_pause_us_, pause_us);
+            }
+
+            void memory_manager::collect(){
+                const ptime start = microsec_clock::universal_time();
+
+                if (!nursery_objects_.empty()){
+                    collect_nursery();
+                }
+
+                collecting_ = true;
+                std::sort(objects_.begin(), objects_.end());
+                marks_.assign(objects_.size(), false);
+
+                mark_all();
+
+                std::size_t live_count = 0;
+                for (std::size_t i = 0; i < objects_.size(); ++i){
+                    if (marks_[i]){
+                        objects_[live_count++] = objects_[i];
+                    } else {
+                        const std::size_t size = objects_[i]->get_size();
+                        heap_bytes_ -= size;
+                        stats_.bytes_reclaimed_ += size;
+                        ++stats_.objects_reclaimed_;
+                        dealloc(objects_[i]);
+                    }
+                }
+                objects_.resize(live_count);
+                collecting_ = false;
+                //the slabs the sweep emptied go back at once
+                allocator_.release_free_memory();
+
+                next_collection_bytes_ = std::max(min_heap_bytes_, heap_bytes_ * HEAP_GROWTH_FACTOR);
+
+                ++stats_.collections_;
+                record_pause(elapsed_us(start));
             }
 
         }
@@ -2,65 +2,205 @@
 #define MEMORY_MANAGER_H_INCLUDED
 
 #include "runtime.h"
-#include "symbols_handler.h"
+#include "pool_allocator.h"
 #include <string>
+#include <vector>
+#include <cstring>
+#include <new>
+#include <ostream>
 
-#include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
 
 namespace Freefoil {
 
     namespace Runtime {
 
-        using Private::symbols_handler;
-        using boost::scoped_ptr;
+        using boost::scoped_array;
         using std::string;
+        using std::vector;
 
         enum runtime_type {
             int_type,
             float_type,
             string_type,
+            rope_type, //a string which is a concatenation of strings
             pointer,
         };
 
+        class memory_manager;
+
         class gcobject {
             gcobject(const gcobject &);
             gcobject &operator = (const gcobject &);
         protected:
             runtime_type rtt_;
             gcobject(runtime_type rtt):rtt_(rtt) {}
+            //the objects are made in the memory of a memory manager only, and they own no memory but their own
+            //allocation, so the memory manager frees them without destroying them
+            ~gcobject() {}
         public:
-            virtual ~gcobject() {}
             runtime_type get_rtt() const {
                 return rtt_;
             }
-            void *operator new(std::size_t sz);
-            void operator delete(void *address);
+
+            //copies the object out of the nursery into the old space; the nursery drops the ones left behind
+            virtual gcobject *promote(memory_manager &mm) const = 0;
+
+            //calls memory_manager::mark() for every object the object points to
+            virtual void trace(memory_manager &) {}
 
             virtual std::ostream &put(std::ostream &os) const{
                 return os;
             }
+
+            //the memory the object holds, for the heap size triggers of the collector
+            virtual std::size_t get_size() const {
+                return sizeof(*this);
+            }
         };
 
+        //immutable string, allocated along with its characters as one block of memory: the object is followed
+        //by the rest of the characters and the terminating zero. The hash is computed on the first get_hash(), as most
+        //strings, e.g. the results of concatenations which are only printed, are never hashed
         class gcstring : public gcobject {
-            scoped_ptr<string> body_scoped_ptr_;
+            const std::size_t length_;
+            mutable std::size_t hash_; //0 until computed; a string which hashes to 0 computes it on every call
+            char chars_[1];
+
+            gcstring(const char *chars, const std::size_t length, const std::size_t hash)
+                :gcobject(string_type), length_(length), hash_(hash) {
+                std::memcpy(chars_, chars, length);
+                chars_[length] = '\0';
+            }
         public:
-            gcstring(const string &str)
-                :gcobject(string_type), body_scoped_ptr_(new string(str)) {
+            static std::size_t get_allocation_size(const std::size_t length) {
+                return sizeof(gcstring) + length;
             }
 
-            void *operator new(std::size_t sz);
-            void operator delete(void *address);
+            //the string in the memory the memory manager allocates; there is no other way to make one
+            static gcstring *create(memory_manager &mm, const char *chars, const std::size_t length, const bool in_old_space = false);
+
             //TODO: other operators
 
+            static std::size_t hash(const char *chars, const std::size_t length) {
+                std::size_t result = 0;
+                for (std::size_t i = 0; i < length; ++i) {
+                    result *= 65599;
+                    result += chars[i];
+                }
+                return result;
+            }
+
+            std::size_t get_length() const {
+                return length_;
+            }
+
+            std::size_t get_hash() const {
+                if (hash_ == 0) {
+                    hash_ = hash(chars_, length_);
+                }
+                return hash_;
+            }
+
+            //zero terminated
+            const char *get_chars() const {
+                return chars_;
+            }
+
+            //the hashes tell the strings apart without reading their characters, but only if both are computed already
+            bool equals(const gcstring &other) const {
+                if (length_ != other.length_ or (hash_ != 0 and other.hash_ != 0 and hash_ != other.hash_)) {
+                    return false;
+                }
+                return std::memcmp(chars_, other.chars_, length_) == 0;
+            }
+
+            virtual gcobject *promote(memory_manager &mm) const;
+
             virtual std::ostream &put(std::ostream &os) const{
-                return os << *body_scoped_ptr_;
+                return os.write(chars_, length_);
+            }
+
+            virtual std::size_t get_size() const {
+                return get_allocation_size(length_);
+            }
+        };
+
+        //the concatenation of two strings, either of which may be a rope in turn, so that repeated concatenation doesn't copy
+        //the characters over and over. The characters are copied once the rope is flattened, as the builtins print it:
+        //its flat string is cached, and its parts are dropped
+        class gcrope : public gcobject {
+            friend class memory_manager;
+
+            mutable gcobject *left_;
+            mutable gcobject *right_;
+            mutable gcobject *flat_; //a gcstring in the old space, once the rope is flattened
+            const std::size_t length_;
+
+            gcrope(gcobject *left, gcobject *right, gcobject *flat, const std::size_t length)
+                :gcobject(rope_type), left_(left), right_(right), flat_(flat), length_(length) {
+            }
+        public:
+            static gcrope *create(memory_manager &mm, gcobject *left, gcobject *right, const std::size_t length);
+
+            std::size_t get_length() const {
+                return length_;
+            }
+
+            virtual gcobject *promote(memory_manager &mm) const;
+            virtual void trace(memory_manager &mm);
+            virtual std::ostream &put(std::ostream &os) const;
+
+            virtual std::size_t get_size() const {
+                return sizeof(*this);
             }
         };
 
+        inline std::size_t get_string_length(const gcobject &str) {
+            return str.get_rtt() == rope_type ? static_cast<const gcrope &>(str).get_length() : static_cast<const gcstring &>(str).get_length();
+        }
+
         inline std::ostream &operator <<(std::ostream &os, const gcobject &gcobj){
             return gcobj.put(os);
         }
 
+        //the roots of the heap the memory manager doesn't know of: a VM lends the stack of the program it runs
+        class gc_roots {
+        public:
+            //calls memory_manager::mark() for every slot which may hold a gcobject pointer; the collector may update the slots
+            virtual void mark_roots(memory_manager &mm) = 0;
+        protected:
+            ~gc_roots() {}
+        };
+
+        //the counters of the collector since the start
+        struct gc_stats {
+            std::size_t minor_collections_;
+            std::size_t objects_promoted_;
+            std::size_t collections_;
+            std::size_t objects_reclaimed_;
+            std::size_t bytes_reclaimed_;
+            std::size_t total_pause_us_;
+            std::size_t max_pause_us_;
+
+            gc_stats()
+                :minor_collections_(0), objects_promoted_(0),
+                 collections_(0), objects_reclaimed_(0), bytes_reclaimed_(0), total_pause_us_(0), max_pause_us_(0)
+                {}
+        };
+
+        //generational collector. While a VM lending its roots runs, objects are bump-allocated in the nursery; once it
+        //is full, the objects reachable from the roots are promoted into the old space, the slots pointing to them
+        //are updated, and the nursery is reset at once.
+        //The old space is a precise mark-sweep heap: every object is registered when it is allocated or promoted,
+        //and once the old space outgrows its threshold, its unreachable objects are freed. The old space is carved
+        //out of the slabs of the heap allocator, which get back to the OS once a collection empties them.
+        //Ropes point to the strings they are made of, so the marked objects are traced. Ropes are made in the nursery
+        //while it is in use, and the flat strings point nowhere, so old objects never point into the nursery,
+        //and the old space needs no write barrier.
+        //Without roots objects go straight into the old space, which only grows: the VMs which don't know the layout
+        //of their stacks never collect, as the objects can be neither moved nor freed under them.
+        //There is no global heap: each VM owns one, so that VMs run on different threads share nothing mutable.
         class memory_manager {
 
             memory_manager(const memory_manager&);
@@ -68,44 +208,204 @@ namespace Freefoil {
 
         public:
             typedef gcobject *gcobject_instance_t;
+
+            static const std::size_t DEFAULT_MIN_HEAP_BYTES = 256 * 1024; //the heap never collected below
+            static const std::size_t HEAP_GROWTH_FACTOR = 2; //the next collection is when the heap is that many times the live data
+            static const std::size_t NURSERY_BYTES = 64 * 1024;
+            static const std::size_t LARGE_OBJECT_BYTES = NURSERY_BYTES / 16; //allocated in the old space at once, rather than copied when promoted
+            static const std::size_t ALIGNMENT = 2 * sizeof(void *); //of the nursery allocations
+            static const std::size_t SHORT_CONCAT_LENGTH = 64; //concatenations up to that long are copied into flat strings at once
+
+            //makes the roots the ones of the heap until the end of the scope
+            class roots_activation {
+                roots_activation(const roots_activation &);
+                roots_activation &operator =(const roots_activation &);
+
+                memory_manager &mm_;
+                gc_roots *const previous_roots_;
+            public:
+                roots_activation(memory_manager &mm, gc_roots &roots)
+                    :mm_(mm), previous_roots_(mm.roots_) {
+                    mm_.roots_ = &roots;
+                }
+                ~roots_activation() {
+                    mm_.roots_ = previous_roots_;
+                }
+            };
         private:
-            typedef symbols_handler<gcobject_instance_t> instances_handler_t;
-            instances_handler_t instances_handler_;
+            scoped_array<char> nursery_;
+            char *nursery_top_; //the next allocation
+            char *nursery_end_;
+            vector<gcobject_instance_t> nursery_objects_; //in the order of allocation, so sorted by address
+            vector<gcobject_instance_t> forwards_; //the promoted copies, by the index in nursery_objects_
+            bool collecting_nursery_;
+
+            vector<gcobject_instance_t> gray_; //the objects marked or promoted, which are yet to be traced
+
+            vector<gcobject_instance_t> objects_; //every object of the old space, sorted by address while collecting
+            vector<bool> marks_; //by the index in objects_
+            bool collecting_;
+            std::size_t heap_bytes_; //of the old space
+            std::size_t min_heap_bytes_;
+            std::size_t next_collection_bytes_;
+            gc_roots *roots_;
+            gc_stats stats_;
+            heap_allocator allocator_; //of the old space
+
+            void track(const gcobject_instance_t instance) {
+                if (in_nursery(instance)) {
+                    nursery_objects_.push_back(instance);
+                } else {
+                    objects_.push_back(instance);
+                    heap_bytes_ += instance->get_size();
+                }
+            }
+
+            bool in_nursery(const void *address) const {
+                const std::size_t position = reinterpret_cast<std::size_t>(address);
+                return position >= reinterpret_cast<std::size_t>(nursery_.get()) and position < reinterpret_cast<std::size_t>(nursery_end_);
+            }
+
+            static std::size_t align(const std::size_t sz) {
+                return (sz + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+            }
+
+            bool nursery_has_room(const std::size_t sz) const {
+                return static_cast<std::size_t>(nursery_end_ - nursery_top_) >= align(sz);
+            }
+
+            //whether the allocation is going into the nursery, which is full
+            bool nursery_needs_collection(const std::size_t sz) const {
+                return roots_ != NULL and nursery_ and sz <= LARGE_OBJECT_BYTES and !nursery_has_room(sz);
+            }
+
+            //collects garbage first if the allocation would outgrow the nursery or the old space
+            void make_room(const std::size_t sz) {
+                if (nursery_needs_collection(sz)) {
+                    minor_collect();
+                }
+                if (roots_ != NULL and heap_bytes_ >= next_collection_bytes_) {
+                    collect();
+                }
+            }
+
+            void mark_all();
+
+            //promotes the reachable objects of the nursery and empties it
+            void collect_nursery();
+            void minor_collect();
+            void record_pause(const std::size_t pause_us);
         public:
 
+            //small objects go into the nursery while there are roots which can be updated when they move
             void *alloc(std::size_t sz){
-                return malloc(sz);
+                if (roots_ != NULL and sz <= LARGE_OBJECT_BYTES) {
+                    if (!nursery_) {
+                        nursery_.reset(new char[NURSERY_BYTES]);
+                        nursery_top_ = nursery_.get();
+                        nursery_end_ = nursery_top_ + NURSERY_BYTES;
+                    }
+                    if (nursery_has_room(sz)) {
+                        void * const address = nursery_top_;
+                        nursery_top_ += align(sz);
+                        return address;
+                    }
+                }
+                return alloc_old(sz);
+            }
+            void *alloc_old(std::size_t sz){
+                return allocator_.allocate(sz);
             }
             void dealloc(void *address){
-                return free(address);
+                if (!in_nursery(address)) {
+                    allocator_.deallocate(address);
+                }
             }
 
-            memory_manager() {}
+            memory_manager()
+                :nursery_top_(NULL), nursery_end_(NULL), collecting_nursery_(false),
+                 collecting_(false), heap_bytes_(0), min_heap_bytes_(DEFAULT_MIN_HEAP_BYTES),
+                 next_collection_bytes_(DEFAULT_MIN_HEAP_BYTES), roots_(NULL) {
+            }
 
-            gcobject_instance_t sload(const std::string &str){
-                //tries to estimate whether we have that string in data table or not
-                //and allocate new string only if the presented string is a new one
+            //the objects go along with the heap
+            ~memory_manager() {
+                for (vector<gcobject_instance_t>::const_iterator iter = objects_.begin(); iter != objects_.end(); ++iter) {
+                    allocator_.deallocate(*iter);
+                }
+            }
 
-                gcobject_instance_t *instance = instances_handler_.lookup(str);
+            //a string which is made in the old space, so it never moves, e.g. a constant of a program or an argument
+            //a host passes to it; it lives as long as the VM marks it. The call never collects, so the strings made
+            //before it need not be marked yet
+            gcobject_instance_t make_old_string(const std::string &str){
+                const gcobject_instance_t instance = gcstring::create(*this, str.data(), str.size(), true);
+                track(instance);
+                return instance;
+            }
 
-                if (instance == NULL){
-                    gcobject_instance_t instance = new gcstring(str);
-                    instances_handler_.insert(str, instance);
-                    return instance;
-                }else{
-                    return *instance;
-                }
+            //drops every object of the nursery at once; only valid while nothing but the nursery objects themselves
+            //points into it, e.g. between the runs of a VM, as old objects never do
+            void reset_nursery(){
+                assert(roots_ == NULL and !collecting_nursery_ and !collecting_);
+                nursery_top_ = nursery_.get();
+                nursery_objects_.clear();
+            }
+
+            //a string made in the nursery, if there are roots. The allocation may collect garbage, so the strings
+            //made before it are to be in the slots the roots mark
+            gcobject_instance_t make_string(const std::string &str);
+
+            //the string itself, or the flat version of the rope
+            const gcstring &get_flat(const gcobject &str) {
+                return str.get_rtt() == rope_type ? flatten(static_cast<const gcrope &>(str)) : static_cast<const gcstring &>(str);
+            }
+
+            //appends the characters of the string, which may be a rope
+            static void write_chars(const gcobject &str, string &chars);
+
+            //the string which is the left one followed by the right one. Both are read after the garbage the allocation
+            //may collect, so they are to be passed in the slots the roots mark
+            gcobject_instance_t concat(gcobject_instance_t &left, gcobject_instance_t &right);
+
+            //the flat version of the rope, which is made on the first call
+            const gcstring &flatten(const gcrope &rope);
+
+            //whether the strings, either of which may be a rope, have the same characters; the ropes of the same
+            //length are flattened, which never collects garbage
+            bool equal_strings(const gcobject &left, const gcobject &right);
+
+            //-1, 0 or 1 as the left string goes before, along with or after the right one in the order of their
+            //characters, as memcmp() compares them
+            int compare_strings(const gcobject &left, const gcobject &right);
+
+            //frees the objects unreachable from the roots of the heap, if there are any, the nursery and the old space alike
+            void collect();
+
+            //marks the object the slot points to as reachable, and points the slot to its new place if it is moved;
+            //the slot may hold anything else, e.g. a string local which is not assigned yet, so only the addresses
+            //of the objects alive are taken
+            void mark(gcobject_instance_t &slot);
+
+            //the least heap size a collection is triggered at
+            void set_min_heap_bytes(const std::size_t min_heap_bytes) {
+                min_heap_bytes_ = min_heap_bytes;
+                next_collection_bytes_ = std::max(next_collection_bytes_, min_heap_bytes_);
+            }
+
+            std::size_t get_heap_bytes() const {
+                return heap_bytes_ + (nursery_top_ - nursery_.get());
             }
 
-            void function_begin(){
-                instances_handler_.scope_begin();
+            const gc_stats &get_stats() const {
+                return stats_;
             }
 
-            void function_end(){
-                instances_handler_.scope_end();
+            void get_allocator_stats(allocator_stats &stats) const {
+                allocator_.get_stats(stats);
             }
         };
     }
 }
 
-#endif // GC_H_INCLUDED
+#endif // MEMORY_MANAGER_H_INCLUDED
@@ -1,6 +1,8 @@
 #ifndef OPCODES_H_INCLUDED
 #define OPCODES_H_INCLUDED
 
+#include <cstddef>
+
 namespace Freefoil {
     namespace Private {
 
@@ -67,7 +69,209 @@ namespace Freefoil {
             OPCODE_sret = 43,  //return str
 
             OPCODE_builtin_call = 44,
+
+            //superinstructions: fused sequences of the opcodes above, emitted by the codegen peephole stage only;
+            //the operands of the fused instructions follow in their original order
+            OPCODE_iload_iload = 45, //iload a; iload b
+            OPCODE_iload_iload_const = 46, //iload a; iload_const k
+            OPCODE_iload_iload_iadd_isave = 47, //iload a; iload b; iadd; isave c
+            OPCODE_iload_iload_isub_isave = 48, //iload a; iload b; isub; isave c
+            OPCODE_iload_iload_imul_isave = 49, //iload a; iload b; imul; isave c
+            OPCODE_iload_iload_const_iadd_isave = 50, //iload a; iload_const k; iadd; isave c
+            OPCODE_iload_iload_const_isub_isave = 51, //iload a; iload_const k; isub; isave c
+            OPCODE_iload_iload_ifeq = 52, //iload a; iload b; ifeq offset
+            OPCODE_iload_iload_ifneq = 53,
+            OPCODE_iload_iload_ifleq = 54,
+            OPCODE_iload_iload_ifgeq = 55,
+            OPCODE_iload_iload_ifgreater = 56,
+            OPCODE_iload_iload_ifless = 57,
+            OPCODE_iload_iload_const_ifeq = 58, //iload a; iload_const k; ifeq offset
+            OPCODE_iload_iload_const_ifneq = 59,
+            OPCODE_iload_iload_const_ifleq = 60,
+            OPCODE_iload_iload_const_ifgeq = 61,
+            OPCODE_iload_iload_const_ifgreater = 62,
+            OPCODE_iload_iload_const_ifless = 63,
+
+            OPCODE_tailcall = 64, //call of a user function in return position: the callee takes over the caller's frame and returns to the caller's caller
+
+            OPCODE_pop = 65, //drop the value on top of stack
+
+            OPCODE_seq = 66, //pop two strings, push 1 if they have the same characters, 0 otherwise
+            OPCODE_scmp = 67, //pop two strings, push -1, 0 or 1 as the deeper one is less than, equal to or greater than the upper one
             //TODO: add other opcodes
+
+            OPCODES_COUNT //must be the last one
+        };
+
+        enum {
+            MAX_OPERANDS_COUNT = 3 //the most operand bytes any opcode may have
+        };
+
+        //returns the number of operand bytes following the opcode in the instructions stream
+        inline int get_operands_count(const int opcode) {
+            switch (opcode) {
+            case OPCODE_iload:
+            case OPCODE_fload:
+            case OPCODE_sload:
+            case OPCODE_isave:
+            case OPCODE_fsave:
+            case OPCODE_ssave:
+            case OPCODE_iload_const:
+            case OPCODE_fload_const:
+            case OPCODE_sload_const:
+            case OPCODE_call:
+            case OPCODE_tailcall:
+            case OPCODE_builtin_call:
+            case OPCODE_ifeq:
+            case OPCODE_ifneq:
+            case OPCODE_ifleq:
+            case OPCODE_ifgeq:
+            case OPCODE_ifgreater:
+            case OPCODE_ifless:
+            case OPCODE_jz:
+            case OPCODE_jnz:
+            case OPCODE_jmp:
+                return 1;
+            case OPCODE_iload_iload:
+            case OPCODE_iload_iload_const:
+                return 2;
+            case OPCODE_iload_iload_iadd_isave:
+            case OPCODE_iload_iload_isub_isave:
+            case OPCODE_iload_iload_imul_isave:
+            case OPCODE_iload_iload_const_iadd_isave:
+            case OPCODE_iload_iload_const_isub_isave:
+            case OPCODE_iload_iload_ifeq:
+            case OPCODE_iload_iload_ifneq:
+            case OPCODE_iload_iload_ifleq:
+            case OPCODE_iload_iload_ifgeq:
+            case OPCODE_iload_iload_ifgreater:
+            case OPCODE_iload_iload_ifless:
+            case OPCODE_iload_iload_const_ifeq:
+            case OPCODE_iload_iload_const_ifneq:
+            case OPCODE_iload_iload_const_ifleq:
+            case OPCODE_iload_iload_const_ifgeq:
+            case OPCODE_iload_iload_const_ifgreater:
+            case OPCODE_iload_iload_const_ifless:
+                return 3;
+            default:
+                return 0;
+            }
+        }
+
+        //returns true if the last operand of the opcode is a relative jump offset
+        inline bool is_branch(const int opcode) {
+            switch (opcode) {
+            case OPCODE_iload_iload_ifeq:
+            case OPCODE_iload_iload_ifneq:
+            case OPCODE_iload_iload_ifleq:
+            case OPCODE_iload_iload_ifgeq:
+            case OPCODE_iload_iload_ifgreater:
+            case OPCODE_iload_iload_ifless:
+            case OPCODE_iload_iload_const_ifeq:
+            case OPCODE_iload_iload_const_ifneq:
+            case OPCODE_iload_iload_const_ifleq:
+            case OPCODE_iload_iload_const_ifgeq:
+            case OPCODE_iload_iload_const_ifgreater:
+            case OPCODE_iload_iload_const_ifless:
+            case OPCODE_ifeq:
+            case OPCODE_ifneq:
+            case OPCODE_ifleq:
+            case OPCODE_ifgeq:
+            case OPCODE_ifgreater:
+            case OPCODE_ifless:
+            case OPCODE_jz:
+            case OPCODE_jnz:
+            case OPCODE_jmp:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        //the superinstructions the codegen peephole stage is allowed to emit, derived from the profiles of our workloads:
+        //entries are tried in order, so the longer sequences must precede their own prefixes
+        static const struct superinstruction {
+            int opcode_;
+            std::size_t length_;
+            int pattern_[4];
+        } superinstructions_table[] = {
+            { OPCODE_iload_iload_iadd_isave, 4, { OPCODE_iload, OPCODE_iload, OPCODE_iadd, OPCODE_isave } },
+            { OPCODE_iload_iload_isub_isave, 4, { OPCODE_iload, OPCODE_iload, OPCODE_isub, OPCODE_isave } },
+            { OPCODE_iload_iload_imul_isave, 4, { OPCODE_iload, OPCODE_iload, OPCODE_imul, OPCODE_isave } },
+            { OPCODE_iload_iload_const_iadd_isave, 4, { OPCODE_iload, OPCODE_iload_const, OPCODE_iadd, OPCODE_isave } },
+            { OPCODE_iload_iload_const_isub_isave, 4, { OPCODE_iload, OPCODE_iload_const, OPCODE_isub, OPCODE_isave } },
+            { OPCODE_iload_iload_ifeq, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifeq } },
+            { OPCODE_iload_iload_ifneq, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifneq } },
+            { OPCODE_iload_iload_ifleq, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifleq } },
+            { OPCODE_iload_iload_ifgeq, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifgeq } },
+            { OPCODE_iload_iload_ifgreater, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifgreater } },
+            { OPCODE_iload_iload_ifless, 3, { OPCODE_iload, OPCODE_iload, OPCODE_ifless } },
+            { OPCODE_iload_iload_const_ifeq, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifeq } },
+            { OPCODE_iload_iload_const_ifneq, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifneq } },
+            { OPCODE_iload_iload_const_ifleq, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifleq } },
+            { OPCODE_iload_iload_const_ifgeq, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifgeq } },
+            { OPCODE_iload_iload_const_ifgreater, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifgreater } },
+            { OPCODE_iload_iload_const_ifless, 3, { OPCODE_iload, OPCODE_iload_const, OPCODE_ifless } },
+            { OPCODE_iload_iload, 2, { OPCODE_iload, OPCODE_iload } },
+            { OPCODE_iload_iload_const, 2, { OPCODE_iload, OPCODE_iload_const } },
+        };
+
+        static const std::size_t superinstructions_count = sizeof(superinstructions_table) / sizeof(superinstructions_table[0]);
+
+        //returns the description of the superinstruction, or NULL if the opcode is not a fused one
+        inline const superinstruction *find_superinstruction(const int opcode) {
+            for (std::size_t i = 0; i < superinstructions_count; ++i) {
+                if (superinstructions_table[i].opcode_ == opcode) {
+                    return &superinstructions_table[i];
+                }
+            }
+            return NULL;
+        }
+
+        //three-address instruction set of the register machine: the operands are frame slots addressed relative
+        //to the frame pointer, so locals are used in place and temporaries live right below the locals
+        enum REGISTER_OPCODE_KIND {
+            REG_OPCODE_move = 1, //dst, src
+            REG_OPCODE_iconst = 2, //dst, integer value
+            REG_OPCODE_fconst = 3, //dst, index in float constants pool
+            REG_OPCODE_sconst = 4, //dst, index in string constants pool
+
+            REG_OPCODE_iadd = 5, //dst, src1, src2
+            REG_OPCODE_isub = 6,
+            REG_OPCODE_imul = 7,
+            REG_OPCODE_idiv = 8,
+            REG_OPCODE_fadd = 9,
+            REG_OPCODE_fsub = 10,
+            REG_OPCODE_fmul = 11,
+            REG_OPCODE_fdiv = 12,
+
+            REG_OPCODE_inegate = 13, //dst, src
+            REG_OPCODE_fnegate = 14,
+            REG_OPCODE_f2i = 15,
+            REG_OPCODE_i2f = 16,
+
+            REG_OPCODE_ifeq = 17, //src1, src2, target
+            REG_OPCODE_ifneq = 18,
+            REG_OPCODE_ifleq = 19,
+            REG_OPCODE_ifgeq = 20,
+            REG_OPCODE_ifgreater = 21,
+            REG_OPCODE_ifless = 22,
+
+            REG_OPCODE_jz = 23, //src, target
+            REG_OPCODE_jnz = 24, //src, target
+            REG_OPCODE_jmp = 25, //target
+
+            REG_OPCODE_call = 26, //callee's frame pointer, user function index
+            REG_OPCODE_builtin_call = 27, //slot of the first argument, builtin function index
+            REG_OPCODE_ret = 28,
+            REG_OPCODE_ret_value = 29, //slot of the callee frame the value goes to, src
+            REG_OPCODE_halt = 30,
+
+            REG_OPCODE_sadd = 31, //dst, src1, src2
+            REG_OPCODE_seq = 32, //dst, src1, src2
+            REG_OPCODE_scmp = 33, //dst, src1, src2
+
+            REG_OPCODES_COUNT //must be the last one
         };
     }
 }
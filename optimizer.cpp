@@ -0,0 +1,258 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace Freefoil {
+
+    namespace Private {
+
+        static bool is_return(const int opcode) {
+            return opcode == OPCODE_ret or opcode == OPCODE_iret or opcode == OPCODE_fret or opcode == OPCODE_sret;
+        }
+
+        //the compare and branch opcode which jumps exactly when the given one does not
+        static int negate_compare(const int opcode) {
+            switch (opcode) {
+            case OPCODE_ifeq:
+                return OPCODE_ifneq;
+            case OPCODE_ifneq:
+                return OPCODE_ifeq;
+            case OPCODE_ifleq:
+                return OPCODE_ifgreater;
+            case OPCODE_ifgreater:
+                return OPCODE_ifleq;
+            case OPCODE_ifgeq:
+                return OPCODE_ifless;
+            case OPCODE_ifless:
+                return OPCODE_ifgeq;
+            default:
+                return 0;
+            }
+        }
+
+        bool bytecode_optimizer::decode(const Runtime::instructions_stream_t &instructions) {
+            static const std::size_t NO_INDEX = static_cast<std::size_t>(-1);
+
+            code_.clear();
+            vector<std::size_t> index_of(instructions.size(), NO_INDEX);
+            for (std::size_t pos = 0; pos < instructions.size(); pos += 1 + get_operands_count(instructions[pos])) {
+                const int operands_count = get_operands_count(instructions[pos]);
+                if (pos + operands_count >= instructions.size()) {
+                    return false;
+                }
+                instruction new_instruction;
+                new_instruction.opcode_ = instructions[pos];
+                std::fill(new_instruction.operands_, new_instruction.operands_ + MAX_OPERANDS_COUNT, 0);
+                std::copy(&instructions[pos + 1], &instructions[pos + 1] + operands_count, new_instruction.operands_);
+                new_instruction.target_ = pos; //the position is replaced with the index below
+                new_instruction.position_ = pos;
+                new_instruction.removed_ = false;
+                index_of[pos] = code_.size();
+                code_.push_back(new_instruction);
+            }
+
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                instruction &cur = code_[i];
+                if (is_branch(cur.opcode_)) {
+                    //relative offsets are the last operand and are counted from its own byte
+                    const int operands_count = get_operands_count(cur.opcode_);
+                    const std::size_t dst_pos = cur.target_ + operands_count + cur.operands_[operands_count - 1];
+                    if (dst_pos >= instructions.size() or index_of[dst_pos] == NO_INDEX) {
+                        return false;
+                    }
+                    cur.target_ = index_of[dst_pos];
+                }
+            }
+            return true;
+        }
+
+        bool bytecode_optimizer::encode(Runtime::instructions_stream_t &optimized) {
+            //a removed instruction is where the next kept one is, so the jumps to it land there
+            vector<std::size_t> &positions = positions_;
+            positions.assign(code_.size() + 1, 0);
+            std::size_t size = 0;
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                positions[i] = size;
+                if (!code_[i].removed_) {
+                    size += 1 + get_operands_count(code_[i].opcode_);
+                }
+            }
+            positions[code_.size()] = size;
+
+            optimized.clear();
+            optimized.reserve(size);
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                const instruction &cur = code_[i];
+                if (cur.removed_) {
+                    continue;
+                }
+                const int operands_count = get_operands_count(cur.opcode_);
+                optimized.push_back(cur.opcode_);
+                optimized.insert(optimized.end(), cur.operands_, cur.operands_ + operands_count);
+                if (is_branch(cur.opcode_)) {
+                    if (positions[cur.target_] == size) {
+                        return false;
+                    }
+                    const int offset = static_cast<int>(positions[cur.target_]) - static_cast<int>(positions[i] + operands_count);
+                    if (offset < std::numeric_limits<Runtime::BYTE>::min() or offset > std::numeric_limits<Runtime::BYTE>::max()) {
+                        return false;
+                    }
+                    optimized.back() = offset;
+                }
+            }
+            return true;
+        }
+
+        //the instruction which actually runs when the control gets to the given one
+        std::size_t bytecode_optimizer::resolve(std::size_t index) const {
+            while (index < code_.size() and code_[index].removed_) {
+                ++index;
+            }
+            return index;
+        }
+
+        //the instruction which follows the given one
+        std::size_t bytecode_optimizer::next(const std::size_t index) const {
+            return resolve(index + 1);
+        }
+
+        void bytecode_optimizer::count_jumps(vector<std::size_t> &jumps_count) const {
+            jumps_count.assign(code_.size() + 1, 0);
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                if (!code_[i].removed_ and is_branch(code_[i].opcode_)) {
+                    ++jumps_count[resolve(code_[i].target_)];
+                }
+            }
+        }
+
+        //the codegen computes a relation into a bool and then branches on it:
+        //      if<cmp> a; push_false; jmp b; a: push_true; b: jz c; ... c: pop
+        //when nothing else jumps into the sequence, it is the same as branching on the relation directly:
+        //      if<not cmp> c + 1
+        void bytecode_optimizer::fold_compare_branches() {
+            vector<std::size_t> jumps_count;
+            count_jumps(jumps_count);
+
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                instruction &compare = code_[i];
+                if (compare.removed_ or negate_compare(compare.opcode_) == 0) {
+                    continue;
+                }
+                const std::size_t push_false = next(i);
+                const std::size_t jmp = next(push_false);
+                const std::size_t push_true = next(jmp);
+                const std::size_t jz = next(push_true);
+                if (jz >= code_.size() or
+                        code_[push_false].opcode_ != OPCODE_push_false or
+                        code_[jmp].opcode_ != OPCODE_jmp or
+                        code_[push_true].opcode_ != OPCODE_push_true or
+                        code_[jz].opcode_ != OPCODE_jz) {
+                    continue;
+                }
+                if (resolve(compare.target_) != push_true or resolve(code_[jmp].target_) != jz or
+                        jumps_count[push_false] != 0 or jumps_count[jmp] != 0 or jumps_count[push_true] != 1 or jumps_count[jz] != 1) {
+                    continue;
+                }
+                const std::size_t pop = resolve(code_[jz].target_);
+                if (pop >= code_.size() or code_[pop].opcode_ != OPCODE_pop or next(pop) >= code_.size()) {
+                    continue;
+                }
+
+                compare.opcode_ = negate_compare(compare.opcode_);
+                compare.target_ = next(pop);
+                code_[push_false].removed_ = code_[jmp].removed_ = code_[push_true].removed_ = code_[jz].removed_ = true;
+                --jumps_count[pop];
+                ++jumps_count[compare.target_];
+            }
+        }
+
+        //jumps to unconditional jumps go to their destinations at once, unconditional jumps to returns become the returns,
+        //and unconditional jumps to the next instruction are dropped
+        void bytecode_optimizer::thread_jumps() {
+            for (std::size_t i = 0; i < code_.size(); ++i) {
+                instruction &cur = code_[i];
+                if (cur.removed_ or !is_branch(cur.opcode_)) {
+                    continue;
+                }
+                std::size_t target = resolve(cur.target_);
+                //bounded, as the jumps may form a cycle
+                for (std::size_t hops = 0; hops < code_.size() and target < code_.size() and code_[target].opcode_ == OPCODE_jmp; ++hops) {
+                    target = resolve(code_[target].target_);
+                }
+                cur.target_ = target;
+
+                if (cur.opcode_ == OPCODE_jmp and target < code_.size() and is_return(code_[target].opcode_)) {
+                    cur.opcode_ = code_[target].opcode_;
+                } else if (cur.opcode_ == OPCODE_jmp and target == next(i)) {
+                    cur.removed_ = true;
+                }
+            }
+        }
+
+        //replaces the sequences of the superinstructions table with the fused opcodes; a sequence can't be fused if it is
+        //jumped into, but it may be jumped to
+        void bytecode_optimizer::fuse_superinstructions() {
+            vector<std::size_t> jumps_count;
+            count_jumps(jumps_count);
+
+            for (std::size_t index = resolve(0); index < code_.size(); index = next(index)) {
+                for (std::size_t i = 0; i < superinstructions_count; ++i) {
+                    const superinstruction &candidate = superinstructions_table[i];
+
+                    std::size_t parts[4];
+                    bool matches = true;
+                    std::size_t cur = index;
+                    for (std::size_t j = 0; j < candidate.length_ and matches; ++j) {
+                        matches = cur < code_.size() and code_[cur].opcode_ == candidate.pattern_[j] and (j == 0 or jumps_count[cur] == 0);
+                        parts[j] = cur;
+                        cur = matches ? next(cur) : cur;
+                    }
+                    if (!matches) {
+                        continue;
+                    }
+
+                    //the operands of the fused instructions follow in their original order
+                    instruction fused = code_[index];
+                    fused.opcode_ = candidate.opcode_;
+                    int operands_count = 0;
+                    for (std::size_t j = 0; j < candidate.length_; ++j) {
+                        const instruction &part = code_[parts[j]];
+                        const int part_operands_count = get_operands_count(part.opcode_);
+                        std::copy(part.operands_, part.operands_ + part_operands_count, fused.operands_ + operands_count);
+                        operands_count += part_operands_count;
+                        if (is_branch(part.opcode_)) {
+                            fused.target_ = part.target_;
+                        }
+                        code_[parts[j]].removed_ = true;
+                    }
+                    assert(operands_count == get_operands_count(fused.opcode_));
+                    code_[index] = fused;
+                    break;
+                }
+            }
+        }
+
+        void bytecode_optimizer::remap(const Runtime::stack_maps_t &stack_maps, Runtime::stack_maps_t &optimized_stack_maps) const {
+            optimized_stack_maps.clear();
+            std::size_t i = 0;
+            for (Runtime::stack_maps_t::const_iterator map_iter = stack_maps.begin(); map_iter != stack_maps.end(); ++map_iter) {
+                while (i < code_.size() and code_[i].position_ < map_iter->first) {
+                    ++i;
+                }
+                assert(i < code_.size() and code_[i].position_ == map_iter->first and !code_[i].removed_);
+                optimized_stack_maps[positions_[i]] = map_iter->second;
+            }
+        }
+
+        bool bytecode_optimizer::optimize(const Runtime::instructions_stream_t &instructions, Runtime::instructions_stream_t &optimized) {
+            if (!decode(instructions)) {
+                return false;
+            }
+            fold_compare_branches();
+            thread_jumps();
+            fuse_superinstructions();
+            return encode(optimized);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef OPTIMIZER_H_INCLUDED
+#define OPTIMIZER_H_INCLUDED
+
+#include "runtime.h"
+#include "opcodes.h"
+
+#include <vector>
+
+namespace Freefoil {
+
+    namespace Private {
+
+        using std::vector;
+
+        //the optimizing passes over the resolved bytecode of a user function. They work on the code alone, so the codegen
+        //runs them on its output, and the stack VM runs them on the code of its hot functions in the background.
+        //No pass deepens the operand stack or changes the frame, so the optimized code may take over the frames
+        //and the max_stack_depth of the code it is made of.
+        class bytecode_optimizer {
+
+            struct instruction {
+                int opcode_;
+                Runtime::BYTE operands_[MAX_OPERANDS_COUNT];
+                std::size_t target_; //index of the jump destination, if the opcode is a branch
+                std::size_t position_; //in the code given to the optimizer
+                bool removed_;
+            };
+
+            typedef vector<instruction> instructions_t;
+
+            instructions_t code_;
+            vector<std::size_t> positions_; //in the optimized code, by the index of the instruction
+
+            bool decode(const Runtime::instructions_stream_t &instructions);
+            bool encode(Runtime::instructions_stream_t &optimized);
+            std::size_t resolve(std::size_t index) const;
+            std::size_t next(const std::size_t index) const;
+            void count_jumps(vector<std::size_t> &jumps_count) const;
+
+            void fold_compare_branches();
+            void thread_jumps();
+            void fuse_superinstructions();
+        public:
+            //returns false if the code can't be optimized, e.g. if a jump gets out of the reach of its offset
+            bool optimize(const Runtime::instructions_stream_t &instructions, Runtime::instructions_stream_t &optimized);
+
+            //moves the stack maps of the code given to the last optimize() to the positions of the optimized code;
+            //the passes neither drop the safe points nor change the stack at them
+            void remap(const Runtime::stack_maps_t &stack_maps, Runtime::stack_maps_t &optimized_stack_maps) const;
+        };
+    }
+}
+
+#endif // OPTIMIZER_H_INCLUDED
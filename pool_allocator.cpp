@@ -0,0 +1,220 @@
+#include "pool_allocator.h"
+
+#include <cassert>
+
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Freefoil {
+    namespace Runtime {
+
+        pool_allocator::pool_allocator()
+            :mapped_(NULL), large_slabs_(0), large_bytes_(0), mapped_bytes_(0), slabs_released_(0) {
+            //a class per granule up to 16 granules, then four classes per doubling of the size
+            for (std::size_t block_size = GRANULE; block_size <= MAX_SMALL_BYTES; ) {
+                size_class cls;
+                cls.block_size_ = block_size;
+                cls.capacity_ = (SLAB_BYTES - header_size()) / block_size;
+                cls.available_ = NULL;
+                cls.slabs_ = 0;
+                cls.live_blocks_ = 0;
+                classes_.push_back(cls);
+
+                std::size_t step = GRANULE;
+                if (block_size >= 16 * GRANULE) {
+                    std::size_t power = 16 * GRANULE;
+                    while (power * 2 <= block_size) {
+                        power *= 2;
+                    }
+                    step = power / 4;
+                }
+                block_size += step;
+            }
+            assert(classes_.size() <= 256);
+
+            class_of_granules_.resize(MAX_SMALL_BYTES / GRANULE + 1);
+            std::size_t class_index = 0;
+            for (std::size_t granules = 0; granules < class_of_granules_.size(); ++granules) {
+                while (classes_[class_index].block_size_ < granules * GRANULE) {
+                    ++class_index;
+                }
+                class_of_granules_[granules] = static_cast<unsigned char>(class_index);
+            }
+        }
+
+        pool_allocator::~pool_allocator() {
+            while (mapped_ != NULL) {
+                unmap_slab(mapped_);
+            }
+        }
+
+        //the memory of the slab is aligned to SLAB_BYTES, whatever its size
+        pool_allocator::slab *pool_allocator::map_slab(const std::size_t size) {
+#if defined(__unix__)
+            const std::size_t page_size = sysconf(_SC_PAGESIZE);
+            const std::size_t mapped_bytes = (size + page_size - 1) / page_size * page_size;
+            //more than needed is mapped, and the ends beyond the aligned slab are given back
+            void * const mapping = mmap(NULL, mapped_bytes + SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            char * const start = static_cast<char *>(mapping);
+            char * const aligned = reinterpret_cast<char *>((reinterpret_cast<std::size_t>(start) + SLAB_BYTES - 1) & ~(SLAB_BYTES - 1));
+            if (aligned != start) {
+                munmap(start, aligned - start);
+            }
+            munmap(aligned + mapped_bytes, start + SLAB_BYTES - aligned);
+            slab * const s = reinterpret_cast<slab *>(aligned);
+            s->mapping_ = aligned;
+#else
+            const std::size_t mapped_bytes = size;
+            void * const mapping = std::malloc(mapped_bytes + SLAB_BYTES);
+            if (mapping == NULL) {
+                throw std::bad_alloc();
+            }
+            slab * const s = reinterpret_cast<slab *>((reinterpret_cast<std::size_t>(mapping) + SLAB_BYTES - 1) & ~(SLAB_BYTES - 1));
+            s->mapping_ = mapping;
+#endif
+            s->mapped_bytes_ = mapped_bytes;
+            s->next_ = s->prev_ = NULL;
+            s->prev_mapped_ = NULL;
+            s->next_mapped_ = mapped_;
+            if (mapped_ != NULL) {
+                mapped_->prev_mapped_ = s;
+            }
+            mapped_ = s;
+            mapped_bytes_ += mapped_bytes;
+            return s;
+        }
+
+        void pool_allocator::unmap_slab(slab *s) {
+            if (s->prev_mapped_ != NULL) {
+                s->prev_mapped_->next_mapped_ = s->next_mapped_;
+            } else {
+                mapped_ = s->next_mapped_;
+            }
+            if (s->next_mapped_ != NULL) {
+                s->next_mapped_->prev_mapped_ = s->prev_mapped_;
+            }
+            mapped_bytes_ -= s->mapped_bytes_;
+#if defined(__unix__)
+            munmap(s->mapping_, s->mapped_bytes_);
+#else
+            std::free(s->mapping_);
+#endif
+        }
+
+        void pool_allocator::link(size_class &cls, slab *s) {
+            s->prev_ = NULL;
+            s->next_ = cls.available_;
+            if (cls.available_ != NULL) {
+                cls.available_->prev_ = s;
+            }
+            cls.available_ = s;
+        }
+
+        void pool_allocator::unlink(size_class &cls, slab *s) {
+            if (s->prev_ != NULL) {
+                s->prev_->next_ = s->next_;
+            } else {
+                cls.available_ = s->next_;
+            }
+            if (s->next_ != NULL) {
+                s->next_->prev_ = s->prev_;
+            }
+            s->next_ = s->prev_ = NULL;
+        }
+
+        void *pool_allocator::allocate_large(const std::size_t sz) {
+            slab * const s = map_slab(header_size() + sz);
+            char * const block = reinterpret_cast<char *>(s) + header_size();
+            s->free_ = NULL;
+            s->unused_ = s->end_ = block + sz;
+            s->class_index_ = LARGE_CLASS;
+            s->live_blocks_ = 1;
+            ++large_slabs_;
+            large_bytes_ += sz;
+            return block;
+        }
+
+        //the slow path of allocate(): the first slab of the class has no freed blocks, so the block is carved out
+        //of its unused ones, or out of a new slab if there is none
+        void *pool_allocator::refill(size_class &cls) {
+            slab *s = cls.available_;
+            if (s == NULL) {
+                s = map_slab(SLAB_BYTES);
+                s->free_ = NULL;
+                s->unused_ = reinterpret_cast<char *>(s) + header_size();
+                s->end_ = s->unused_ + cls.capacity_ * cls.block_size_;
+                s->class_index_ = &cls - &classes_[0];
+                s->live_blocks_ = 0;
+                ++cls.slabs_;
+                link(cls, s);
+            }
+            assert(s->free_ == NULL and s->unused_ != s->end_);
+            void * const block = s->unused_;
+            s->unused_ += cls.block_size_;
+            ++s->live_blocks_;
+            ++cls.live_blocks_;
+            if (!has_free_blocks(*s)) {
+                unlink(cls, s);
+            }
+            return block;
+        }
+
+        void pool_allocator::deallocate(void *address) {
+            slab * const s = slab_of(address);
+            if (s->class_index_ == LARGE_CLASS) {
+                --large_slabs_;
+                large_bytes_ -= s->end_ - static_cast<char *>(address);
+                unmap_slab(s);
+                return;
+            }
+            size_class &cls = classes_[s->class_index_];
+            const bool was_full = !has_free_blocks(*s);
+            *static_cast<void **>(address) = s->free_;
+            s->free_ = address;
+            --s->live_blocks_;
+            --cls.live_blocks_;
+            if (was_full) {
+                link(cls, s);
+            }
+        }
+
+        void pool_allocator::release_free_memory() {
+            for (std::vector<size_class>::iterator cls = classes_.begin(); cls != classes_.end(); ++cls) {
+                slab *s = cls->available_;
+                while (s != NULL) {
+                    slab * const next = s->next_;
+                    if (s->live_blocks_ == 0) {
+                        unlink(*cls, s);
+                        unmap_slab(s);
+                        --cls->slabs_;
+                        ++slabs_released_;
+                    }
+                    s = next;
+                }
+            }
+        }
+
+        void pool_allocator::get_stats(allocator_stats &stats) const {
+            stats = allocator_stats();
+            stats.live_bytes_ = large_bytes_;
+            stats.mapped_bytes_ = mapped_bytes_;
+            stats.live_allocations_ = large_slabs_;
+            stats.slabs_released_ = slabs_released_;
+            for (std::vector<size_class>::const_iterator cls = classes_.begin(); cls != classes_.end(); ++cls) {
+                allocator_stats::size_class_stats class_stats;
+                class_stats.block_size_ = cls->block_size_;
+                class_stats.slabs_ = cls->slabs_;
+                class_stats.live_blocks_ = cls->live_blocks_;
+                class_stats.capacity_blocks_ = cls->slabs_ * cls->capacity_;
+                stats.classes_.push_back(class_stats);
+                stats.live_bytes_ += cls->live_blocks_ * cls->block_size_;
+                stats.live_allocations_ += cls->live_blocks_;
+            }
+        }
+    }
+}
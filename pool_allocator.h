@@ -0,0 +1,192 @@
+#ifndef POOL_ALLOCATOR_H_INCLUDED
+#define POOL_ALLOCATOR_H_INCLUDED
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+//the old space of the heap is carved out of size-class slabs;
+//define FREEFOIL_NO_POOL_ALLOCATOR to allocate every object with malloc instead, e.g. for memory debuggers
+#if !defined(FREEFOIL_NO_POOL_ALLOCATOR)
+#define FREEFOIL_POOL_ALLOCATOR
+#endif
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::vector;
+
+        //the memory of an allocator at the moment
+        struct allocator_stats {
+            struct size_class_stats {
+                std::size_t block_size_;
+                std::size_t slabs_;
+                std::size_t live_blocks_;
+                std::size_t capacity_blocks_; //of all the slabs of the class
+            };
+
+            std::size_t live_bytes_;     //of the blocks handed out, rounded up to their size classes
+            std::size_t mapped_bytes_;   //taken from the OS, the slab headers and the unused blocks included
+            std::size_t live_allocations_;
+            std::size_t slabs_released_; //since the start
+            vector<size_class_stats> classes_;
+
+            allocator_stats()
+                :live_bytes_(0), mapped_bytes_(0), live_allocations_(0), slabs_released_(0)
+                {}
+
+            //the share of the mapped memory which is not handed out
+            double get_fragmentation() const {
+                return mapped_bytes_ == 0 ? 0.0 : 1.0 - static_cast<double>(live_bytes_) / mapped_bytes_;
+            }
+        };
+
+        //segregated size-class allocator. Small blocks are carved out of slabs, each of which holds blocks of one size
+        //class only: a freed block goes to the free list of its slab, and the slabs with free blocks make a list
+        //per class. Slabs are aligned to their size, so the slab of a block is found by masking its address.
+        //A block too big for the classes gets a slab of its own, with the same header, so that it is freed the same way.
+        //The slabs emptied by a collection stay cached until release_free_memory() returns them to the OS at once.
+        //The allocator belongs to one heap and is not locked: the heaps are not shared between threads, so the whole
+        //allocator already is what a per-thread cache would be, and there is no shared pool behind it to contend for.
+        class pool_allocator {
+
+            pool_allocator(const pool_allocator &);
+            pool_allocator &operator =(const pool_allocator &);
+
+        public:
+            static const std::size_t SLAB_BYTES = 64 * 1024; //also the alignment of the slabs
+            static const std::size_t GRANULE = 2 * sizeof(void *); //the alignment of the blocks
+            static const std::size_t MAX_SMALL_BYTES = 2048; //bigger blocks get slabs of their own
+
+        private:
+            struct slab {
+                slab *next_;   //in the list of the slabs of its class with free blocks
+                slab *prev_;
+                slab *next_mapped_; //in the list of every slab
+                slab *prev_mapped_;
+                void *free_;   //the freed blocks, each pointing to the next one
+                char *unused_; //the blocks beyond are yet to be handed out for the first time
+                char *end_;
+                std::size_t class_index_; //LARGE_CLASS for a slab of one big block
+                std::size_t live_blocks_;
+                std::size_t mapped_bytes_;
+                void *mapping_; //the start of the memory taken from the OS for the slab
+            };
+
+            struct size_class {
+                std::size_t block_size_;
+                std::size_t capacity_; //blocks a slab holds
+                slab *available_;      //the slabs with free blocks
+                std::size_t slabs_;
+                std::size_t live_blocks_;
+            };
+
+            static const std::size_t LARGE_CLASS = static_cast<std::size_t>(-1);
+
+            vector<size_class> classes_;
+            slab *mapped_; //every slab, the full ones and the large ones included
+            vector<unsigned char> class_of_granules_; //the class index by the size in granules, rounded up
+            std::size_t large_slabs_;
+            std::size_t large_bytes_;   //of the big blocks handed out
+            std::size_t mapped_bytes_;
+            std::size_t slabs_released_;
+
+            static std::size_t header_size() {
+                return (sizeof(slab) + GRANULE - 1) & ~(GRANULE - 1);
+            }
+
+            static slab *slab_of(void *address) {
+                return reinterpret_cast<slab *>(reinterpret_cast<std::size_t>(address) & ~(SLAB_BYTES - 1));
+            }
+
+            static bool has_free_blocks(const slab &s) {
+                return s.free_ != NULL or s.unused_ != s.end_;
+            }
+
+            slab *map_slab(const std::size_t size);
+            void unmap_slab(slab *s);
+            void link(size_class &cls, slab *s);
+            void unlink(size_class &cls, slab *s);
+            void *allocate_large(const std::size_t sz);
+            void *refill(size_class &cls);
+
+        public:
+            pool_allocator();
+            ~pool_allocator();
+
+            void *allocate(const std::size_t sz) {
+                if (sz > MAX_SMALL_BYTES) {
+                    return allocate_large(sz);
+                }
+                size_class &cls = classes_[class_of_granules_[(sz + GRANULE - 1) / GRANULE]];
+                slab * const s = cls.available_;
+                if (s == NULL or s->free_ == NULL) {
+                    return refill(cls);
+                }
+                void * const block = s->free_;
+                s->free_ = *static_cast<void **>(block);
+                ++s->live_blocks_;
+                ++cls.live_blocks_;
+                if (!has_free_blocks(*s)) {
+                    unlink(cls, s);
+                }
+                return block;
+            }
+
+            void deallocate(void *address);
+
+            //returns the slabs with no blocks in use to the OS
+            void release_free_memory();
+
+            void get_stats(allocator_stats &stats) const;
+        };
+
+        //every block straight from malloc, so that the tools which watch malloc see each object
+        class malloc_allocator {
+
+            malloc_allocator(const malloc_allocator &);
+            malloc_allocator &operator =(const malloc_allocator &);
+
+            std::size_t live_allocations_;
+        public:
+            malloc_allocator()
+                :live_allocations_(0)
+                {}
+
+            void *allocate(const std::size_t sz) {
+                void * const address = std::malloc(sz);
+                if (address == NULL) {
+                    throw std::bad_alloc();
+                }
+                ++live_allocations_;
+                return address;
+            }
+
+            void deallocate(void *address) {
+                --live_allocations_;
+                std::free(address);
+            }
+
+            void release_free_memory() {
+            }
+
+            //malloc doesn't tell the sizes, so only the allocations are counted
+            void get_stats(allocator_stats &stats) const {
+                stats = allocator_stats();
+                stats.live_allocations_ = live_allocations_;
+            }
+        };
+
+        //the allocator of the heaps is chosen at build time rather than at run time, so that the allocations of
+        //the old space don't branch on it; a build with FREEFOIL_NO_POOL_ALLOCATOR is the one to debug with
+#if defined(FREEFOIL_POOL_ALLOCATOR)
+        typedef pool_allocator heap_allocator;
+#else
+        typedef malloc_allocator heap_allocator;
+#endif
+    }
+}
+
+#endif // POOL_ALLOCATOR_H_INCLUDED
@@ -2,10 +2,16 @@
 #define RUNTIME_H_INCLUDED
 
 #include <vector>
+#include <map>
 #include <string>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <limits>
 
+#include <boost/cstdint.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace Freefoil {
 
@@ -23,6 +29,9 @@ namespace Freefoil {
         static const WORD max_word_value = std::numeric_limits<WORD>::max();
         static const ULONG max_long_value = std::numeric_limits<ULONG>::max();
 
+        //the constants of a program, each of which is stored once, in the dense table of its type which the bytecode
+        //indexes; the compiler finds the index of a constant through the hash index of its table, which is keyed by the
+        //bit pattern of the floats, so that -0.0 is not taken for 0.0 and a NaN is found again
         class constants_pool {
 
             typedef vector<int> int_table_t;
@@ -33,47 +42,56 @@ namespace Freefoil {
             float_table_t float_table_;
             string_table_t string_table_;
 
+            boost::unordered_map<int, std::ptrdiff_t> int_index_;
+            boost::unordered_map<boost::uint32_t, std::ptrdiff_t> float_index_;
+            boost::unordered_map<string, std::ptrdiff_t> string_index_;
+
+            static boost::uint32_t get_bits(const float f) {
+                boost::uint32_t bits;
+                std::memcpy(&bits, &f, sizeof(bits));
+                return bits;
+            }
+
+            template <typename index_t, typename key_t>
+            static std::ptrdiff_t find_index(const index_t &index, const key_t &key) {
+                const typename index_t::const_iterator index_iter = index.find(key);
+                assert(index_iter != index.end());
+                return index_iter->second;
+            }
+
+            //the index of the constant, which is added to the table unless it is there already
+            template <typename index_t, typename table_t>
+            static std::ptrdiff_t add_constant(index_t &index, const typename index_t::key_type &key, table_t &table, const typename table_t::value_type &value) {
+                const std::pair<typename index_t::iterator, bool> insertion = index.insert(typename index_t::value_type(key, table.size()));
+                if (insertion.second) {
+                    table.push_back(value);
+                }
+                return insertion.first->second;
+            }
+
         public:
             std::ptrdiff_t get_index_of_string_constant(const std::string &str) const {
-                assert(std::count(string_table_.begin(), string_table_.end(), str) == 1);
-                return std::distance(string_table_.begin(), std::find(string_table_.begin(), string_table_.end(), str));
+                return find_index(string_index_, str);
             }
 
             std::ptrdiff_t get_index_of_float_constant(const float f) const {
-                assert(std::count(float_table_.begin(), float_table_.end(), f) == 1);
-                return std::distance(float_table_.begin(), std::find(float_table_.begin(), float_table_.end(), f));
+                return find_index(float_index_, get_bits(f));
             }
 
             std::ptrdiff_t get_index_of_int_constant(const int i) const {
-                assert(std::count(int_table_.begin(), int_table_.end(), i) == 1);
-                return std::distance(int_table_.begin(), std::find(int_table_.begin(), int_table_.end(), i));
+                return find_index(int_index_, i);
             }
 
             std::ptrdiff_t add_int_constant(const int i) {
-                if (std::count(int_table_.begin(), int_table_.end(), i) == 0) {
-                    int_table_.push_back(i);
-                    return int_table_.size() - 1;
-                } else {
-                    return get_index_of_int_constant(i);
-                }
+                return add_constant(int_index_, i, int_table_, i);
             }
 
             std::ptrdiff_t add_float_constant(const float f) {
-                if (std::count(float_table_.begin(), float_table_.end(), f) == 0) {
-                    float_table_.push_back(f);
-                    return float_table_.size() - 1;
-                } else {
-                    return get_index_of_float_constant(f);
-                }
+                return add_constant(float_index_, get_bits(f), float_table_, f);
             }
 
             std::ptrdiff_t add_string_constant(const std::string &str) {
-                if (std::count(string_table_.begin(), string_table_.end(), str) == 0) {
-                    string_table_.push_back(str);
-                    return string_table_.size() - 1;
-                } else {
-                    return get_index_of_string_constant(str);
-                }
+                return add_constant(string_index_, str, string_table_, str);
             }
 
             int get_int_value_from_table(const std::size_t index) const {
@@ -87,38 +105,121 @@ namespace Freefoil {
             const char *get_string_value_from_table(const std::size_t index) const {
                 return string_table_[index].c_str();
             }
+
+            std::size_t get_string_constants_count() const {
+                return string_table_.size();
+            }
         };
 
         typedef vector<BYTE> instructions_stream_t;
 
+        //which operand stack slots hold gcobject pointers before an instruction, from the deepest one up
+        typedef vector<bool> stack_map_t;
+        //the stack maps of a function at its GC safe points, the instructions which may allocate and the calls,
+        //by the positions of the instructions
+        typedef std::map<std::size_t, stack_map_t> stack_maps_t;
+
         class freefoil_vm;
+        class freefoil_register_vm;
+        class aot_translator;
+        class tier_compiler;
+
+        //the types of the params and the return values of the user functions, as the host, which passes and gets
+        //the values, and the builtins which call the user functions by their names check them
+        enum value_type_t {
+            VOID_TYPE,
+            INT_TYPE,
+            FLOAT_TYPE,
+            BOOL_TYPE,
+            STRING_TYPE
+        };
+
+        inline const char *get_type_name(const value_type_t type) {
+            switch (type) {
+            case INT_TYPE:
+                return "an int";
+            case FLOAT_TYPE:
+                return "a float";
+            case BOOL_TYPE:
+                return "a bool";
+            case STRING_TYPE:
+                return "a string";
+            default:
+                return "nothing";
+            }
+        }
 
         class function_template{
             friend class freefoil_vm;
+            friend class freefoil_register_vm;
+            friend class aot_translator;
+            friend class tier_compiler;
 
+            string name_;
             BYTE args_count_;
             BYTE locals_count_;
+            std::size_t max_stack_depth_; //the deepest operand stack, as computed by the bytecode verifier
             instructions_stream_t instructions_;
             bool void_type_; //marks whether or not function returns void
+            value_type_t return_type_;
+            vector<value_type_t> param_types_;
+            stack_maps_t stack_maps_; //as computed by the bytecode verifier
+            vector<int> ref_slots_; //the offsets of the params and locals holding gcobject pointers, as the bytecode addresses them
         public:
-            function_template(const BYTE args_count, const BYTE locals_count, const instructions_stream_t &instructions, const bool void_type)
-                :args_count_(args_count), locals_count_(locals_count), instructions_(instructions), void_type_(false)
+            function_template(const string &name, const vector<value_type_t> &param_types, const BYTE locals_count, const std::size_t max_stack_depth, const instructions_stream_t &instructions, const value_type_t return_type,
+                              const stack_maps_t &stack_maps = stack_maps_t(), const vector<int> &ref_slots = vector<int>())
+                :name_(name), args_count_(static_cast<BYTE>(param_types.size())), locals_count_(locals_count), max_stack_depth_(max_stack_depth), instructions_(instructions), void_type_(return_type == VOID_TYPE), return_type_(return_type),
+                 param_types_(param_types), stack_maps_(stack_maps), ref_slots_(ref_slots)
                 {}
+
+            const vector<value_type_t> &get_param_types() const {
+                return param_types_;
+            }
         };
 
         typedef vector<function_template> function_templates_vector_t;
 
         class program_entry{
             friend class freefoil_vm;
+            friend class freefoil_register_vm;
+            friend class aot_translator;
+            friend class tier_compiler;
 
             function_templates_vector_t user_funcs_;
             constants_pool constants_pool_;
             ULONG entry_point_func_index_;
             BYTE args_count_; //TODO:
+            std::size_t id_;
+
+            program_entry &operator =(const program_entry &);
+
+            //no two programs get the same id, not even one freed and the one made at its address later
+            static std::size_t next_id() {
+                static std::size_t last_id = 0;
+#if defined(__GNUC__)
+                return __sync_add_and_fetch(&last_id, 1);
+#else
+                return ++last_id;
+#endif
+            }
         public:
             program_entry(const function_templates_vector_t& user_funcs, const constants_pool &constants, const ULONG entry_point_func_index, const BYTE args_count = 0)
-                :user_funcs_(user_funcs), constants_pool_(constants), entry_point_func_index_(entry_point_func_index), args_count_(args_count)
+                :user_funcs_(user_funcs), constants_pool_(constants), entry_point_func_index_(entry_point_func_index), args_count_(args_count), id_(next_id())
                 {}
+
+            program_entry(const program_entry &other)
+                :user_funcs_(other.user_funcs_), constants_pool_(other.constants_pool_), entry_point_func_index_(other.entry_point_func_index_),
+                 args_count_(other.args_count_), id_(next_id())
+                {}
+
+            std::size_t get_id() const {
+                return id_;
+            }
+
+            //the types of the params of the entry point, which the arguments of a run have to have
+            const vector<value_type_t> &get_param_types() const {
+                return user_funcs_[entry_point_func_index_].get_param_types();
+            }
         };
 
         typedef shared_ptr<program_entry> program_entry_shared_ptr;
@@ -3,37 +3,39 @@
 
 #include <string>
 #include <vector>
-
-#include <boost/shared_ptr.hpp>
+#include <cstddef>
 
 namespace Freefoil {
     namespace Private {
 
         using std::string;
         using std::vector;
-        using boost::shared_ptr;
 
+        //the bindings are kept on a stack, in the order they are made, which is the undo log of the scopes: each binding
+        //knows the one of the same name it shadows, so the last one is undone by putting that one back. The names are
+        //found through an open addressing table of the indices of their innermost bindings, with linear probing;
+        //a slot is freed by shifting the rest of its probe run back, so the table needs no tombstones
         template <class value>
         class symbol_table {
 
-            const static size_t SIZE = 256;
-
-            class binding;
-            typedef shared_ptr<binding> binding_shared_ptr;
-            typedef vector<binding_shared_ptr> bindings_shared_ptr_vector_t;
-            bindings_shared_ptr_vector_t bindings_;
+            static const std::size_t NO_BINDING = static_cast<std::size_t>(-1);
+            static const std::size_t MIN_SLOTS_COUNT = 64; //a power of two, as the capacity always is
 
-            class binding {
-                friend class symbol_table;
+            struct binding {
                 string name_;
                 value value_descriptor_;
-                binding_shared_ptr next_binding_;
-            public:
-                binding(const string &the_name, const value &the_value_descriptor, const binding_shared_ptr &the_next_binding)
-                        :name_(the_name), value_descriptor_(the_value_descriptor), next_binding_(the_next_binding)
+                std::size_t hash_;
+                std::size_t shadowed_; //the index of the binding of the same name this one hides, or NO_BINDING
+
+                binding(const string &the_name, const value &the_value_descriptor, const std::size_t the_hash, const std::size_t the_shadowed)
+                        :name_(the_name), value_descriptor_(the_value_descriptor), hash_(the_hash), shadowed_(the_shadowed)
                         {}
             };
 
+            vector<binding> bindings_;
+            vector<std::size_t> slots_; //the indices of the innermost bindings of the names, NO_BINDING in the free slots
+            std::size_t names_count_;   //of the slots in use
+
             static size_t hash(const string &the_string) {
                 size_t result = 0;
                 for (string::const_iterator cur_iter = the_string.begin(), iter_end = the_string.end(); cur_iter != iter_end; ++cur_iter) {
@@ -42,36 +44,107 @@ namespace Freefoil {
                 }
                 return result;
             }
-        public:
-            symbol_table() {
-                bindings_.reserve(SIZE);
-                binding_shared_ptr null_binding;
-                for (size_t i = 0; i < SIZE; ++i) {
-                    bindings_.push_back(null_binding);
+
+            //the slot of the name, or the free slot it would take
+            std::size_t find_slot(const string &the_name, const std::size_t the_hash) const {
+                const std::size_t mask = slots_.size() - 1;
+                std::size_t slot = the_hash & mask;
+                while (slots_[slot] != NO_BINDING) {
+                    const binding &b = bindings_[slots_[slot]];
+                    if (b.hash_ == the_hash and b.name_ == the_name) {
+                        break;
+                    }
+                    slot = (slot + 1) & mask;
                 }
+                return slot;
             }
 
-            size_t insert(const string &the_name, const value& the_value_descriptor) {
-                const size_t index = hash(the_name) % SIZE;
-                bindings_[index] = binding_shared_ptr(new binding(the_name, the_value_descriptor, bindings_[index]));
-                return index;
+            void grow() {
+                vector<std::size_t> old_slots(slots_.size() * 2, NO_BINDING);
+                old_slots.swap(slots_);
+                const std::size_t mask = slots_.size() - 1;
+                for (vector<std::size_t>::const_iterator slot_iter = old_slots.begin(); slot_iter != old_slots.end(); ++slot_iter) {
+                    if (*slot_iter != NO_BINDING) {
+                        std::size_t slot = bindings_[*slot_iter].hash_ & mask;
+                        while (slots_[slot] != NO_BINDING) {
+                            slot = (slot + 1) & mask;
+                        }
+                        slots_[slot] = *slot_iter;
+                    }
+                }
             }
 
-            value *lookup(const string &the_name) const {
-
-                const size_t index = hash(the_name) % SIZE;
-                for (binding_shared_ptr b = bindings_[index]; b != NULL; b = b->next_binding_){
-                    if (the_name == b->name_){
-                        return &(b->value_descriptor_);
+            //frees the slot, moving back the names of the probe run after it which may take it
+            void free_slot(std::size_t slot) {
+                const std::size_t mask = slots_.size() - 1;
+                std::size_t next = (slot + 1) & mask;
+                while (slots_[next] != NO_BINDING) {
+                    const std::size_t home = bindings_[slots_[next]].hash_ & mask;
+                    //the name at next may move to slot unless its home lies cyclically in (slot, next]
+                    if (((next - home) & mask) >= ((next - slot) & mask)) {
+                        slots_[slot] = slots_[next];
+                        slot = next;
                     }
+                    next = (next + 1) & mask;
+                }
+                slots_[slot] = NO_BINDING;
+                --names_count_;
+            }
+        public:
+            symbol_table()
+                :slots_(MIN_SLOTS_COUNT, NO_BINDING), names_count_(0) {
+            }
+
+            //the count of the bindings, which undo() takes back to the count of an earlier time
+            std::size_t size() const {
+                return bindings_.size();
+            }
+
+            //binds the name, unless it has been bound since the first_binding-th binding was made
+            bool insert(const string &the_name, const value &the_value_descriptor, const std::size_t first_binding = 0) {
+                if ((names_count_ + 1) * 2 > slots_.size()) {
+                    grow();
+                }
+                const std::size_t the_hash = hash(the_name);
+                const std::size_t slot = find_slot(the_name, the_hash);
+                const std::size_t shadowed = slots_[slot];
+                if (shadowed != NO_BINDING and shadowed >= first_binding) {
+                    return false;
                 }
-                return NULL; //not found
-           }
+                if (shadowed == NO_BINDING) {
+                    ++names_count_;
+                }
+                bindings_.push_back(binding(the_name, the_value_descriptor, the_hash, shadowed));
+                slots_[slot] = bindings_.size() - 1;
+                return true;
+            }
+
+            //the value of the innermost binding of the name, which holds until the next insert
+            const value *lookup(const string &the_name) const {
+                const std::size_t index = slots_[find_slot(the_name, hash(the_name))];
+                return index != NO_BINDING ? &bindings_[index].value_descriptor_ : NULL;
+            }
 
-            void pop_buckets_head(const size_t the_index){
-                bindings_[the_index] = (*bindings_[the_index]).next_binding_;
+            //undoes the bindings made since there were the count of them
+            void undo(const std::size_t count) {
+                while (bindings_.size() > count) {
+                    const binding &b = bindings_.back();
+                    const std::size_t slot = find_slot(b.name_, b.hash_);
+                    if (b.shadowed_ != NO_BINDING) {
+                        slots_[slot] = b.shadowed_;
+                    } else {
+                        free_slot(slot);
+                    }
+                    bindings_.pop_back();
+                }
             }
         };
+
+        template <class value>
+        const std::size_t symbol_table<value>::NO_BINDING;
+
+        template <class value>
+        const std::size_t symbol_table<value>::MIN_SLOTS_COUNT;
     }
 }
 
@@ -0,0 +1,59 @@
+#!/bin/sh
+#runs each script of tests/backends on every backend: the stack VM in each of its modes, the register VM and the
+#AOT translation, built as "make aot" builds it, and compares what each of them prints past the output of the
+#compiler, followed by its exit code, with the .out file of the script, so that the backends agree with each other
+#usage: tests/run_backends.sh [freefoil binary]
+
+freefoil=${1:-./freefoil}
+dir=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$dir")
+case "$freefoil" in
+/*) ;;
+*) freefoil=$PWD/$freefoil ;;
+esac
+output_file=${TMPDIR:-/tmp}/freefoil_backends.$$
+aot_dir=${TMPDIR:-/tmp}/freefoil_backends_aot.$$
+failed=0
+
+#the runtime the translated scripts link with is built once
+mkdir -p "$aot_dir"
+for source in memory_manager pool_allocator; do
+    if ! ${CXX:-g++} -O2 -I"$root" -c -o "$aot_dir/$source.o" "$root/$source.cpp"; then
+        rm -rf "$aot_dir"
+        exit 1
+    fi
+done
+
+check() {
+    if [ "$output" = "$(cat "$name.out")" ]; then
+        echo "ok $(basename "$name") $1"
+    else
+        echo "FAILED $(basename "$name") $1:"
+        echo "$output"
+        failed=1
+    fi
+}
+
+for script in "$dir"/backends/*.ff; do
+    name=${script%.ff}
+    for options in "" --switch --no-tos --no-jit --register; do
+        "$freefoil" $options "$script" > "$output_file" 2>&1
+        code=$?
+        output=$(awk 'past_compiler { print } /^codegen end$/ { past_compiler = 1 }' "$output_file"; echo "exit $code")
+        check "${options:-default}"
+    done
+
+    if (cd "$aot_dir" && "$freefoil" --aot "$script") > "$output_file" 2>&1 &&
+       ${CXX:-g++} -O2 -DFREEFOIL_AOT_MAIN -I"$root" -o "$aot_dir/script" "$aot_dir/freefoil_aot.cpp" \
+           "$aot_dir/memory_manager.o" "$aot_dir/pool_allocator.o" > "$output_file" 2>&1; then
+        "$aot_dir/script" > "$output_file" 2>&1
+        code=$?
+        output=$(cat "$output_file"; echo "exit $code")
+    else
+        output=$(tail -3 "$output_file"; echo "can't translate it")
+    fi
+    check --aot
+done
+
+rm -rf "$output_file" "$aot_dir"
+exit $failed
@@ -0,0 +1,36 @@
+#!/bin/sh
+#runs each script of tests/scripts and compares what it prints past the output of the compiler, followed by its exit
+#code, with its .out file. The .args file of a script, if any, has the command line to run it with, where $script
+#stands for the script; the output of a script with a .sed file is edited with it first, to drop what changes from
+#run to run
+#usage: tests/run_scripts.sh [freefoil binary]
+
+freefoil=${1:-./freefoil}
+dir=$(dirname "$0")/scripts
+output_file=${TMPDIR:-/tmp}/freefoil_test.$$
+failed=0
+
+for script in "$dir"/*.ff; do
+    name=${script%.ff}
+    args='$script'
+    if [ -f "$name.args" ]; then
+        args=$(cat "$name.args")
+    fi
+    eval "set -- $args"
+    "$freefoil" "$@" > "$output_file" 2>&1
+    code=$?
+    if [ -f "$name.sed" ]; then
+        sed -i -f "$name.sed" "$output_file"
+    fi
+    output=$(awk 'past_compiler { print } /^codegen end$/ { past_compiler = 1 }' "$output_file"; echo "exit $code")
+    if [ "$output" = "$(cat "$name.out")" ]; then
+        echo "ok $(basename "$name")"
+    else
+        echo "FAILED $(basename "$name"):"
+        echo "$output"
+        failed=1
+    fi
+done
+
+rm -f "$output_file"
+exit $failed
@@ -0,0 +1,91 @@
+//checks that the bytecode verifier rejects malformed code, the unreachable parts of it included
+#include "../verifier.h"
+#include "../opcodes.h"
+
+#include <iostream>
+#include <string>
+
+using namespace Freefoil;
+using namespace Freefoil::Private;
+using namespace Freefoil::Runtime;
+
+static int failures_count = 0;
+
+static void check(const string &name, const BYTE *code, const std::size_t size, const bool valid, const string &error = string()) {
+    const function_shared_ptr_list_t no_funcs;
+    bytecode_verifier verifier(no_funcs, no_funcs);
+
+    const instructions_stream_t instructions(code, code + size);
+    std::size_t max_stack_depth;
+    stack_maps_t stack_maps;
+    std::vector<int> ref_slots;
+    const bool result = verifier.verify(instructions, max_stack_depth, stack_maps, ref_slots);
+
+    if (result != valid or (!valid and verifier.get_error().find(error) == string::npos)) {
+        std::cout << "FAILED " << name << ": " << (result ? string("accepted") : verifier.get_error()) << std::endl;
+        ++failures_count;
+    } else {
+        std::cout << "ok " << name << std::endl;
+    }
+}
+
+int main() {
+    //relative offsets are counted from their own byte
+    {
+        const BYTE code[] = {
+            OPCODE_push_true,       //0
+            OPCODE_jz, 3,           //1, to 5, where the tested value is left on the stack
+            OPCODE_jmp, 2,          //3, to 6
+            OPCODE_pop,             //5
+            OPCODE_ret,             //6
+        };
+        check("if else", code, sizeof(code), true);
+    }
+    {
+        //the jmp after a returning branch is never run, its offset is checked all the same
+        const BYTE code[] = {
+            OPCODE_ret,             //0
+            OPCODE_jmp, 50,         //1
+        };
+        check("dead jump past the end", code, sizeof(code), false, "jump past the end");
+    }
+    {
+        const BYTE code[] = {
+            OPCODE_push_true,       //0
+            OPCODE_jz, 2,           //1, to 4, the offset of the iload_const
+            OPCODE_iload_const, 0,  //3
+            OPCODE_pop,             //5
+            OPCODE_ret,             //6
+        };
+        check("jump into an instruction", code, sizeof(code), false, "middle of an instruction");
+    }
+    {
+        //a string along one path meets an int along the other
+        const BYTE code[] = {
+            OPCODE_push_true,       //0
+            OPCODE_jz, 5,           //1, to 7
+            OPCODE_sload_const, 0,  //3
+            OPCODE_jmp, 4,          //5, to 10
+            OPCODE_pop,             //7
+            OPCODE_iload_const, 0,  //8
+            OPCODE_pop,             //10
+            OPCODE_ret,             //11
+        };
+        check("string and int merged", code, sizeof(code), false, "along one path only");
+    }
+    {
+        const BYTE code[] = {
+            OPCODE_push_true,       //0
+            OPCODE_jz, 5,           //1, to 7
+            OPCODE_sload_const, 0,  //3
+            OPCODE_jmp, 4,          //5, to 10
+            OPCODE_pop,             //7
+            OPCODE_sload_const, 1,  //8
+            OPCODE_pop,             //10
+            OPCODE_ret,             //11
+        };
+        check("strings merged", code, sizeof(code), true);
+    }
+
+    return failures_count == 0 ? 0 : 1;
+}
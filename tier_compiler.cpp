@@ -0,0 +1,102 @@
+#include "tier_compiler.h"
+#include "optimizer.h"
+
+namespace Freefoil {
+    namespace Runtime {
+
+        tier_compiler::tier_compiler(const program_entry &program)
+            :program_(program) {
+            function_slot baseline;
+            baseline.state_ = BASELINE;
+            slots_.assign(program_.user_funcs_.size(), baseline);
+#if defined(FREEFOIL_BACKGROUND_TIER)
+            pthread_mutex_init(&mutex_, NULL);
+            pthread_cond_init(&wake_, NULL);
+            worker_started_ = false;
+            stopping_ = false;
+#endif
+        }
+
+        tier_compiler::~tier_compiler() {
+#if defined(FREEFOIL_BACKGROUND_TIER)
+            if (worker_started_) {
+                pthread_mutex_lock(&mutex_);
+                stopping_ = true;
+                pthread_cond_signal(&wake_);
+                pthread_mutex_unlock(&mutex_);
+                pthread_join(worker_, NULL);
+            }
+            pthread_cond_destroy(&wake_);
+            pthread_mutex_destroy(&mutex_);
+#endif
+        }
+
+        //runs on the worker: the program is never changed while the VM runs, so its code is read without locking
+        void tier_compiler::compile(const std::size_t func_index) {
+            function_slot &slot = slots_[func_index];
+            Private::bytecode_optimizer optimizer;
+            bool is_optimized = false;
+            try {
+                const function_template &f = program_.user_funcs_[func_index];
+                is_optimized = optimizer.optimize(f.instructions_, slot.optimized_);
+                if (is_optimized) {
+                    optimizer.remap(f.stack_maps_, slot.optimized_stack_maps_);
+                }
+            } catch (...) {
+                is_optimized = false;
+            }
+            lock();
+            slot.state_ = is_optimized ? OPTIMIZED : FAILED;
+            unlock();
+        }
+
+        void tier_compiler::request(const std::size_t func_index) {
+            lock();
+            if (slots_[func_index].state_ != BASELINE) {
+                unlock();
+                return;
+            }
+            slots_[func_index].state_ = QUEUED;
+#if defined(FREEFOIL_BACKGROUND_TIER)
+            if (!worker_started_) {
+                worker_started_ = pthread_create(&worker_, NULL, &tier_compiler::worker_entry, this) == 0;
+            }
+            if (worker_started_) {
+                queue_.push_back(func_index);
+                pthread_cond_signal(&wake_);
+                unlock();
+                return;
+            }
+#endif
+            unlock();
+            //no worker: the caller waits for the code
+            compile(func_index);
+        }
+
+#if defined(FREEFOIL_BACKGROUND_TIER)
+        void *tier_compiler::worker_entry(void *self) {
+            static_cast<tier_compiler *>(self)->work();
+            return NULL;
+        }
+
+        void tier_compiler::work() {
+            pthread_mutex_lock(&mutex_);
+            for (;;) {
+                while (queue_.empty() and !stopping_) {
+                    pthread_cond_wait(&wake_, &mutex_);
+                }
+                if (stopping_) {
+                    break;
+                }
+                const std::size_t func_index = queue_.front();
+                queue_.pop_front();
+
+                pthread_mutex_unlock(&mutex_);
+                compile(func_index);
+                pthread_mutex_lock(&mutex_);
+            }
+            pthread_mutex_unlock(&mutex_);
+        }
+#endif
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef TIER_COMPILER_H_INCLUDED
+#define TIER_COMPILER_H_INCLUDED
+
+#include "runtime.h"
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+//the optimizing tier compiles on a POSIX thread;
+//define FREEFOIL_NO_BACKGROUND_TIER to compile hot functions on the thread running the VM instead
+#if defined(__unix__) && defined(__GNUC__) && !defined(FREEFOIL_NO_BACKGROUND_TIER)
+#define FREEFOIL_BACKGROUND_TIER
+#endif
+
+#if defined(FREEFOIL_BACKGROUND_TIER)
+#include <pthread.h>
+#endif
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        using std::vector;
+
+        //recompiles the hot functions of a program with the optimizing passes of the codegen.
+        //The VM requests a function once it gets hot and goes on running its baseline code; the worker thread, started
+        //by the first request, optimizes the functions in the order they are requested. The VM polls for the result
+        //at its safe points, so the only state the two threads share is the queue and the state of each function, both
+        //of which the mutex guards; the code of a function is handed over by its state, under the mutex too.
+        class tier_compiler {
+
+            tier_compiler(const tier_compiler &);
+            tier_compiler &operator =(const tier_compiler &);
+
+        public:
+            enum function_state {
+                BASELINE,   //not requested
+                QUEUED,     //requested and being optimized
+                OPTIMIZED,  //the optimized code is ready to be taken
+                TAKEN,      //the optimized code is taken by the VM
+                FAILED      //the optimizer gave up, the baseline code stays
+            };
+
+        private:
+            const program_entry &program_;
+
+            struct function_slot {
+                function_state state_; //the worker fills in the code before it sets OPTIMIZED
+                instructions_stream_t optimized_;
+                stack_maps_t optimized_stack_maps_;
+            };
+
+            vector<function_slot> slots_; //indexed as program_.user_funcs_
+
+            void compile(const std::size_t func_index);
+
+            void lock() const {
+#if defined(FREEFOIL_BACKGROUND_TIER)
+                pthread_mutex_lock(&mutex_);
+#endif
+            }
+
+            void unlock() const {
+#if defined(FREEFOIL_BACKGROUND_TIER)
+                pthread_mutex_unlock(&mutex_);
+#endif
+            }
+
+#if defined(FREEFOIL_BACKGROUND_TIER)
+            std::deque<std::size_t> queue_;
+            mutable pthread_mutex_t mutex_; //of the queue and the states of the functions
+            pthread_cond_t wake_;
+            pthread_t worker_;
+            bool worker_started_;
+            bool stopping_;
+
+            void work();
+            static void *worker_entry(void *self);
+#endif
+        public:
+            explicit tier_compiler(const program_entry &program);
+            ~tier_compiler();
+
+            //queues the function for the optimizing recompile, unless it has been requested already
+            void request(const std::size_t func_index);
+
+            function_state get_state(const std::size_t func_index) const {
+                lock();
+                const function_state state = slots_[func_index].state_;
+                unlock();
+                return state;
+            }
+
+            //hands the optimized code of the function over to the VM; only valid in the OPTIMIZED state
+            void take(const std::size_t func_index, instructions_stream_t &optimized, stack_maps_t &optimized_stack_maps) {
+                assert(get_state(func_index) == OPTIMIZED);
+                optimized.swap(slots_[func_index].optimized_);
+                optimized_stack_maps.swap(slots_[func_index].optimized_stack_maps_);
+                lock();
+                slots_[func_index].state_ = TAKEN;
+                unlock();
+            }
+        };
+    }
+}
+
+#endif // TIER_COMPILER_H_INCLUDED
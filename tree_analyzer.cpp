@@ -25,12 +25,12 @@ namespace Freefoil {
     static void create_attributes(const iter_t &iter, const value_descriptor::E_VALUE_TYPE value_type);
     static void create_attributes(const iter_t &iter, const value_descriptor::E_VALUE_TYPE value_type, const int index);
 
-    bool param_descriptors_types_equal_functor(const param_descriptor &param_descriptor, const param_descriptor &the_param_descriptor) {
-        return 	param_descriptor.get_value_type() == the_param_descriptor.get_value_type();
+    bool param_descriptors_types_equal_functor(const param_descriptor &a_param_descriptor, const param_descriptor &the_param_descriptor) {
+        return 	a_param_descriptor.get_value_type() == the_param_descriptor.get_value_type();
     }
 
-    bool param_descriptors_refs_equal_functor(const param_descriptor &param_descriptor, const param_descriptor &the_param_descriptor) {
-        return 	param_descriptor.is_ref() == the_param_descriptor.is_ref();
+    bool param_descriptors_refs_equal_functor(const param_descriptor &a_param_descriptor, const param_descriptor &the_param_descriptor) {
+        return 	a_param_descriptor.is_ref() == the_param_descriptor.is_ref();
     }
 
     bool function_heads_equal_functor(const function_shared_ptr_t &func, const function_shared_ptr_t &the_func) {
@@ -53,7 +53,7 @@ namespace Freefoil {
     }
 
     //TODO: optimize
-    int tree_analyzer::find_function(const std::string &call_name, const std::vector<value_descriptor::E_VALUE_TYPE> &invoke_args, const function_shared_ptr_list_t &funcs) const {
+    std::ptrdiff_t tree_analyzer::find_function(const std::string &call_name, const std::vector<value_descriptor::E_VALUE_TYPE> &invoke_args, const function_shared_ptr_list_t &funcs) const {
 
         int invoke_args_count = invoke_args.size();
 
@@ -246,6 +246,11 @@ namespace Freefoil {
         return funcs_list_;
     }
 
+    const function_shared_ptr_list_t &tree_analyzer::get_builtin_funcs_list() const {
+
+        return builtin_funcs_list_;
+    }
+
     const constants_pool &tree_analyzer::get_parsed_constants_pool() const {
 
         assert(errors_count_ == 0);
@@ -270,6 +275,42 @@ namespace Freefoil {
         param_descriptors_list.clear();
         param_descriptors_list.push_back(param_descriptor(value_descriptor::stringType, false, "s"));
         builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("print", value_descriptor::voidType, param_descriptors_list)));
+
+        //fibers: spawn starts the user function of the name on a fiber and returns its id, which join waits for
+        param_descriptors_list.clear();
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::stringType, false, "function_name"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("spawn", value_descriptor::intType, param_descriptors_list)));
+
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::intType, false, "arg"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("spawn", value_descriptor::intType, param_descriptors_list)));
+
+        param_descriptors_list.clear();
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("yield", value_descriptor::voidType, param_descriptors_list)));
+
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::intType, false, "fiber"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("join", value_descriptor::voidType, param_descriptors_list)));
+
+        //files: read returns what the file has, a chunk at a time, and the empty string at its end, after which eof
+        //is true; a read which would block parks the fiber making it until the file is ready
+        param_descriptors_list.clear();
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::stringType, false, "path"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("open", value_descriptor::intType, param_descriptors_list)));
+
+        param_descriptors_list.clear();
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::intType, false, "file"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("read", value_descriptor::stringType, param_descriptors_list)));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("eof", value_descriptor::boolType, param_descriptors_list)));
+
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("close", value_descriptor::voidType, param_descriptors_list)));
+
+        //parallel_for runs the user function of the name, which takes an int, for each index of [lo, hi) on the worker
+        //threads, and returns the sum of what it returns: parallel_for the ints, or nothing, parallel_for_float the floats
+        param_descriptors_list.clear();
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::intType, false, "lo"));
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::intType, false, "hi"));
+        param_descriptors_list.push_back(param_descriptor(value_descriptor::stringType, false, "function_name"));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("parallel_for", value_descriptor::intType, param_descriptors_list)));
+        builtin_funcs_list_.push_back(function_shared_ptr_t(new function_descriptor("parallel_for_float", value_descriptor::floatType, param_descriptors_list)));
     }
 
     tree_analyzer::tree_analyzer() :errors_count_(0), curr_parsing_function_(), descriptors_handler_(NULL) {
@@ -752,10 +793,7 @@ namespace Freefoil {
             }
             ++errors_count_;
         } else {
-            if (iter_value_type == value_descriptor::intType and parse_str(iter) == "/"){
-                iter_value_type = value_descriptor::floatType;
-            }
-
+            //the quotient of two ints is an int, as idiv leaves it
             if (iter_value_type != left_value_type) {
                 create_cast(left_iter, iter_value_type);
             }
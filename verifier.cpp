@@ -0,0 +1,274 @@
+#include "verifier.h"
+#include "opcodes.h"
+
+#include <vector>
+#include <set>
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+
+namespace Freefoil {
+
+    namespace Private {
+
+        bytecode_verifier::bytecode_verifier(const function_shared_ptr_list_t &user_funcs, const function_shared_ptr_list_t &builtin_funcs)
+            :user_funcs_(user_funcs), builtin_funcs_(builtin_funcs) {
+        }
+
+        bool bytecode_verifier::fail(const std::size_t pos, const string &msg) {
+            error_ = msg + " at " + boost::lexical_cast<string>(pos);
+            return false;
+        }
+
+        //how many values the opcode pops and then pushes; for jz and jnz the effect on the fall through path
+        bool bytecode_verifier::get_stack_effect(const int opcode, const Runtime::BYTE *operands, int &pops, int &pushes) const {
+            switch (opcode) {
+            case OPCODE_iload:
+            case OPCODE_fload:
+            case OPCODE_sload:
+            case OPCODE_iload_const:
+            case OPCODE_fload_const:
+            case OPCODE_sload_const:
+            case OPCODE_push_true:
+            case OPCODE_push_false:
+                pops = 0;
+                pushes = 1;
+                return true;
+            case OPCODE_isave:
+            case OPCODE_fsave:
+            case OPCODE_ssave:
+            case OPCODE_jz:
+            case OPCODE_jnz:
+            case OPCODE_pop:
+            case OPCODE_iret:
+            case OPCODE_fret:
+            case OPCODE_sret:
+                pops = 1;
+                pushes = 0;
+                return true;
+            case OPCODE_iadd:
+            case OPCODE_fadd:
+            case OPCODE_sadd:
+            case OPCODE_isub:
+            case OPCODE_fsub:
+            case OPCODE_imul:
+            case OPCODE_fmul:
+            case OPCODE_idiv:
+            case OPCODE_fdiv:
+            case OPCODE_xor:
+            case OPCODE_seq:
+            case OPCODE_scmp:
+                pops = 2;
+                pushes = 1;
+                return true;
+            case OPCODE_inegate:
+            case OPCODE_fnegate:
+            case OPCODE_b2str:
+            case OPCODE_b2f:
+            case OPCODE_f2i:
+            case OPCODE_i2str:
+            case OPCODE_i2f:
+                pops = 1;
+                pushes = 1;
+                return true;
+            case OPCODE_ifeq:
+            case OPCODE_ifneq:
+            case OPCODE_ifleq:
+            case OPCODE_ifgeq:
+            case OPCODE_ifgreater:
+            case OPCODE_ifless:
+                pops = 2;
+                pushes = 0;
+                return true;
+            case OPCODE_jmp:
+            case OPCODE_halt:
+            case OPCODE_ret:
+                pops = 0;
+                pushes = 0;
+                return true;
+            case OPCODE_call:
+            case OPCODE_tailcall:
+            case OPCODE_builtin_call: {
+                const function_shared_ptr_list_t &funcs = opcode == OPCODE_builtin_call ? builtin_funcs_ : user_funcs_;
+                const std::size_t func_index = static_cast<unsigned char>(operands[0]);
+                if (func_index >= funcs.size()) {
+                    return false;
+                }
+                pops = funcs[func_index]->get_args_count();
+                pushes = funcs[func_index]->get_type() == value_descriptor::voidType ? 0 : 1;
+                return true;
+            }
+            default:
+                return false;
+            }
+        }
+
+        //whether the value the opcode pushes is a gcobject pointer
+        bool bytecode_verifier::pushes_ref(const int opcode, const Runtime::BYTE *operands) const {
+            switch (opcode) {
+            case OPCODE_sload:
+            case OPCODE_sload_const:
+            case OPCODE_sadd:
+            case OPCODE_b2str:
+            case OPCODE_i2str:
+                return true;
+            case OPCODE_call:
+            case OPCODE_builtin_call: {
+                const function_shared_ptr_list_t &funcs = opcode == OPCODE_builtin_call ? builtin_funcs_ : user_funcs_;
+                return funcs[static_cast<unsigned char>(operands[0])]->get_type() == value_descriptor::stringType;
+            }
+            default:
+                return false;
+            }
+        }
+
+        //the instructions a collection may happen at: the ones which allocate, the calls, which the frame waits at,
+        //and the instructions a fiber may be switched out at, whose stack is walked while it waits
+        static bool is_gc_safe_point(const int opcode) {
+            switch (opcode) {
+            case OPCODE_sadd:
+            case OPCODE_b2str:
+            case OPCODE_i2str:
+            case OPCODE_call:
+            case OPCODE_tailcall:
+            case OPCODE_builtin_call:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        bool bytecode_verifier::verify(const Runtime::instructions_stream_t &instructions, std::size_t &max_stack_depth,
+                                       Runtime::stack_maps_t &stack_maps, std::vector<int> &ref_slots) {
+
+            const std::size_t size = instructions.size();
+
+            //the positions instructions start at
+            std::vector<bool> is_instruction(size, false);
+            for (std::size_t pos = 0; pos < size; pos += 1 + get_operands_count(instructions[pos])) {
+                if (pos + get_operands_count(instructions[pos]) >= size) {
+                    return fail(pos, "truncated instruction");
+                }
+                is_instruction[pos] = true;
+            }
+            //every jump is checked, the ones in unreachable code too, since the code is decoded as a whole
+            for (std::size_t pos = 0; pos < size; pos += 1 + get_operands_count(instructions[pos])) {
+                if (is_branch(instructions[pos])) {
+                    const std::size_t offset_pos = pos + get_operands_count(instructions[pos]);
+                    const std::size_t dst_pos = offset_pos + instructions[offset_pos];
+                    if (dst_pos >= size) {
+                        return fail(pos, "jump past the end of the function");
+                    }
+                    if (!is_instruction[dst_pos]) {
+                        return fail(pos, "jump into the middle of an instruction");
+                    }
+                }
+            }
+
+            std::vector<bool> is_reached(size, false);
+            std::vector<Runtime::stack_map_t> refs(size); //the operand stack before the instruction, its depth is the size
+            std::vector<std::size_t> pending;           //reached instructions to be checked
+            std::set<int> ref_slots_set;
+
+            std::size_t max_depth = 0;
+
+            is_reached[0] = true;
+            pending.push_back(0);
+            while (!pending.empty()) {
+                const std::size_t pos = pending.back();
+                pending.pop_back();
+
+                const int opcode = instructions[pos];
+                const int operands_count = get_operands_count(opcode);
+                const Runtime::BYTE *operands = &instructions[pos + 1];
+
+                //fused instructions have the effect of their parts applied in order
+                const superinstruction *fused = find_superinstruction(opcode);
+                const int *parts = fused != NULL ? fused->pattern_ : &opcode;
+                const std::size_t parts_count = fused != NULL ? fused->length_ : 1;
+
+                Runtime::stack_map_t stack = refs[pos];
+                bool tested_ref = false; //the value jz and jnz leave on the stack when they jump
+                for (std::size_t i = 0; i < parts_count; ++i) {
+                    int pops, pushes;
+                    if (!get_stack_effect(parts[i], operands, pops, pushes)) {
+                        return fail(pos, "wrong opcode " + boost::lexical_cast<string>(parts[i]));
+                    }
+                    if (stack.size() < static_cast<std::size_t>(pops)) {
+                        return fail(pos, "stack underflow");
+                    }
+                    if (parts[i] == OPCODE_sload or parts[i] == OPCODE_ssave) {
+                        ref_slots_set.insert(operands[0]);
+                    }
+                    if (pops > 0) {
+                        tested_ref = stack.back();
+                    }
+                    stack.resize(stack.size() - pops);
+                    stack.resize(stack.size() + pushes, pushes_ref(parts[i], operands));
+                    max_depth = std::max(max_depth, stack.size());
+                    operands += get_operands_count(parts[i]);
+                }
+
+                //the successors and the stacks they are reached with
+                std::size_t successors[2];
+                Runtime::stack_map_t successor_stacks[2];
+                std::size_t successors_count = 0;
+
+                const int last_part = parts[parts_count - 1];
+                if (is_branch(opcode)) {
+                    const std::size_t dst_pos = pos + operands_count + instructions[pos + operands_count];
+                    successors[successors_count] = dst_pos;
+                    successor_stacks[successors_count] = stack;
+                    //jz and jnz leave the tested value on the stack when they jump
+                    if (last_part == OPCODE_jz or last_part == OPCODE_jnz) {
+                        successor_stacks[successors_count].push_back(tested_ref);
+                        max_depth = std::max(max_depth, successor_stacks[successors_count].size());
+                    }
+                    ++successors_count;
+                }
+                switch (last_part) {
+                case OPCODE_jmp:
+                case OPCODE_halt:
+                case OPCODE_ret:
+                case OPCODE_iret:
+                case OPCODE_fret:
+                case OPCODE_sret:
+                case OPCODE_tailcall:
+                    break;
+                default:
+                    if (pos + 1 + operands_count >= size) {
+                        return fail(pos, "control reaches the end of the function");
+                    }
+                    successors[successors_count] = pos + 1 + operands_count;
+                    successor_stacks[successors_count++] = stack;
+                    break;
+                }
+
+                for (std::size_t i = 0; i < successors_count; ++i) {
+                    Runtime::stack_map_t &successor_stack = refs[successors[i]];
+                    if (!is_reached[successors[i]]) {
+                        is_reached[successors[i]] = true;
+                        successor_stack = successor_stacks[i];
+                        pending.push_back(successors[i]);
+                    } else if (successor_stack.size() != successor_stacks[i].size()) {
+                        return fail(successors[i], "stack depth mismatch");
+                    } else if (successor_stack != successor_stacks[i]) {
+                        //the collector has to know whether a slot holds a pointer whichever path the code took
+                        return fail(successors[i], "stack slot holds a string along one path only");
+                    }
+                }
+            }
+
+            stack_maps.clear();
+            for (std::size_t pos = 0; pos < size; ++pos) {
+                if (is_reached[pos] and is_gc_safe_point(instructions[pos])) {
+                    stack_maps[pos] = refs[pos];
+                }
+            }
+            ref_slots.assign(ref_slots_set.begin(), ref_slots_set.end());
+
+            max_stack_depth = max_depth;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef VERIFIER_H_INCLUDED
+#define VERIFIER_H_INCLUDED
+
+#include "function_descriptor.h"
+#include "runtime.h"
+
+#include <string>
+#include <vector>
+
+namespace Freefoil {
+
+    namespace Private {
+
+        using std::string;
+
+        //checks the code of a user function after its jumps are resolved: every instruction has to be reached with the same
+        //operand stack depth along every control flow path, no path may pop more than there is on the stack or run past the
+        //end of the function, every jump, reachable or not, has to land on an instruction, and the paths which meet have to
+        //agree on which stack slots hold strings. Verified code needs no stack checks at runtime other than one for the
+        //deepest operand stack at the function entry.
+        class bytecode_verifier {
+
+            const function_shared_ptr_list_t &user_funcs_;
+            const function_shared_ptr_list_t &builtin_funcs_;
+            string error_;
+
+            bool get_stack_effect(const int opcode, const Runtime::BYTE *operands, int &pops, int &pushes) const;
+            bool pushes_ref(const int opcode, const Runtime::BYTE *operands) const;
+            bool fail(const std::size_t pos, const string &msg);
+        public:
+            bytecode_verifier(const function_shared_ptr_list_t &user_funcs, const function_shared_ptr_list_t &builtin_funcs);
+
+            //on success stores the deepest operand stack of the function, locals aside, and where the function keeps
+            //gcobject pointers: the stack maps of its GC safe points, and the params and locals loaded and saved as strings
+            bool verify(const Runtime::instructions_stream_t &instructions, std::size_t &max_stack_depth,
+                        Runtime::stack_maps_t &stack_maps, std::vector<int> &ref_slots);
+
+            const string &get_error() const {
+                return error_;
+            }
+        };
+    }
+}
+
+#endif // VERIFIER_H_INCLUDED
@@ -0,0 +1,77 @@
+#include "vm_stack.h"
+#include "exceptions.h"
+
+#include <algorithm>
+#include <new>
+
+#if defined(FREEFOIL_RESERVED_STACK)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Freefoil {
+    namespace Runtime {
+
+#if defined(FREEFOIL_RESERVED_STACK)
+
+        static std::size_t round_up_to_page(const std::size_t size) {
+            const std::size_t page_size = sysconf(_SC_PAGESIZE);
+            return (std::max<std::size_t>(size, 1) + page_size - 1) / page_size * page_size;
+        }
+
+        vm_stack::vm_stack(const std::size_t initial_size, const std::size_t max_size) {
+            const std::size_t reserve_size = round_up_to_page(max_size);
+            const std::size_t commit_size = std::min(round_up_to_page(initial_size), reserve_size);
+
+            mapping_size_ = reserve_size;
+            void *mapping = mmap(NULL, mapping_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mapping == MAP_FAILED) {
+                throw freefoil_exception("can't reserve the VM stack");
+            }
+            mapping_ = static_cast<char *>(mapping);
+            end_ = mapping_ + mapping_size_;
+            begin_ = end_ - commit_size;
+            if (mprotect(begin_, commit_size, PROT_READ | PROT_WRITE) != 0) {
+                munmap(mapping_, mapping_size_);
+                throw freefoil_exception("can't commit the VM stack");
+            }
+        }
+
+        vm_stack::~vm_stack() {
+            munmap(mapping_, mapping_size_);
+        }
+
+        bool vm_stack::grow(const std::size_t size) {
+            if (size > mapping_size_) {
+                return false;
+            }
+            const std::size_t committed_size = end_ - begin_;
+            if (size <= committed_size) {
+                return true;
+            }
+            const std::size_t new_size = std::min(round_up_to_page(std::max(size, 2 * committed_size)), mapping_size_);
+            char * const new_begin = end_ - new_size;
+            if (mprotect(new_begin, begin_ - new_begin, PROT_READ | PROT_WRITE) != 0) {
+                return false;
+            }
+            begin_ = new_begin;
+            return true;
+        }
+
+#else
+
+        vm_stack::vm_stack(const std::size_t, const std::size_t max_size)
+            :mapping_(new char[max_size]), mapping_size_(max_size), begin_(mapping_), end_(mapping_ + max_size) {
+        }
+
+        vm_stack::~vm_stack() {
+            delete [] mapping_;
+        }
+
+        bool vm_stack::grow(const std::size_t size) {
+            return size <= mapping_size_;
+        }
+
+#endif
+    }
+}
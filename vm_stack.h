@@ -0,0 +1,50 @@
+#ifndef VM_STACK_H_INCLUDED
+#define VM_STACK_H_INCLUDED
+
+#include <cstddef>
+
+//reserved stacks rely on mmap/mprotect;
+//define FREEFOIL_NO_RESERVED_STACK to allocate the whole stack up front
+#if defined(__unix__) && !defined(FREEFOIL_NO_RESERVED_STACK)
+#define FREEFOIL_RESERVED_STACK
+#endif
+
+namespace Freefoil {
+
+    namespace Runtime {
+
+        //memory of a VM stack, growing down from end().
+        //A reserved stack reserves max_size bytes of address space, but only the pages in use are committed: the VM
+        //checks the room a frame needs against begin(), the lowest committed byte, and calls grow() for more once it
+        //runs out, so the stack is never touched past what is committed, and no signal is involved.
+        //An unreserved stack is allocated in full at once, and never grows.
+        class vm_stack {
+
+            vm_stack(const vm_stack &);
+            vm_stack &operator =(const vm_stack &);
+
+            char *mapping_;         //start of the whole mapping
+            std::size_t mapping_size_;
+            char *begin_;           //lowest committed byte
+            char *end_;
+
+        public:
+            vm_stack(const std::size_t initial_size, const std::size_t max_size);
+            ~vm_stack();
+
+            char *begin() const {
+                return begin_;
+            }
+
+            char *end() const {
+                return end_;
+            }
+
+            //commits the pages so that at least size bytes below end() are usable; the committed part at least doubles,
+            //so that deep recursion grows it a logarithmic number of times. Returns false if size is past the reserve
+            bool grow(const std::size_t size);
+        };
+    }
+}
+
+#endif // VM_STACK_H_INCLUDED